@@ -0,0 +1,240 @@
+#include "batch_runner.h"
+#include <thread>
+#include <chrono>
+
+BatchRunner::BatchRunner(size_t instance_count, unsigned thread_count)
+    : instance_count(instance_count), thread_count(thread_count), rom_location(0), load_error(MOS6502::LOAD_OK),
+      unfinished(0), stop_PC(-1), slice(BATCH_SLICE)
+{
+    instance_stride = (sizeof(MOS6502) + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+    size_t objects = instance_stride * instance_count;
+    void * block;
+    if(posix_memalign(&block, CACHE_LINE_SIZE, objects + instance_count * MEMORY_SIZE) != 0)
+    {
+        throw bad_alloc();
+    }
+    arena = (uint8_t *)block;
+    uint8_t * memories = arena + objects;
+    memset(memories, 0, instance_count * MEMORY_SIZE);
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        // the RESET vector MOS6502() sets up in memory it allocates itself
+        uint8_t * memory = memories + i * MEMORY_SIZE;
+        memory[RESET_LOW] = 0x00;
+        memory[RESET_HIGH] = 0x02;
+        new(arena + i * instance_stride) MOS6502(memory);
+    }
+
+    if(this->thread_count == 0)
+    {
+        this->thread_count = thread::hardware_concurrency();
+    }
+    if(this->thread_count == 0)
+    {
+        this->thread_count = 1;
+    }
+    queues.reset(new WorkQueue[this->thread_count]);
+}
+
+BatchRunner::~BatchRunner()
+{
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        instance(i).~MOS6502();
+    }
+    free(arena);
+}
+
+size_t BatchRunner::size()
+{
+    return instance_count;
+}
+
+MOS6502 & BatchRunner::instance(size_t index)
+{
+    return *reinterpret_cast<MOS6502 *>(arena + index * instance_stride);
+}
+
+uint8_t * BatchRunner::instance_memory(size_t index)
+{
+    return arena + instance_count * instance_stride + index * MEMORY_SIZE;
+}
+
+// point the pages of the current image back at the instance's own RAM
+void BatchRunner::unmap_shared(size_t index)
+{
+    if(rom)
+    {
+        uint32_t size = (rom->size() + PAGE_SIZE - 1) & ~(uint32_t)LOW_BYTE;
+        instance(index).map_memory(rom_location, size, instance_memory(index) + rom_location, true);
+    }
+}
+
+bool BatchRunner::load(string filename, uint16_t location)
+{
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        if(!instance(i).load(filename, location))
+        {
+            load_error = instance(i).get_load_error();
+            return false;
+        }
+    }
+    load_error = MOS6502::LOAD_OK;
+    return true;
+}
+
+bool BatchRunner::load_shared(string filename, uint16_t location)
+{
+    // the instances keep reading the old image until they are remapped
+    unique_ptr<RomImage> image(new RomImage());
+    if(!image->open(filename))
+    {
+        load_error = image->get_error();
+        return false;
+    }
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        unmap_shared(i);
+        if(!instance(i).map_rom(*image, location))
+        {
+            // map_rom() only checks the image and location, so this is the
+            // first instance and the rest still have the old image
+            load_error = instance(i).get_load_error();
+            if(rom)
+            {
+                instance(i).map_rom(*rom, rom_location);
+            }
+            return false;
+        }
+    }
+    rom.swap(image); // the old image closes as image goes out of scope
+    rom_location = location;
+    load_error = MOS6502::LOAD_OK;
+    return true;
+}
+
+MOS6502::LoadError BatchRunner::get_load_error()
+{
+    return load_error;
+}
+
+void BatchRunner::reset()
+{
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        instance(i).reset();
+    }
+}
+
+void BatchRunner::set_slice(uint64_t instructions)
+{
+    slice = (instructions > 0) ? instructions : 1;
+}
+
+BatchRunner::Report BatchRunner::run(uint64_t steps)
+{
+    return run_all(steps, -1);
+}
+
+BatchRunner::Report BatchRunner::run(uint64_t steps, uint16_t stop_PC)
+{
+    return run_all(steps, stop_PC);
+}
+
+BatchRunner::Report BatchRunner::run_all(uint64_t steps, int32_t stop)
+{
+    Report report;
+    report.reasons.assign(instance_count, MOS6502::STOP_NONE);
+    report.instructions = 0;
+
+    stop_PC = stop;
+    remaining.assign(instance_count, steps);
+    unfinished = instance_count;
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        queues[i % thread_count].tasks.push_back(i);
+    }
+
+    uint64_t start_count = 0;
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        start_count += instance(i).get_instructions();
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for(unsigned id = 0; id < thread_count; id++)
+    {
+        workers.push_back(thread(&BatchRunner::worker, this, id, &report));
+    }
+    for(size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for(size_t i = 0; i < instance_count; i++)
+    {
+        report.instructions += instance(i).get_instructions();
+    }
+    report.instructions -= start_count;
+    report.instructions_per_second = (report.seconds > 0) ? report.instructions / report.seconds : 0;
+    return report;
+}
+
+// Take from the front of our own queue, otherwise steal from the back of
+// another worker's.
+bool BatchRunner::next_task(unsigned worker, size_t & task)
+{
+    for(unsigned offset = 0; offset < thread_count; offset++)
+    {
+        WorkQueue & queue = queues[(worker + offset) % thread_count];
+        lock_guard<mutex> guard(queue.lock);
+        if(!queue.tasks.empty())
+        {
+            if(offset == 0)
+            {
+                task = queue.tasks.front();
+                queue.tasks.pop_front();
+            }
+            else
+            {
+                task = queue.tasks.back();
+                queue.tasks.pop_back();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void BatchRunner::worker(unsigned id, Report * report)
+{
+    while(unfinished > 0)
+    {
+        size_t task;
+        if(!next_task(id, task))
+        {
+            this_thread::yield();
+            continue;
+        }
+
+        MOS6502 & cpu = instance(task);
+        uint64_t chunk = (remaining[task] < slice) ? remaining[task] : slice;
+        uint64_t before = cpu.get_instructions();
+        MOS6502::StopReason reason = (stop_PC < 0) ? cpu.run(chunk) : cpu.run(chunk, (uint16_t)stop_PC);
+        remaining[task] -= cpu.get_instructions() - before;
+
+        if(reason == MOS6502::STOP_COUNT && remaining[task] > 0)
+        {
+            lock_guard<mutex> guard(queues[id].lock);
+            queues[id].tasks.push_back(task);
+        }
+        else
+        {
+            report->reasons[task] = reason;
+            unfinished--;
+        }
+    }
+}
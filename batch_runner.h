@@ -0,0 +1,86 @@
+#ifndef BATCH_RUNNER_H
+#define BATCH_RUNNER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include "mos6502.h"
+#include "rom_image.h"
+using namespace std;
+
+#define BATCH_SLICE 100000 // instructions an instance runs before it yields
+
+// Runs many MOS6502 instances, e.g. one ROM against many inputs, on a pool
+// of host threads. Each worker owns a queue of instances and steals from
+// the others when it runs dry. Instances run in slices through the normal
+// run() entry points, so the final state matches running each one on its
+// own with the same step count.
+class BatchRunner
+{
+public:
+    struct Report {
+        vector<MOS6502::StopReason> reasons; // per instance
+        uint64_t instructions;               // executed by all instances
+        double seconds;
+        double instructions_per_second;
+    };
+
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+
+    size_t instance_count;
+    unsigned thread_count;
+    // One cache-line aligned allocation: the instances, each padded to a
+    // whole number of cache lines, then their 64K memories
+    uint8_t * arena;
+    size_t instance_stride;
+    unique_ptr<RomImage> rom;        // image shared read-only by all instances
+    uint16_t rom_location;
+    MOS6502::LoadError load_error;
+
+    unique_ptr<WorkQueue[]> queues;
+    atomic<size_t> unfinished;
+    vector<uint64_t> remaining;
+    int32_t stop_PC;
+    uint64_t slice;
+
+    uint8_t * instance_memory(size_t index);
+    void unmap_shared(size_t index);
+    Report run_all(uint64_t steps, int32_t stop);
+    bool next_task(unsigned worker, size_t & task);
+    void worker(unsigned id, Report * report);
+
+public:
+    // thread_count 0 uses every hardware thread
+    BatchRunner(size_t instance_count, unsigned thread_count = 0);
+    ~BatchRunner();
+
+    BatchRunner(const BatchRunner & other) = delete;
+    BatchRunner & operator=(const BatchRunner & other) = delete;
+
+    size_t size();
+    MOS6502 & instance(size_t index);
+
+    // load into every instance's own RAM, as MOS6502::load() does
+    bool load(string filename, uint16_t location);
+    // mmap the file once and map it read-only into every instance; location
+    // must be page aligned and CPU writes to the image are dropped. Pages of
+    // an earlier image go back to each instance's RAM, and a failed load
+    // leaves the earlier image mapped.
+    bool load_shared(string filename, uint16_t location);
+    MOS6502::LoadError get_load_error(); // why a load failed
+    void reset();
+
+    Report run(uint64_t steps);
+    Report run(uint64_t steps, uint16_t stop_PC);
+    void set_slice(uint64_t instructions);
+};
+
+#endif
@@ -0,0 +1,1158 @@
+#include "mos6502.h"
+#include "disassembler.h"
+#include "rom_image.h"
+#include <map>
+#include <chrono>
+#include <thread>
+#include <math.h>
+#include <time.h>
+
+// Throughput benchmarks for the interpreter cores, with a text table on
+// stdout and optionally JSON for tracking results over time.
+//
+//   benchmark [--core all|reference,threaded,translated,native]
+//             [--filter TEXT] [--repeats N] [--min-time SECONDS]
+//             [--json FILE|-] [--list]
+//             [--rom FILE [--rom-start ADDRESS] [--rom-pass ADDRESS]]
+//
+// opcode/  one legal opcode, or a push/pull or call/return pair, 64 times
+//          over in a loop closed by a JMP
+// mode/    every opcode of one addressing mode in turn
+// kernel/  memcpy, 16-bit multiply, sieve and BCD loops, each checked
+//          once per core before it is timed; with --rom, a whole run of a
+//          functional test ROM such as Klaus Dormann's, which passes when
+//          it traps at the pass address
+// setup/   construction, copying and load() cost
+//
+// Each benchmark warms up while working out how long a repetition needs
+// to run to take --min-time, then times --repeats repetitions. Rates come
+// from the median repetition; the spread is their standard deviation.
+
+#define BENCH_DEFAULT_REPEATS 5
+#define BENCH_DEFAULT_MIN_TIME 0.02 // seconds per repetition
+#define BENCH_FIRST_STEPS 1000      // instructions in the first warm-up run
+#define BENCH_CHECK_STEPS 100000000 // bound on a kernel's first pass
+#define BENCH_ROM_STEPS 1000000000  // bound on a functional test ROM run
+#define BENCH_BODY_LENGTH 64        // instructions in a micro-benchmark loop
+
+#define BENCH_ZP_DATA 0x10      // zero page operand
+#define BENCH_ZP_POINTER 0x80   // (zp,X) and (zp),Y pointer to BENCH_DATA
+#define BENCH_POINTERS 0x0300   // JMP (ind) targets, a word per copy
+#define BENCH_IRQ_HANDLER 0x0380
+#define BENCH_SUBROUTINE 0x0390
+#define BENCH_CODE 0x0400
+#define BENCH_DATA 0x2000
+#define BENCH_IMAGE_LOCATION 0xC000 // where setup/ loads its image
+#define BENCH_IMAGE_SIZE 0x4000
+#define BENCH_IMAGE_FILE "mos6502_benchmark.rom"
+
+#define MEMCPY_SOURCE 0x3000
+#define MEMCPY_TARGET 0x5000
+#define MEMCPY_PAGES 16
+#define SIEVE_FLAGS 0x6000 // a byte per number below 8192
+#define SIEVE_PRIMES 1028  // primes below 8192
+
+struct Options {
+    vector<MOS6502::Core> cores;
+    string filter;
+    unsigned repeats;
+    double min_time;
+    string json;
+    bool list;
+    string rom;
+    uint16_t rom_start;
+    uint16_t rom_pass;
+};
+
+struct Stats {
+    double median;
+    double mean;
+    double min;
+    double max;
+    double stddev;
+};
+
+struct Result {
+    string name;
+    string core;       // empty for setup benchmarks
+    uint64_t count;    // instructions, or operations for setup benchmarks
+    uint64_t cycles;
+    Stats ns;          // per instruction or operation, over the repetitions
+    bool valid;
+};
+
+// A 64K memory image that runs forever from start, passing pass_PC once
+// per pass of its loop. check looks at the result of a pass.
+struct Workload {
+    string name;
+    vector<uint8_t> memory;
+    uint16_t start;
+    uint16_t pass_PC;
+    bool (*check)(MOS6502 & cpu);
+};
+
+// Just enough of an assembler for the kernels. Code goes into a 64K image
+// from origin on, and branches and jumps may name labels defined later;
+// link() fills them in.
+class Assembler
+{
+private:
+    vector<uint8_t> & image;
+    uint16_t pc;
+    map<string, uint16_t> labels;
+    vector<pair<uint16_t, string> > branches; // offset byte, target
+    vector<pair<uint16_t, string> > words;    // address operand, target
+
+public:
+    Assembler(vector<uint8_t> & memory, uint16_t origin)
+        : image(memory), pc(origin)
+    {
+    }
+
+    uint16_t here()
+    {
+        return pc;
+    }
+
+    void label(string name)
+    {
+        labels[name] = pc;
+    }
+
+    void op(uint8_t opcode)
+    {
+        image[pc++] = opcode;
+    }
+
+    void op(uint8_t opcode, uint8_t operand)
+    {
+        op(opcode);
+        image[pc++] = operand;
+    }
+
+    void op_word(uint8_t opcode, uint16_t operand)
+    {
+        op(opcode);
+        image[pc++] = operand & LOW_BYTE;
+        image[pc++] = operand >> 8;
+    }
+
+    void branch(uint8_t opcode, string target)
+    {
+        op(opcode, 0);
+        branches.push_back(make_pair((uint16_t)(pc - 1), target));
+    }
+
+    void jump(uint8_t opcode, string target)
+    {
+        op_word(opcode, 0);
+        words.push_back(make_pair((uint16_t)(pc - 2), target));
+    }
+
+    // a missing label or a branch out of range is a bug in the benchmark
+    void link()
+    {
+        for(size_t i = 0; i < branches.size(); i++)
+        {
+            int offset = (int)address(branches[i].second) - (branches[i].first + 1);
+            if(offset < -128 || offset > 127)
+            {
+                cerr << "Branch to " << branches[i].second << " out of range" << endl;
+                exit(2);
+            }
+            image[branches[i].first] = (uint8_t)offset;
+        }
+        for(size_t i = 0; i < words.size(); i++)
+        {
+            uint16_t target = address(words[i].second);
+            image[words[i].first] = target & LOW_BYTE;
+            image[words[i].first + 1] = target >> 8;
+        }
+    }
+
+    uint16_t address(string name)
+    {
+        map<string, uint16_t>::iterator found = labels.find(name);
+        if(found == labels.end())
+        {
+            cerr << "No label " << name << endl;
+            exit(2);
+        }
+        return found->second;
+    }
+};
+
+static const char * core_names[] = {"reference", "threaded", "translated", "native"};
+
+static void usage()
+{
+    cerr << "usage: benchmark [--core all|reference,threaded,translated,native]" << endl
+         << "                 [--filter TEXT] [--repeats N] [--min-time SECONDS]" << endl
+         << "                 [--json FILE|-] [--list]" << endl
+         << "                 [--rom FILE [--rom-start ADDRESS] [--rom-pass ADDRESS]]" << endl;
+}
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static Stats summarize(vector<double> samples)
+{
+    Stats stats = {0, 0, 0, 0, 0};
+    if(samples.empty())
+    {
+        return stats;
+    }
+    sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    stats.median = (n % 2) ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+    stats.min = samples[0];
+    stats.max = samples[n - 1];
+    for(size_t i = 0; i < n; i++)
+    {
+        stats.mean += samples[i] / n;
+    }
+    for(size_t i = 0; n > 1 && i < n; i++)
+    {
+        stats.stddev += (samples[i] - stats.mean) * (samples[i] - stats.mean) / (n - 1);
+    }
+    stats.stddev = sqrt(stats.stddev);
+    return stats;
+}
+
+// Image with RESET at start, BRK and IRQ going to an RTI, a subroutine
+// that only returns, and the pointers the indirect modes use.
+static vector<uint8_t> blank_image(uint16_t start)
+{
+    vector<uint8_t> memory(MEMORY_SIZE, 0);
+    memory[RESET_LOW] = start & LOW_BYTE;
+    memory[RESET_HIGH] = start >> 8;
+    memory[IRQ_LOW] = BENCH_IRQ_HANDLER & LOW_BYTE;
+    memory[IRQ_HIGH] = BENCH_IRQ_HANDLER >> 8;
+    memory[BENCH_IRQ_HANDLER] = 0x40; // RTI
+    memory[BENCH_SUBROUTINE] = 0x60;  // RTS
+    memory[BENCH_ZP_POINTER] = BENCH_DATA & LOW_BYTE;
+    memory[BENCH_ZP_POINTER + 1] = BENCH_DATA >> 8;
+    return memory;
+}
+
+// The instruction with operands that keep it in place: branches and jumps
+// go to the next instruction, and memory operands to the data areas.
+static void emit(Assembler & code, vector<uint8_t> & memory, uint8_t opcode)
+{
+    uint16_t next = code.here() + Disassembler::length(opcode);
+    switch(Disassembler::mode(opcode))
+    {
+        case MOS6502::ACC:
+        case MOS6502::IMP:
+            code.op(opcode);
+            break;
+
+        case MOS6502::IMM:
+            code.op(opcode, 0x01);
+            break;
+
+        case MOS6502::ZPG:
+        case MOS6502::ZPX:
+        case MOS6502::ZPY:
+            code.op(opcode, BENCH_ZP_DATA);
+            break;
+
+        case MOS6502::ABS:
+            code.op_word(opcode, (Disassembler::mnemonic(opcode) == "JMP") ? next : BENCH_DATA);
+            break;
+
+        case MOS6502::AIX:
+        case MOS6502::AIY:
+            code.op_word(opcode, BENCH_DATA);
+            break;
+
+        case MOS6502::IIX:
+        case MOS6502::IIY:
+            code.op(opcode, BENCH_ZP_POINTER);
+            break;
+
+        case MOS6502::REL:
+            code.op(opcode, 0);
+            break;
+
+        case MOS6502::IND:
+        {
+            uint16_t pointer = BENCH_POINTERS + 2 * ((code.here() - BENCH_CODE) / 3);
+            memory[pointer] = next & LOW_BYTE;
+            memory[pointer + 1] = next >> 8;
+            code.op_word(opcode, pointer);
+            break;
+        }
+    }
+}
+
+// Opcodes that only make sense with their partner, and the partner.
+static bool paired(const string & mnemonic, string & first, string & second)
+{
+    static const char * pairs[4][2] = {{"JSR", "RTS"}, {"BRK", "RTI"}, {"PHA", "PLA"}, {"PHP", "PLP"}};
+    for(int i = 0; i < 4; i++)
+    {
+        if(mnemonic == pairs[i][0] || mnemonic == pairs[i][1])
+        {
+            first = pairs[i][0];
+            second = pairs[i][1];
+            return true;
+        }
+    }
+    return false;
+}
+
+// Loop of BENCH_BODY_LENGTH instructions taken from opcodes in turn.
+static Workload micro_workload(string name, const vector<uint8_t> & opcodes)
+{
+    Workload work;
+    work.name = name;
+    work.memory = blank_image(BENCH_CODE);
+    work.start = BENCH_CODE;
+    work.check = NULL;
+
+    Assembler code(work.memory, BENCH_CODE);
+    code.label("start");
+    for(int i = 0; i < BENCH_BODY_LENGTH; i++)
+    {
+        emit(code, work.memory, opcodes[i % opcodes.size()]);
+    }
+    work.pass_PC = code.here();
+    code.jump(0x4C, "start"); // JMP
+    code.link();
+    return work;
+}
+
+static void push_pair(Assembler & code, const string & first)
+{
+    if(first == "JSR")
+    {
+        code.op_word(0x20, BENCH_SUBROUTINE); // JSR to an RTS
+    }
+    else if(first == "BRK")
+    {
+        code.op(0x00, 0xEA); // BRK, returns past the byte after it
+    }
+    else
+    {
+        code.op((first == "PHA") ? 0x48 : 0x08); // PHA or PHP
+        code.op((first == "PHA") ? 0x68 : 0x28); // PLA or PLP
+    }
+}
+
+static vector<Workload> opcode_workloads()
+{
+    vector<Workload> workloads;
+    for(int opcode = 0; opcode < 256; opcode++)
+    {
+        string mnemonic = Disassembler::mnemonic(opcode);
+        string first, second;
+        if(mnemonic == "ILL")
+        {
+            continue;
+        }
+        if(paired(mnemonic, first, second))
+        {
+            if(mnemonic != first)
+            {
+                continue;
+            }
+            Workload work;
+            work.name = "opcode/" + first + "+" + second;
+            work.memory = blank_image(BENCH_CODE);
+            work.start = BENCH_CODE;
+            work.check = NULL;
+            Assembler code(work.memory, BENCH_CODE);
+            code.label("start");
+            for(int i = 0; i < BENCH_BODY_LENGTH / 2; i++)
+            {
+                push_pair(code, first);
+            }
+            work.pass_PC = code.here();
+            code.jump(0x4C, "start"); // JMP
+            code.link();
+            workloads.push_back(work);
+            continue;
+        }
+        workloads.push_back(micro_workload("opcode/" + mnemonic + "_" +
+                                           Disassembler::mode_name(Disassembler::mode(opcode)),
+                                           vector<uint8_t>(1, (uint8_t)opcode)));
+    }
+    return workloads;
+}
+
+static vector<Workload> mode_workloads()
+{
+    vector<Workload> workloads;
+    for(int mode = MOS6502::ACC; mode <= MOS6502::IND; mode++)
+    {
+        vector<uint8_t> opcodes;
+        for(int opcode = 0; opcode < 256; opcode++)
+        {
+            string mnemonic = Disassembler::mnemonic(opcode);
+            string first, second;
+            if(Disassembler::mode(opcode) == mode && mnemonic != "ILL" && mnemonic != "TXS" &&
+               !paired(mnemonic, first, second))
+            {
+                opcodes.push_back(opcode);
+            }
+        }
+        if(!opcodes.empty())
+        {
+            workloads.push_back(micro_workload("mode/" + Disassembler::mode_name((MOS6502::Mode)mode), opcodes));
+        }
+    }
+    return workloads;
+}
+
+static bool check_memcpy(MOS6502 & cpu)
+{
+    for(int i = 0; i < MEMCPY_PAGES * PAGE_SIZE; i++)
+    {
+        if(cpu.get_memory(MEMCPY_TARGET + i) != cpu.get_memory(MEMCPY_SOURCE + i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies MEMCPY_PAGES pages through (zp),Y pointers.
+static Workload memcpy_kernel()
+{
+    Workload work;
+    work.name = "kernel/memcpy";
+    work.memory = blank_image(BENCH_CODE);
+    work.start = BENCH_CODE;
+    work.check = check_memcpy;
+    for(int i = 0; i < MEMCPY_PAGES * PAGE_SIZE; i++)
+    {
+        work.memory[MEMCPY_SOURCE + i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    Assembler code(work.memory, BENCH_CODE);
+    code.label("start");
+    code.op(0xA9, 0x00);                // LDA #0
+    code.op(0x85, 0xFB);                // STA source
+    code.op(0x85, 0xFD);                // STA target
+    code.op(0xA9, MEMCPY_SOURCE >> 8);  // LDA #>source
+    code.op(0x85, 0xFC);
+    code.op(0xA9, MEMCPY_TARGET >> 8);  // LDA #>target
+    code.op(0x85, 0xFE);
+    code.op(0xA2, MEMCPY_PAGES);        // LDX #pages
+    code.op(0xA0, 0x00);                // LDY #0
+    code.label("copy");
+    code.op(0xB1, 0xFB);                // LDA (source),Y
+    code.op(0x91, 0xFD);                // STA (target),Y
+    code.op(0xC8);                      // INY
+    code.branch(0xD0, "copy");          // BNE copy
+    code.op(0xE6, 0xFC);                // INC source+1
+    code.op(0xE6, 0xFE);                // INC target+1
+    code.op(0xCA);                      // DEX
+    code.branch(0xD0, "copy");          // BNE copy
+    work.pass_PC = code.here();
+    code.jump(0x4C, "start");           // JMP start
+    code.link();
+    return work;
+}
+
+static uint32_t mul16_multiplicand(uint8_t i)
+{
+    return 0x5A00 | (i ^ 0xA5);
+}
+
+static uint32_t mul16_multiplier(uint8_t i)
+{
+    return ((i ^ 0xFF) << 8) | i;
+}
+
+static bool check_mul16(MOS6502 & cpu)
+{
+    uint32_t sum = 0;
+    for(int i = 0; i < 256; i++)
+    {
+        sum += mul16_multiplicand(i) * mul16_multiplier(i);
+    }
+    uint32_t stored = 0;
+    for(int i = 3; i >= 0; i--)
+    {
+        stored = (stored << 8) | cpu.get_memory(0x18 + i);
+    }
+    return stored == sum;
+}
+
+// Shift-and-add 16 x 16 bit multiplies of 256 operand pairs, summing the
+// 32-bit products.
+static Workload mul16_kernel()
+{
+    Workload work;
+    work.name = "kernel/mul16";
+    work.memory = blank_image(BENCH_CODE);
+    work.start = BENCH_CODE;
+    work.check = check_mul16;
+
+    // $10 multiplicand, $12 multiplier, $14 product, $18 sum, $20 pair
+    Assembler code(work.memory, BENCH_CODE);
+    code.label("start");
+    code.op(0xA9, 0x00);                // LDA #0
+    code.op(0x85, 0x20);                // STA pair
+    for(uint8_t i = 0; i < 4; i++)
+    {
+        code.op(0x85, 0x18 + i);        // STA sum+i
+    }
+    code.label("next");
+    code.op(0xA5, 0x20);                // LDA pair
+    code.op(0x85, 0x12);                // STA multiplier
+    code.op(0x49, 0xFF);                // EOR #$FF
+    code.op(0x85, 0x13);                // STA multiplier+1
+    code.op(0xA5, 0x20);                // LDA pair
+    code.op(0x49, 0xA5);                // EOR #$A5
+    code.op(0x85, 0x10);                // STA multiplicand
+    code.op(0xA9, 0x5A);                // LDA #$5A
+    code.op(0x85, 0x11);                // STA multiplicand+1
+    code.op(0xA9, 0x00);                // LDA #0
+    code.op(0x85, 0x16);                // STA product+2
+    code.op(0x85, 0x17);                // STA product+3
+    code.op(0xA2, 16);                  // LDX #16
+    code.label("shift");
+    code.op(0x46, 0x13);                // LSR multiplier+1
+    code.op(0x66, 0x12);                // ROR multiplier
+    code.branch(0x90, "skip");          // BCC skip
+    code.op(0xA5, 0x16);                // LDA product+2
+    code.op(0x18);                      // CLC
+    code.op(0x65, 0x10);                // ADC multiplicand
+    code.op(0x85, 0x16);                // STA product+2
+    code.op(0xA5, 0x17);                // LDA product+3
+    code.op(0x65, 0x11);                // ADC multiplicand+1
+    code.op(0x85, 0x17);                // STA product+3
+    code.label("skip");
+    code.op(0x66, 0x17);                // ROR product+3
+    code.op(0x66, 0x16);                // ROR product+2
+    code.op(0x66, 0x15);                // ROR product+1
+    code.op(0x66, 0x14);                // ROR product
+    code.op(0xCA);                      // DEX
+    code.branch(0xD0, "shift");         // BNE shift
+    code.op(0x18);                      // CLC
+    for(uint8_t i = 0; i < 4; i++)
+    {
+        code.op(0xA5, 0x18 + i);        // LDA sum+i
+        code.op(0x65, 0x14 + i);        // ADC product+i
+        code.op(0x85, 0x18 + i);        // STA sum+i
+    }
+    code.op(0xE6, 0x20);                // INC pair
+    code.branch(0xD0, "next");          // BNE next
+    work.pass_PC = code.here();
+    code.jump(0x4C, "start");           // JMP start
+    code.link();
+    return work;
+}
+
+static bool check_sieve(MOS6502 & cpu)
+{
+    return (cpu.get_memory(0x30) | cpu.get_memory(0x31) << 8) == SIEVE_PRIMES;
+}
+
+// Sieve of Eratosthenes over a byte per number below 8192, counting the
+// primes.
+static Workload sieve_kernel()
+{
+    Workload work;
+    work.name = "kernel/sieve";
+    work.memory = blank_image(BENCH_CODE);
+    work.start = BENCH_CODE;
+    work.check = check_sieve;
+
+    // $30 count, $32 candidate, $FB flag pointer
+    Assembler code(work.memory, BENCH_CODE);
+    code.label("start");
+    code.op(0xA9, 0x00);                // LDA #0
+    code.op(0x85, 0xFB);                // STA pointer
+    code.op(0xA9, SIEVE_FLAGS >> 8);    // LDA #>flags
+    code.op(0x85, 0xFC);                // STA pointer+1
+    code.op(0xA9, 0x01);                // LDA #1
+    code.op(0xA0, 0x00);                // LDY #0
+    code.op(0xA2, 0x20);                // LDX #32
+    code.label("fill");
+    code.op(0x91, 0xFB);                // STA (pointer),Y
+    code.op(0xC8);                      // INY
+    code.branch(0xD0, "fill");          // BNE fill
+    code.op(0xE6, 0xFC);                // INC pointer+1
+    code.op(0xCA);                      // DEX
+    code.branch(0xD0, "fill");          // BNE fill
+    code.op(0xA9, 0x00);                // LDA #0
+    code.op(0x85, 0x30);                // STA count
+    code.op(0x85, 0x31);                // STA count+1
+    code.op(0x85, 0x33);                // STA candidate+1
+    code.op(0xA9, 0x02);                // LDA #2
+    code.op(0x85, 0x32);                // STA candidate
+    code.label("outer");
+    code.op(0xA5, 0x32);                // LDA candidate
+    code.op(0x85, 0xFB);                // STA pointer
+    code.op(0xA5, 0x33);                // LDA candidate+1
+    code.op(0x18);                      // CLC
+    code.op(0x69, SIEVE_FLAGS >> 8);    // ADC #>flags
+    code.op(0x85, 0xFC);                // STA pointer+1
+    code.op(0xB1, 0xFB);                // LDA (pointer),Y
+    code.branch(0xF0, "next");          // BEQ next
+    code.op(0xE6, 0x30);                // INC count
+    code.branch(0xD0, "mark");          // BNE mark
+    code.op(0xE6, 0x31);                // INC count+1
+    code.label("mark");
+    code.op(0x18);                      // CLC
+    code.op(0xA5, 0xFB);                // LDA pointer
+    code.op(0x65, 0x32);                // ADC candidate
+    code.op(0x85, 0xFB);                // STA pointer
+    code.op(0xA5, 0xFC);                // LDA pointer+1
+    code.op(0x65, 0x33);                // ADC candidate+1
+    code.op(0x85, 0xFC);                // STA pointer+1
+    code.op(0xC9, (SIEVE_FLAGS >> 8) + 0x20); // CMP #>flags+8192
+    code.branch(0xB0, "next");          // BCS next
+    code.op(0xA9, 0x00);                // LDA #0
+    code.op(0x91, 0xFB);                // STA (pointer),Y
+    code.jump(0x4C, "mark");            // JMP mark
+    code.label("next");
+    code.op(0xE6, 0x32);                // INC candidate
+    code.branch(0xD0, "limit");         // BNE limit
+    code.op(0xE6, 0x33);                // INC candidate+1
+    code.label("limit");
+    code.op(0xA5, 0x33);                // LDA candidate+1
+    code.op(0xC9, 0x20);                // CMP #>8192
+    code.branch(0x90, "outer");         // BCC outer
+    work.pass_PC = code.here();
+    code.jump(0x4C, "start");           // JMP start
+    code.link();
+    return work;
+}
+
+static bool check_bcd(MOS6502 & cpu)
+{
+    // 256 x 1237 and 0 - 256 x 19, as eight and four decimal digits
+    static const uint8_t expected[6] = {0x72, 0x66, 0x31, 0x00, 0x36, 0x51};
+    for(int i = 0; i < 6; i++)
+    {
+        if(cpu.get_memory(0x40 + i) != expected[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Decimal mode adds into an eight digit counter and subtracts from a four
+// digit one.
+static Workload bcd_kernel()
+{
+    Workload work;
+    work.name = "kernel/bcd";
+    work.memory = blank_image(BENCH_CODE);
+    work.start = BENCH_CODE;
+    work.check = check_bcd;
+
+    // $40 sum, $44 difference
+    Assembler code(work.memory, BENCH_CODE);
+    code.label("start");
+    code.op(0xF8);                      // SED
+    code.op(0xA9, 0x00);                // LDA #0
+    for(uint8_t i = 0; i < 6; i++)
+    {
+        code.op(0x85, 0x40 + i);        // STA sum+i / difference+i
+    }
+    code.op(0xA2, 0x00);                // LDX #0
+    code.label("loop");
+    code.op(0x18);                      // CLC
+    static const uint8_t addend[4] = {0x37, 0x12, 0x00, 0x00};
+    for(uint8_t i = 0; i < 4; i++)
+    {
+        code.op(0xA5, 0x40 + i);        // LDA sum+i
+        code.op(0x69, addend[i]);       // ADC #addend
+        code.op(0x85, 0x40 + i);        // STA sum+i
+    }
+    code.op(0x38);                      // SEC
+    code.op(0xA5, 0x44);                // LDA difference
+    code.op(0xE9, 0x19);                // SBC #$19
+    code.op(0x85, 0x44);                // STA difference
+    code.op(0xA5, 0x45);                // LDA difference+1
+    code.op(0xE9, 0x00);                // SBC #0
+    code.op(0x85, 0x45);                // STA difference+1
+    code.op(0xCA);                      // DEX
+    code.branch(0xD0, "loop");          // BNE loop
+    code.op(0xD8);                      // CLD
+    work.pass_PC = code.here();
+    code.jump(0x4C, "start");           // JMP start
+    code.link();
+    return work;
+}
+
+// Runs the CPU steps instructions at a time, growing steps until a run
+// takes min_time, then times the repetitions.
+static void time_runs(MOS6502 & cpu, const Options & options, Result & result)
+{
+    uint64_t steps = BENCH_FIRST_STEPS;
+    for(;;)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        cpu.run(steps);
+        double seconds = seconds_since(start);
+        if(seconds >= options.min_time)
+        {
+            break;
+        }
+        double scale = (seconds > 0) ? 1.2 * options.min_time / seconds : 100;
+        steps = (uint64_t)(steps * ((scale < 2) ? 2 : (scale > 100) ? 100 : scale));
+    }
+
+    vector<double> samples;
+    for(unsigned i = 0; i < options.repeats; i++)
+    {
+        uint64_t instructions = cpu.get_instructions();
+        uint64_t cycles = cpu.get_cycles();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        cpu.run(steps);
+        double seconds = seconds_since(start);
+        instructions = cpu.get_instructions() - instructions;
+        result.count += instructions;
+        result.cycles += cpu.get_cycles() - cycles;
+        samples.push_back((instructions > 0) ? seconds * 1e9 / instructions : 0);
+    }
+    result.ns = summarize(samples);
+}
+
+static Result run_workload(const Workload & work, MOS6502::Core core, const Options & options)
+{
+    Result result = {work.name, core_names[core], 0, 0, Stats(), true};
+    MOS6502 * cpu = new MOS6502();
+    cpu->set_core(core);
+    for(uint32_t i = 0; i < MEMORY_SIZE; i++)
+    {
+        cpu->set_memory(i, work.memory[i]);
+    }
+    cpu->reset();
+
+    if(work.check != NULL)
+    {
+        // the first pass checks the core gets the right answer
+        result.valid = cpu->run(BENCH_CHECK_STEPS, work.pass_PC) == MOS6502::STOP_PC && work.check(*cpu);
+    }
+    time_runs(*cpu, options, result);
+    delete cpu;
+    return result;
+}
+
+// Each repetition restores the ROM as loaded and runs it until it traps.
+static Result run_rom(MOS6502::Core core, const Options & options)
+{
+    Result result = {"kernel/functional_test", core_names[core], 0, 0, Stats(), true};
+    MOS6502 * cpu = new MOS6502();
+    cpu->set_core(core);
+    cpu->set_halt_conditions(MOS6502::HALT_ON_SELF_LOOP);
+    if(!cpu->load(options.rom, 0))
+    {
+        cerr << "Cannot load " << options.rom << endl;
+        exit(2);
+    }
+    cpu->set_PC(options.rom_start);
+    MOS6502::Snapshot * loaded = new MOS6502::Snapshot;
+    cpu->snapshot(*loaded);
+
+    vector<double> samples;
+    for(unsigned i = 0; i <= options.repeats; i++)
+    {
+        cpu->restore(*loaded);
+        uint64_t instructions = cpu->get_instructions();
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        MOS6502::StopReason reason = cpu->run(BENCH_ROM_STEPS);
+        double seconds = seconds_since(start);
+        instructions = cpu->get_instructions() - instructions;
+        if(reason != MOS6502::STOP_SELF_LOOP || cpu->get_PC() != options.rom_pass)
+        {
+            result.valid = false;
+        }
+        if(i == 0)
+        {
+            if(!result.valid)
+            {
+                fprintf(stderr, "%s: functional test trapped at $%04X\n", core_names[core], cpu->get_PC());
+            }
+            continue; // warm-up
+        }
+        result.count += instructions;
+        result.cycles += cpu->get_cycles() - loaded->cycles;
+        samples.push_back((instructions > 0) ? seconds * 1e9 / instructions : 0);
+    }
+    result.ns = summarize(samples);
+    delete loaded;
+    delete cpu;
+    return result;
+}
+
+struct SetupState {
+    string image_file;
+    RomImage image;
+    MOS6502 * source; // loaded CPU to copy
+    MOS6502 * target; // CPU to load into
+};
+
+typedef void (*SetupOperation)(SetupState & state);
+
+static void construct(SetupState &)
+{
+    delete new MOS6502();
+}
+
+static void copy_construct(SetupState & state)
+{
+    delete new MOS6502(*state.source);
+}
+
+static void load_file(SetupState & state)
+{
+    state.target->load(state.image_file, BENCH_IMAGE_LOCATION);
+}
+
+static void construct_from_file(SetupState & state)
+{
+    delete new MOS6502(state.image_file, BENCH_IMAGE_LOCATION);
+}
+
+static void construct_from_image(SetupState & state)
+{
+    delete new MOS6502(state.image, BENCH_IMAGE_LOCATION);
+}
+
+static Result run_setup(string name, SetupOperation operation, SetupState & state, const Options & options)
+{
+    Result result = {name, "", 0, 0, Stats(), true};
+    uint64_t iterations = 1;
+    for(;;)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(uint64_t i = 0; i < iterations; i++)
+        {
+            operation(state);
+        }
+        if(seconds_since(start) >= options.min_time)
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    vector<double> samples;
+    for(unsigned r = 0; r < options.repeats; r++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(uint64_t i = 0; i < iterations; i++)
+        {
+            operation(state);
+        }
+        samples.push_back(seconds_since(start) * 1e9 / iterations);
+        result.count += iterations;
+    }
+    result.ns = summarize(samples);
+    return result;
+}
+
+static bool selected(const string & name, const Options & options)
+{
+    return name.find(options.filter) != string::npos;
+}
+
+static void print_result(FILE * out, const Result & result)
+{
+    double spread = (result.ns.median > 0) ? 100 * result.ns.stddev / result.ns.median : 0;
+    if(result.core.empty())
+    {
+        fprintf(out, "%-35s %10.1f %6.1f%%\n", result.name.c_str(), result.ns.median, spread);
+        return;
+    }
+    double mips = (result.ns.median > 0) ? 1000 / result.ns.median : 0;
+    double cycles_per_instruction = (result.count > 0) ? (double)result.cycles / result.count : 0;
+    fprintf(out, "%-24s %-10s %10.2f %10.3f %6.1f%% %12.2f%s\n", result.name.c_str(), result.core.c_str(),
+            mips, result.ns.median, spread, mips * cycles_per_instruction, result.valid ? "" : "  WRONG RESULT");
+}
+
+static string json_string(const string & text)
+{
+    string quoted = "\"";
+    for(size_t i = 0; i < text.size(); i++)
+    {
+        char c = text[i];
+        if(c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if((unsigned char)c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+static void write_stats(FILE * out, const char * key, const Stats & stats)
+{
+    fprintf(out, "      \"%s\": {\"median\": %.4f, \"mean\": %.4f, \"min\": %.4f, \"max\": %.4f, \"stddev\": %.4f},\n",
+            key, stats.median, stats.mean, stats.min, stats.max, stats.stddev);
+}
+
+static bool write_json(const string & filename, const vector<Result> & results, const Options & options)
+{
+    FILE * out = (filename == "-") ? stdout : fopen(filename.c_str(), "w");
+    if(out == NULL)
+    {
+        return false;
+    }
+
+    char date[32];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+#ifdef __VERSION__
+    const char * compiler = __VERSION__;
+#else
+    const char * compiler = "unknown";
+#endif
+#ifdef NDEBUG
+    const char * build = "release";
+#else
+    const char * build = "debug";
+#endif
+
+    fprintf(out, "{\n  \"context\": {\n");
+    fprintf(out, "    \"date\": \"%s\",\n", date);
+    fprintf(out, "    \"compiler\": %s,\n", json_string(compiler).c_str());
+    fprintf(out, "    \"build\": \"%s\",\n", build);
+    fprintf(out, "    \"host_threads\": %u,\n", thread::hardware_concurrency());
+    fprintf(out, "    \"repetitions\": %u,\n", options.repeats);
+    fprintf(out, "    \"min_time\": %g\n", options.min_time);
+    fprintf(out, "  },\n  \"benchmarks\": [\n");
+    for(size_t i = 0; i < results.size(); i++)
+    {
+        const Result & result = results[i];
+        fprintf(out, "    {\n      \"name\": %s,\n", json_string(result.name).c_str());
+        if(result.core.empty())
+        {
+            fprintf(out, "      \"operations\": %llu,\n", (unsigned long long)result.count);
+            write_stats(out, "ns_per_operation", result.ns);
+            fprintf(out, "      \"operations_per_second\": %.1f\n",
+                    (result.ns.median > 0) ? 1e9 / result.ns.median : 0);
+        }
+        else
+        {
+            double mips = (result.ns.median > 0) ? 1000 / result.ns.median : 0;
+            double cycles_per_instruction = (result.count > 0) ? (double)result.cycles / result.count : 0;
+            fprintf(out, "      \"core\": \"%s\",\n", result.core.c_str());
+            fprintf(out, "      \"instructions\": %llu,\n", (unsigned long long)result.count);
+            fprintf(out, "      \"cycles\": %llu,\n", (unsigned long long)result.cycles);
+            write_stats(out, "ns_per_instruction", result.ns);
+            fprintf(out, "      \"mips\": %.3f,\n", mips);
+            fprintf(out, "      \"cycles_per_second\": %.1f,\n", mips * cycles_per_instruction * 1e6);
+            fprintf(out, "      \"valid\": %s\n", result.valid ? "true" : "false");
+        }
+        fprintf(out, "    }%s\n", (i + 1 < results.size()) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return (out == stdout) ? fflush(out) == 0 : fclose(out) == 0;
+}
+
+static bool parse_cores(string list, vector<MOS6502::Core> & cores)
+{
+    cores.clear();
+    if(list == "all")
+    {
+        list = "reference,threaded,translated,native";
+    }
+    stringstream names(list);
+    string name;
+    while(getline(names, name, ','))
+    {
+        int core = 0;
+        while(core < 4 && name != core_names[core])
+        {
+            core++;
+        }
+        if(core == 4)
+        {
+            return false;
+        }
+        cores.push_back((MOS6502::Core)core);
+    }
+    return !cores.empty();
+}
+
+static bool parse_options(int argc, char ** argv, Options & options)
+{
+    parse_cores("all", options.cores);
+    options.repeats = BENCH_DEFAULT_REPEATS;
+    options.min_time = BENCH_DEFAULT_MIN_TIME;
+    options.list = false;
+    options.rom_start = 0x0400; // as the functional test is usually built
+    options.rom_pass = 0x3469;
+
+    for(int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if(option == "--list")
+        {
+            options.list = true;
+            continue;
+        }
+        if(i + 1 == argc)
+        {
+            return false;
+        }
+        const char * value = argv[++i];
+        if(option == "--core")
+        {
+            if(!parse_cores(value, options.cores))
+            {
+                return false;
+            }
+        }
+        else if(option == "--filter")
+        {
+            options.filter = value;
+        }
+        else if(option == "--repeats")
+        {
+            options.repeats = strtoul(value, NULL, 0);
+        }
+        else if(option == "--min-time")
+        {
+            options.min_time = strtod(value, NULL);
+        }
+        else if(option == "--json")
+        {
+            options.json = value;
+        }
+        else if(option == "--rom")
+        {
+            options.rom = value;
+        }
+        else if(option == "--rom-start")
+        {
+            options.rom_start = strtoul(value, NULL, 0);
+        }
+        else if(option == "--rom-pass")
+        {
+            options.rom_pass = strtoul(value, NULL, 0);
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return options.repeats > 0;
+}
+
+int main(int argc, char ** argv)
+{
+    Options options;
+    if(!parse_options(argc, argv, options))
+    {
+        usage();
+        return 2;
+    }
+
+    vector<Workload> workloads = opcode_workloads();
+    vector<Workload> modes = mode_workloads();
+    workloads.insert(workloads.end(), modes.begin(), modes.end());
+    workloads.push_back(memcpy_kernel());
+    workloads.push_back(mul16_kernel());
+    workloads.push_back(sieve_kernel());
+    workloads.push_back(bcd_kernel());
+
+    const char * setup_names[5] = {"setup/construct", "setup/copy", "setup/load",
+                                   "setup/construct_load", "setup/construct_map_rom"};
+    SetupOperation setup_operations[5] = {construct, copy_construct, load_file, construct_from_file,
+                                          construct_from_image};
+
+    if(options.list)
+    {
+        for(size_t i = 0; i < workloads.size(); i++)
+        {
+            printf("%s\n", workloads[i].name.c_str());
+        }
+        printf("kernel/functional_test\n");
+        for(int i = 0; i < 5; i++)
+        {
+            printf("%s\n", setup_names[i]);
+        }
+        return 0;
+    }
+
+    // the table goes to stderr when the JSON takes stdout
+    FILE * table = (options.json == "-") ? stderr : stdout;
+    fprintf(table, "%-24s %-10s %10s %10s %7s %12s\n", "benchmark", "core", "MIPS", "ns/instr", "+/-", "Mcycles/s");
+    vector<Result> results;
+    bool valid = true;
+
+    for(size_t i = 0; i < workloads.size(); i++)
+    {
+        for(size_t c = 0; c < options.cores.size() && selected(workloads[i].name, options); c++)
+        {
+            results.push_back(run_workload(workloads[i], options.cores[c], options));
+            print_result(table, results.back());
+            valid &= results.back().valid;
+        }
+    }
+    if(!options.rom.empty() && selected("kernel/functional_test", options))
+    {
+        for(size_t c = 0; c < options.cores.size(); c++)
+        {
+            results.push_back(run_rom(options.cores[c], options));
+            print_result(table, results.back());
+            valid &= results.back().valid;
+        }
+    }
+
+    bool setup_wanted = false;
+    for(int i = 0; i < 5; i++)
+    {
+        setup_wanted |= selected(setup_names[i], options);
+    }
+    if(setup_wanted)
+    {
+        SetupState state;
+        state.image_file = BENCH_IMAGE_FILE;
+        FILE * file = fopen(BENCH_IMAGE_FILE, "wb");
+        vector<uint8_t> image = blank_image(BENCH_CODE);
+        if(file == NULL || fwrite(&image[BENCH_IMAGE_LOCATION], 1, BENCH_IMAGE_SIZE, file) != BENCH_IMAGE_SIZE ||
+           fclose(file) != 0 || !state.image.open(BENCH_IMAGE_FILE))
+        {
+            cerr << "Cannot write " << BENCH_IMAGE_FILE << endl;
+            return 2;
+        }
+        state.source = new MOS6502(BENCH_IMAGE_FILE, BENCH_IMAGE_LOCATION);
+        state.target = new MOS6502();
+
+        fprintf(table, "\n%-35s %10s %7s\n", "setup", "ns/op", "+/-");
+        for(int i = 0; i < 5; i++)
+        {
+            if(selected(setup_names[i], options))
+            {
+                results.push_back(run_setup(setup_names[i], setup_operations[i], state, options));
+                print_result(table, results.back());
+            }
+        }
+        delete state.source;
+        delete state.target;
+        state.image.close();
+        remove(BENCH_IMAGE_FILE);
+    }
+
+    if(!options.json.empty() && !write_json(options.json, results, options))
+    {
+        cerr << "Cannot write " << options.json << endl;
+        return 2;
+    }
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#include "disassembler.h"
+
+// indexed by MOS6502::Mode
+static const char * mode_names[] =
+{
+    "ACC", "IMM", "ABS", "ZPG", "ZPX", "ZPY", "AIX", "AIY", "IMP", "REL", "IIX", "IIY", "IND"
+};
+
+string Disassembler::to_hex_string(uint16_t num)
+{
+    stringstream strstr;
+    strstr << hex << num;
+    return strstr.str();
+}
+
+uint8_t Disassembler::length(uint8_t opcode)
+{
+    switch(MOS6502::decoder[opcode].addr_mode)
+    {
+        case MOS6502::ACC:
+        case MOS6502::IMP:
+            return 1;
+
+        case MOS6502::ABS:
+        case MOS6502::AIX:
+        case MOS6502::AIY:
+        case MOS6502::IND:
+            return 3;
+
+        default:
+            return 2;
+    }
+}
+
+string Disassembler::mnemonic(uint8_t opcode)
+{
+    return MOS6502::decoder[opcode].op_name;
+}
+
+MOS6502::Mode Disassembler::mode(uint8_t opcode)
+{
+    return MOS6502::decoder[opcode].addr_mode;
+}
+
+string Disassembler::mode_name(MOS6502::Mode mode)
+{
+    return mode_names[mode];
+}
+
+string Disassembler::disassemble(const uint8_t * bytes)
+{
+    const MOS6502::Instruction & instr = MOS6502::decoder[bytes[0]];
+    uint16_t byte_operand = bytes[1];
+    uint16_t word_operand = bytes[1] | bytes[2] << 8;
+    string operand;
+
+    switch(instr.addr_mode)
+    {
+        case MOS6502::ACC:
+            operand = "A";
+            break;
+
+        case MOS6502::IMM:
+            operand = "#$" + to_hex_string(byte_operand);
+            break;
+
+        case MOS6502::ABS:
+            operand = "$" + to_hex_string(word_operand);
+            break;
+
+        case MOS6502::ZPG:
+        case MOS6502::REL:
+            operand = "$" + to_hex_string(byte_operand);
+            break;
+
+        case MOS6502::ZPX:
+            operand = "$" + to_hex_string(byte_operand) + ",X";
+            break;
+
+        case MOS6502::ZPY:
+            operand = "$" + to_hex_string(byte_operand) + ",Y";
+            break;
+
+        case MOS6502::AIX:
+            operand = "$" + to_hex_string(word_operand) + ",X";
+            break;
+
+        case MOS6502::AIY:
+            operand = "$" + to_hex_string(word_operand) + ",Y";
+            break;
+
+        case MOS6502::IMP:
+            break;
+
+        case MOS6502::IIX:
+            operand = "($" + to_hex_string(byte_operand) + ",X)";
+            break;
+
+        case MOS6502::IIY:
+            operand = "($" + to_hex_string(byte_operand) + "),Y";
+            break;
+
+        case MOS6502::IND:
+            operand = "($" + to_hex_string(word_operand) + ")";
+            break;
+    }
+
+    return string(instr.op_name) + " " + operand;
+}
+
+vector<string> Disassembler::disassemble(const uint8_t * buffer, size_t size, uint16_t origin)
+{
+    vector<string> listing;
+    size_t offset = 0;
+
+    while(offset < size)
+    {
+        uint8_t bytes[3] = {buffer[offset], 0, 0};
+        uint8_t instr_length = length(bytes[0]);
+        for(uint8_t i = 1; i < instr_length && offset + i < size; i++)
+        {
+            bytes[i] = buffer[offset + i];
+        }
+
+        string address = to_hex_string((uint16_t)(origin + offset));
+        listing.push_back(string(4 - address.size(), '0') + address + ": " + disassemble(bytes));
+        offset += instr_length;
+    }
+
+    return listing;
+}
+
+vector<string> Disassembler::disassemble(MOS6502 & cpu, uint16_t start, uint16_t end)
+{
+    vector<uint8_t> buffer;
+    for(uint32_t location = start; location <= end; location++)
+    {
+        buffer.push_back(cpu.peek_byte(location));
+    }
+    return disassemble(buffer.data(), buffer.size(), start);
+}
@@ -0,0 +1,34 @@
+#ifndef DISASSEMBLER_H
+#define DISASSEMBLER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mos6502.h"
+using namespace std;
+
+// Standalone disassembler sharing the CPU's opcode table. Operands are
+// formatted the same way get_last_instr() always has ("LDA #$5").
+class Disassembler
+{
+private:
+    static string to_hex_string(uint16_t num);
+
+public:
+    static uint8_t length(uint8_t opcode);
+    static string mnemonic(uint8_t opcode); // "ILL" for illegal opcodes
+    static MOS6502::Mode mode(uint8_t opcode);
+    static string mode_name(MOS6502::Mode mode); // "ZPX"
+
+    // disassemble one instruction from its opcode and operand bytes
+    static string disassemble(const uint8_t * bytes);
+
+    // disassemble every instruction in a buffer mapped at origin
+    static vector<string> disassemble(const uint8_t * buffer, size_t size, uint16_t origin);
+
+    // disassemble the emulator's memory from start up to and including end;
+    // device pages are not read, so they list as BRK
+    static vector<string> disassemble(MOS6502 & cpu, uint16_t start, uint16_t end);
+};
+
+#endif
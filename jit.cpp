@@ -0,0 +1,593 @@
+#include "jit.h"
+
+#ifdef JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+// host registers, by x86-64 encoding number
+enum HostRegister {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8,
+    R9 = 9,
+    R10 = 10,
+    R11 = 11
+};
+
+// where the 6502 state lives inside compiled code
+#define HOST_CONTEXT RDI
+#define HOST_A R8
+#define HOST_X R9
+#define HOST_Y R10
+#define HOST_RESULT R11 // last result byte, source of lazy N and Z
+#define HOST_C RSI
+#define HOST_V RCX
+
+// x86 condition codes
+#define CC_E 0x4
+#define CC_NE 0x5
+
+#define CONTEXT_FIELD(field) ((int32_t)offsetof(JitContext, field))
+
+JitCompiler::JitCompiler() : buffer(NULL), used(0), full(false), n_live(false), z_live(false)
+{
+#ifdef JIT_X86_64
+    void * mapped = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapped != MAP_FAILED)
+    {
+        buffer = (uint8_t *)mapped;
+    }
+#endif
+}
+
+JitCompiler::~JitCompiler()
+{
+#ifdef JIT_X86_64
+    if(buffer != NULL)
+    {
+        munmap(buffer, JIT_BUFFER_SIZE);
+    }
+#endif
+}
+
+bool JitCompiler::available()
+{
+    return buffer != NULL;
+}
+
+bool JitCompiler::exhausted()
+{
+    return full;
+}
+
+// Compiled blocks are only reachable through the translation cache, so
+// dropping them all is just rewinding the buffer.
+void JitCompiler::clear()
+{
+    used = 0;
+    full = false;
+}
+
+void JitCompiler::emit(uint8_t byte)
+{
+    code.push_back(byte);
+}
+
+void JitCompiler::emit32(uint32_t value)
+{
+    for(int i = 0; i < 4; i++)
+    {
+        emit((value >> (8 * i)) & LOW_BYTE);
+    }
+}
+
+// Always present, so byte forms of RSI and RDI mean SIL and DIL
+void JitCompiler::emit_rex(bool wide, int reg, int base)
+{
+    emit(0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3));
+}
+
+void JitCompiler::emit_modrm_disp(int reg, int base, int32_t disp)
+{
+    emit(0x80 | ((reg & 7) << 3) | (base & 7));
+    emit32(disp);
+}
+
+// op r/m, reg with both operands registers
+void JitCompiler::emit_reg_reg(uint8_t opcode, int reg, int rm, bool wide)
+{
+    emit_rex(wide, reg, rm);
+    emit(opcode);
+    emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// group 1 ALU op (ext: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp) with imm32
+void JitCompiler::emit_alu_imm(int ext, int reg, uint32_t value)
+{
+    emit_rex(false, 0, reg);
+    emit(0x81);
+    emit(0xC0 | (ext << 3) | (reg & 7));
+    emit32(value);
+}
+
+void JitCompiler::emit_mov_imm(int reg, uint32_t value)
+{
+    emit_rex(false, 0, reg);
+    emit(0xB8 + (reg & 7));
+    emit32(value);
+}
+
+void JitCompiler::emit_test_imm(int reg, uint32_t value)
+{
+    emit_rex(false, 0, reg);
+    emit(0xF7);
+    emit(0xC0 | (reg & 7));
+    emit32(value);
+}
+
+void JitCompiler::emit_shr(int reg, uint8_t amount)
+{
+    emit_rex(false, 0, reg);
+    emit(0xC1);
+    emit(0xC0 | (5 << 3) | (reg & 7));
+    emit(amount);
+}
+
+void JitCompiler::emit_not(int reg)
+{
+    emit_rex(false, 0, reg);
+    emit(0xF7);
+    emit(0xC0 | (2 << 3) | (reg & 7));
+}
+
+// movzx reg32, byte [base + disp]
+void JitCompiler::emit_load_byte(int reg, int base, int32_t disp)
+{
+    emit_rex(false, reg, base);
+    emit(0x0F);
+    emit(0xB6);
+    emit_modrm_disp(reg, base, disp);
+}
+
+// mov byte [base + disp], reg8
+void JitCompiler::emit_store_byte(int reg, int base, int32_t disp)
+{
+    emit_rex(false, reg, base);
+    emit(0x88);
+    emit_modrm_disp(reg, base, disp);
+}
+
+// mov reg64, [base + disp]
+void JitCompiler::emit_load_ptr(int reg, int base, int32_t disp)
+{
+    emit_rex(true, reg, base);
+    emit(0x8B);
+    emit_modrm_disp(reg, base, disp);
+}
+
+// jcc to an exit stub, patched in compile()
+void JitCompiler::emit_jump(int condition, size_t exit)
+{
+    emit(0x0F);
+    emit(0x80 + condition);
+    Fixup fixup = {code.size(), exit};
+    fixups.push_back(fixup);
+    emit32(0);
+}
+
+// Writes the registers and any lazy flags back to the context and
+// returns the number of instructions run.
+void JitCompiler::emit_exit(const Exit & exit)
+{
+    emit_store_byte(HOST_A, HOST_CONTEXT, CONTEXT_FIELD(A));
+    emit_store_byte(HOST_X, HOST_CONTEXT, CONTEXT_FIELD(X));
+    emit_store_byte(HOST_Y, HOST_CONTEXT, CONTEXT_FIELD(Y));
+    emit_store_byte(HOST_C, HOST_CONTEXT, CONTEXT_FIELD(C));
+    emit_store_byte(HOST_V, HOST_CONTEXT, CONTEXT_FIELD(V));
+    if(exit.n_live)
+    {
+        emit_reg_reg(0x89, HOST_RESULT, RAX, false);
+        emit_shr(RAX, 7);
+        emit_store_byte(RAX, HOST_CONTEXT, CONTEXT_FIELD(N));
+    }
+    if(exit.z_live)
+    {
+        emit_set_zero(RAX);
+        emit_store_byte(RAX, HOST_CONTEXT, CONTEXT_FIELD(Z));
+    }
+
+    // mov word [context + PC], imm16
+    emit(0x66);
+    emit_rex(false, 0, HOST_CONTEXT);
+    emit(0xC7);
+    emit_modrm_disp(0, HOST_CONTEXT, CONTEXT_FIELD(PC));
+    emit(exit.PC & LOW_BYTE);
+    emit(exit.PC >> 8);
+    emit(0x66);
+    emit_rex(false, 0, HOST_CONTEXT);
+    emit(0xC7);
+    emit_modrm_disp(0, HOST_CONTEXT, CONTEXT_FIELD(last_PC));
+    emit(exit.last_PC & LOW_BYTE);
+    emit(exit.last_PC >> 8);
+    // mov dword [context + cycles], imm32
+    emit_rex(false, 0, HOST_CONTEXT);
+    emit(0xC7);
+    emit_modrm_disp(0, HOST_CONTEXT, CONTEXT_FIELD(cycles));
+    emit32(exit.cycles);
+
+    emit_mov_imm(RAX, exit.count);
+    emit(0xC3); // ret
+}
+
+// reg = (HOST_RESULT == 0)
+void JitCompiler::emit_set_zero(int reg)
+{
+    emit_reg_reg(0x85, HOST_RESULT, HOST_RESULT, false); // test
+    emit_rex(false, 0, reg);
+    emit(0x0F);
+    emit(0x90 + CC_E); // sete
+    emit(0xC0 | (reg & 7));
+}
+
+void JitCompiler::set_nz(int reg)
+{
+    emit_reg_reg(0x89, reg, HOST_RESULT, false);
+    n_live = true;
+    z_live = true;
+}
+
+// RAX = read_pages[page], leaving through exit if it is a device page
+void JitCompiler::read_guard(uint16_t address, size_t exit)
+{
+    emit_load_ptr(RAX, HOST_CONTEXT, CONTEXT_FIELD(read_pages));
+    emit_load_ptr(RAX, RAX, (address >> PAGE_SHIFT) * sizeof(uint8_t *));
+    emit_reg_reg(0x85, RAX, RAX, true); // test
+    emit_jump(CC_E, exit);
+}
+
+// RAX = write_pages[page]; device pages, pages without a write pointer
+// and pages holding translated code are left to the interpreter, as are
+// read-modify-writes whose read and write pages differ
+void JitCompiler::write_guard(uint16_t address, size_t exit, bool rmw)
+{
+    int32_t page = address >> PAGE_SHIFT;
+    emit_load_ptr(RAX, HOST_CONTEXT, CONTEXT_FIELD(write_pages));
+    emit_load_ptr(RAX, RAX, page * sizeof(uint8_t *));
+    emit_reg_reg(0x85, RAX, RAX, true); // test
+    emit_jump(CC_E, exit);
+
+    emit_load_ptr(RDX, HOST_CONTEXT, CONTEXT_FIELD(code_pages));
+    emit_rex(false, 0, RDX);
+    emit(0x80); // cmp byte [rdx + page], 0
+    emit_modrm_disp(7, RDX, page);
+    emit(0);
+    emit_jump(CC_NE, exit);
+
+    if(rmw)
+    {
+        emit_load_ptr(RDX, HOST_CONTEXT, CONTEXT_FIELD(read_pages));
+        emit_rex(true, RAX, RDX);
+        emit(0x3B); // cmp rax, [rdx + page * 8]
+        emit_modrm_disp(RAX, RDX, page * sizeof(uint8_t *));
+        emit_jump(CC_NE, exit);
+    }
+}
+
+void JitCompiler::mark_dirty(uint16_t address)
+{
+    emit_load_ptr(RDX, HOST_CONTEXT, CONTEXT_FIELD(dirty_pages));
+    emit_rex(false, 0, RDX);
+    emit(0xC6); // mov byte [rdx + page], 1
+    emit_modrm_disp(0, RDX, address >> PAGE_SHIFT);
+    emit(1);
+}
+
+// EDX = operand value for immediate, zero page and absolute modes
+bool JitCompiler::load_operand(const MOS6502::Instruction & instr, uint16_t operand, size_t exit)
+{
+    switch(instr.addr_mode)
+    {
+        case MOS6502::IMM:
+            emit_mov_imm(RDX, operand);
+            return true;
+
+        case MOS6502::ZPG:
+        case MOS6502::ABS:
+            read_guard(operand, exit);
+            emit_load_byte(RDX, RAX, operand & LOW_BYTE);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+// C for ADC, SBC and the compares, with RAX holding the full result of
+// reg op EDX; leaves the result byte in RAX
+void JitCompiler::carry(bool borrow)
+{
+    emit_reg_reg(0x89, RAX, HOST_C, false);
+    emit_shr(HOST_C, 8);
+    emit_alu_imm(4, HOST_C, 1);
+    if(borrow)
+    {
+        emit_alu_imm(6, HOST_C, 1);
+    }
+    emit_alu_imm(4, RAX, LOW_BYTE);
+}
+
+// C, then V for ADC and SBC, which held A ^ operand beforehand. ADC
+// overflows when the signs agree and the result's differs, SBC when the
+// signs differ and the result's differs from A.
+void JitCompiler::carry_overflow(bool borrow)
+{
+    carry(borrow);
+    emit_reg_reg(0x89, HOST_A, RDX, false);
+    emit_reg_reg(0x31, RAX, RDX, false); // xor: A ^ result
+    if(!borrow)
+    {
+        emit_not(HOST_V);
+    }
+    emit_reg_reg(0x21, RDX, HOST_V, false);
+    emit_shr(HOST_V, 7);
+    emit_alu_imm(4, HOST_V, 1);
+}
+
+// Emits one instruction, or nothing and false if it is not supported
+bool JitCompiler::compile_op(const MOS6502::Instruction & instr, uint16_t operand, size_t exit)
+{
+    MOS6502::op_ptr op = instr.op_func;
+    MOS6502::Mode mode = instr.addr_mode;
+    bool fixed = (mode == MOS6502::IMM || mode == MOS6502::ZPG || mode == MOS6502::ABS);
+    bool memory = (mode == MOS6502::ZPG || mode == MOS6502::ABS);
+
+    if(fixed && (op == &MOS6502::op_LDA || op == &MOS6502::op_LDX || op == &MOS6502::op_LDY))
+    {
+        int reg = (op == &MOS6502::op_LDA) ? HOST_A : (op == &MOS6502::op_LDX) ? HOST_X : HOST_Y;
+        load_operand(instr, operand, exit);
+        emit_reg_reg(0x89, RDX, reg, false);
+        set_nz(reg);
+    }
+    else if(memory && (op == &MOS6502::op_STA || op == &MOS6502::op_STX || op == &MOS6502::op_STY))
+    {
+        int reg = (op == &MOS6502::op_STA) ? HOST_A : (op == &MOS6502::op_STX) ? HOST_X : HOST_Y;
+        write_guard(operand, exit, false);
+        emit_store_byte(reg, RAX, operand & LOW_BYTE);
+        mark_dirty(operand);
+    }
+    else if(fixed && (op == &MOS6502::op_AND || op == &MOS6502::op_ORA || op == &MOS6502::op_EOR))
+    {
+        uint8_t opcode = (op == &MOS6502::op_AND) ? 0x21 : (op == &MOS6502::op_ORA) ? 0x09 : 0x31;
+        load_operand(instr, operand, exit);
+        emit_reg_reg(opcode, RDX, HOST_A, false);
+        set_nz(HOST_A);
+    }
+    else if(fixed && (op == &MOS6502::op_ADC || op == &MOS6502::op_SBC))
+    {
+        // binary mode only; blocks are not entered with D set
+        load_operand(instr, operand, exit);
+        emit_reg_reg(0x89, HOST_A, HOST_V, false);
+        emit_reg_reg(0x31, RDX, HOST_V, false);
+        emit_reg_reg(0x89, HOST_A, RAX, false);
+        if(op == &MOS6502::op_ADC)
+        {
+            emit_reg_reg(0x01, RDX, RAX, false);
+            emit_reg_reg(0x01, HOST_C, RAX, false);
+        }
+        else
+        {
+            emit_reg_reg(0x29, RDX, RAX, false);
+            emit_reg_reg(0x01, HOST_C, RAX, false);
+            emit_alu_imm(5, RAX, 1);
+        }
+        carry_overflow(op == &MOS6502::op_SBC);
+        emit_reg_reg(0x89, RAX, HOST_A, false);
+        set_nz(HOST_A);
+    }
+    else if(fixed && (op == &MOS6502::op_CMP || op == &MOS6502::op_CPX || op == &MOS6502::op_CPY))
+    {
+        // N, Z and C from reg - operand; V is left alone
+        int reg = (op == &MOS6502::op_CMP) ? HOST_A : (op == &MOS6502::op_CPX) ? HOST_X : HOST_Y;
+        load_operand(instr, operand, exit);
+        emit_reg_reg(0x89, reg, RAX, false);
+        emit_reg_reg(0x29, RDX, RAX, false);
+        carry(true);
+        set_nz(RAX);
+    }
+    else if(memory && (op == &MOS6502::op_INC || op == &MOS6502::op_DEC))
+    {
+        write_guard(operand, exit, true);
+        emit_load_byte(RDX, RAX, operand & LOW_BYTE);
+        emit_alu_imm(0, RDX, (op == &MOS6502::op_INC) ? 1 : LOW_BYTE);
+        emit_alu_imm(4, RDX, LOW_BYTE);
+        emit_store_byte(RDX, RAX, operand & LOW_BYTE);
+        set_nz(RDX);
+        mark_dirty(operand);
+    }
+    else if(op == &MOS6502::op_TAX || op == &MOS6502::op_TAY || op == &MOS6502::op_TXA || op == &MOS6502::op_TYA)
+    {
+        int source = (op == &MOS6502::op_TXA) ? HOST_X : (op == &MOS6502::op_TYA) ? HOST_Y : HOST_A;
+        int target = (op == &MOS6502::op_TAX) ? HOST_X : (op == &MOS6502::op_TAY) ? HOST_Y : HOST_A;
+        emit_reg_reg(0x89, source, target, false);
+        set_nz(target);
+    }
+    else if(op == &MOS6502::op_INX || op == &MOS6502::op_INY || op == &MOS6502::op_DEX || op == &MOS6502::op_DEY)
+    {
+        int reg = (op == &MOS6502::op_INX || op == &MOS6502::op_DEX) ? HOST_X : HOST_Y;
+        emit_alu_imm(0, reg, (op == &MOS6502::op_INX || op == &MOS6502::op_INY) ? 1 : LOW_BYTE);
+        emit_alu_imm(4, reg, LOW_BYTE);
+        set_nz(reg);
+    }
+    else if(op == &MOS6502::op_CLC || op == &MOS6502::op_SEC)
+    {
+        emit_mov_imm(HOST_C, op == &MOS6502::op_SEC);
+    }
+    else if(op == &MOS6502::op_CLV)
+    {
+        emit_mov_imm(HOST_V, 0);
+    }
+    else if(op != &MOS6502::op_NOP)
+    {
+        return false;
+    }
+    return true;
+}
+
+// Ends the block on a relative branch: both outcomes exit with their own
+// PC and cycle count, worked out here since both addresses are known.
+void JitCompiler::compile_branch(const MOS6502::Instruction & instr, uint16_t operand, uint16_t pc, uint32_t cycles, uint32_t count)
+{
+    MOS6502::op_ptr op = instr.op_func;
+    uint16_t next = pc + 2;
+    uint16_t target = next + (int8_t)operand;
+    int taken; // condition code for a taken branch
+
+    if(op == &MOS6502::op_BPL || op == &MOS6502::op_BMI)
+    {
+        if(n_live)
+        {
+            emit_test_imm(HOST_RESULT, BYTE_HIGH_BIT);
+        }
+        else
+        {
+            emit_rex(false, 0, HOST_CONTEXT);
+            emit(0x80); // cmp byte [context + N], 0
+            emit_modrm_disp(7, HOST_CONTEXT, CONTEXT_FIELD(N));
+            emit(0);
+        }
+        taken = (op == &MOS6502::op_BMI) ? CC_NE : CC_E;
+    }
+    else if(op == &MOS6502::op_BNE || op == &MOS6502::op_BEQ)
+    {
+        if(z_live)
+        {
+            emit_reg_reg(0x85, HOST_RESULT, HOST_RESULT, false);
+            taken = (op == &MOS6502::op_BEQ) ? CC_E : CC_NE;
+        }
+        else
+        {
+            emit_rex(false, 0, HOST_CONTEXT);
+            emit(0x80); // cmp byte [context + Z], 0
+            emit_modrm_disp(7, HOST_CONTEXT, CONTEXT_FIELD(Z));
+            emit(0);
+            taken = (op == &MOS6502::op_BEQ) ? CC_NE : CC_E;
+        }
+    }
+    else
+    {
+        int flag = (op == &MOS6502::op_BCC || op == &MOS6502::op_BCS) ? HOST_C : HOST_V;
+        emit_reg_reg(0x85, flag, flag, false);
+        taken = (op == &MOS6502::op_BCS || op == &MOS6502::op_BVS) ? CC_NE : CC_E;
+    }
+
+    Exit branch_exit = {target, pc, cycles + instr.cycles + 1 + ((target ^ next) > LOW_BYTE), count + 1, n_live, z_live};
+    exits.push_back(branch_exit);
+    emit_jump(taken, exits.size() - 1);
+
+    Exit fall_exit = {next, pc, cycles + instr.cycles, count + 1, n_live, z_live};
+    emit_exit(fall_exit);
+}
+
+JitCompiler::NativeBlock JitCompiler::compile(const MOS6502::MicroOp * ops, uint16_t count, uint16_t start)
+{
+#ifdef JIT_X86_64
+    if(buffer == NULL)
+    {
+        return NULL;
+    }
+
+    code.clear();
+    fixups.clear();
+    exits.clear();
+    n_live = false;
+    z_live = false;
+
+    // prologue: registers and the eager flags into host registers
+    emit_load_byte(HOST_A, HOST_CONTEXT, CONTEXT_FIELD(A));
+    emit_load_byte(HOST_X, HOST_CONTEXT, CONTEXT_FIELD(X));
+    emit_load_byte(HOST_Y, HOST_CONTEXT, CONTEXT_FIELD(Y));
+    emit_load_byte(HOST_C, HOST_CONTEXT, CONTEXT_FIELD(C));
+    emit_load_byte(HOST_V, HOST_CONTEXT, CONTEXT_FIELD(V));
+
+    uint16_t pc = start;
+    uint16_t last_PC = start;
+    uint32_t cycles = 0;
+    uint32_t compiled = 0;
+    bool ended = false;
+    for(uint16_t i = 0; i < count; i++)
+    {
+        const MOS6502::Instruction & instr = MOS6502::decoder[ops[i].opcode];
+        if(instr.addr_mode == MOS6502::REL)
+        {
+            compile_branch(instr, ops[i].operand, pc, cycles, compiled);
+            compiled++;
+            ended = true;
+            break;
+        }
+        if(instr.op_func == &MOS6502::op_JMP && instr.addr_mode == MOS6502::ABS)
+        {
+            Exit jump_exit = {ops[i].operand, pc, cycles + instr.cycles, compiled + 1, n_live, z_live};
+            emit_exit(jump_exit);
+            compiled++;
+            ended = true;
+            break;
+        }
+
+        // leaving before this instruction
+        Exit before = {pc, last_PC, cycles, compiled, n_live, z_live};
+        exits.push_back(before);
+        if(!compile_op(instr, ops[i].operand, exits.size() - 1))
+        {
+            exits.pop_back();
+            break;
+        }
+        last_PC = pc;
+        pc += ops[i].length;
+        cycles += instr.cycles;
+        compiled++;
+    }
+
+    if(compiled == 0)
+    {
+        return NULL;
+    }
+    if(!ended)
+    {
+        Exit end = {pc, last_PC, cycles, compiled, n_live, z_live};
+        emit_exit(end);
+    }
+
+    vector<size_t> stubs(exits.size());
+    for(size_t i = 0; i < exits.size(); i++)
+    {
+        stubs[i] = code.size();
+        emit_exit(exits[i]);
+    }
+    for(size_t i = 0; i < fixups.size(); i++)
+    {
+        int32_t rel = stubs[fixups[i].exit] - (fixups[i].position + 4);
+        memcpy(&code[fixups[i].position], &rel, 4);
+    }
+
+    if(used + code.size() > JIT_BUFFER_SIZE)
+    {
+        full = true;
+        return NULL;
+    }
+    // the buffer is only writable while a block is copied in
+    uint8_t * entry = buffer + used;
+    if(mprotect(buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+    {
+        return NULL;
+    }
+    memcpy(entry, code.data(), code.size());
+    mprotect(buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+    used += (code.size() + 15) & ~(size_t)15;
+    return (NativeBlock)entry;
+#else
+    return NULL;
+#endif
+}
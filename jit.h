@@ -0,0 +1,111 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mos6502.h"
+using namespace std;
+
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT_X86_64
+#endif
+
+#define JIT_BUFFER_SIZE 0x100000 // bytes of executable memory per CPU
+
+// CPU state handed to compiled code. Flags are 0 or 1. On return PC,
+// last_PC and cycles describe the instructions that ran.
+struct JitContext {
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t N;
+    uint8_t V;
+    uint8_t Z;
+    uint8_t C;
+    uint16_t PC;
+    uint16_t last_PC;
+    uint32_t cycles;
+    uint8_t * const * read_pages;
+    uint8_t * const * write_pages;
+    uint8_t * dirty_pages;
+    const uint8_t * code_pages;
+};
+
+// Compiles translated blocks to x86-64. A/X/Y, C and V live in host
+// registers; N and Z are kept as the last result byte and only worked out
+// when a branch tests them or the block exits. Memory operands must be
+// fixed addresses: every access checks the page table at run time and
+// leaves the block before the instruction if the page is a device, is
+// missing a write pointer or holds translated code, so the interpreter
+// can take it from there. Compiled code returns how many instructions ran;
+// anything past the first unsupported instruction is left to the caller.
+class JitCompiler
+{
+public:
+    typedef uint32_t (*NativeBlock)(JitContext * context);
+
+private:
+    uint8_t * buffer;
+    size_t used;
+    bool full;
+    vector<uint8_t> code; // block being assembled
+
+    struct Fixup {
+        size_t position; // rel32 to patch
+        size_t exit;     // index into exits
+    };
+
+    struct Exit {
+        uint16_t PC;
+        uint16_t last_PC;
+        uint32_t cycles;
+        uint32_t count;
+        bool n_live; // N still only in the result register
+        bool z_live; // Z still only in the result register
+    };
+
+    vector<Fixup> fixups;
+    vector<Exit> exits;
+    bool n_live;
+    bool z_live;
+
+    void emit(uint8_t byte);
+    void emit32(uint32_t value);
+    void emit_rex(bool wide, int reg, int base);
+    void emit_modrm_disp(int reg, int base, int32_t disp);
+    void emit_reg_reg(uint8_t opcode, int reg, int rm, bool wide);
+    void emit_alu_imm(int ext, int reg, uint32_t value);
+    void emit_mov_imm(int reg, uint32_t value);
+    void emit_test_imm(int reg, uint32_t value);
+    void emit_shr(int reg, uint8_t amount);
+    void emit_not(int reg);
+    void emit_load_byte(int reg, int base, int32_t disp);
+    void emit_store_byte(int reg, int base, int32_t disp);
+    void emit_load_ptr(int reg, int base, int32_t disp);
+    void emit_set_zero(int reg);
+    void emit_jump(int condition, size_t exit);
+    void emit_exit(const Exit & exit);
+
+    void set_nz(int reg);
+    void read_guard(uint16_t address, size_t exit);
+    void write_guard(uint16_t address, size_t exit, bool rmw);
+    void mark_dirty(uint16_t address);
+    bool load_operand(const MOS6502::Instruction & instr, uint16_t operand, size_t exit);
+    void carry(bool borrow);
+    void carry_overflow(bool borrow);
+    bool compile_op(const MOS6502::Instruction & instr, uint16_t operand, size_t exit);
+    void compile_branch(const MOS6502::Instruction & instr, uint16_t operand, uint16_t pc, uint32_t cycles, uint32_t count);
+
+public:
+    JitCompiler();
+    ~JitCompiler();
+
+    bool available();
+    bool exhausted(); // a block did not fit; clear() makes room again
+    // compiles the leading instructions of a block that it supports;
+    // returns NULL if there are none or the buffer is full
+    NativeBlock compile(const MOS6502::MicroOp * ops, uint16_t count, uint16_t start);
+    void clear();
+};
+
+#endif
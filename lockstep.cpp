@@ -0,0 +1,332 @@
+#include "lockstep.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LANE_WIDTH 32
+typedef __m256i lane_vec;
+static inline lane_vec vec_load(const uint8_t * p) { return _mm256_load_si256((const __m256i *)p); }
+static inline void vec_store(uint8_t * p, lane_vec v) { _mm256_store_si256((__m256i *)p, v); }
+static inline lane_vec vec_splat(uint8_t b) { return _mm256_set1_epi8((char)b); }
+static inline lane_vec vec_and(lane_vec a, lane_vec b) { return _mm256_and_si256(a, b); }
+static inline lane_vec vec_or(lane_vec a, lane_vec b) { return _mm256_or_si256(a, b); }
+static inline lane_vec vec_xor(lane_vec a, lane_vec b) { return _mm256_xor_si256(a, b); }
+static inline lane_vec vec_add(lane_vec a, lane_vec b) { return _mm256_add_epi8(a, b); }
+static inline lane_vec vec_select(lane_vec mask, lane_vec a, lane_vec b) { return _mm256_blendv_epi8(b, a, mask); }
+static inline lane_vec vec_is_zero(lane_vec a) { return _mm256_cmpeq_epi8(a, _mm256_setzero_si256()); }
+static inline lane_vec vec_is_negative(lane_vec a) { return _mm256_cmpgt_epi8(_mm256_setzero_si256(), a); }
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LANE_WIDTH 16
+typedef __m128i lane_vec;
+static inline lane_vec vec_load(const uint8_t * p) { return _mm_load_si128((const __m128i *)p); }
+static inline void vec_store(uint8_t * p, lane_vec v) { _mm_store_si128((__m128i *)p, v); }
+static inline lane_vec vec_splat(uint8_t b) { return _mm_set1_epi8((char)b); }
+static inline lane_vec vec_and(lane_vec a, lane_vec b) { return _mm_and_si128(a, b); }
+static inline lane_vec vec_or(lane_vec a, lane_vec b) { return _mm_or_si128(a, b); }
+static inline lane_vec vec_xor(lane_vec a, lane_vec b) { return _mm_xor_si128(a, b); }
+static inline lane_vec vec_add(lane_vec a, lane_vec b) { return _mm_add_epi8(a, b); }
+static inline lane_vec vec_select(lane_vec mask, lane_vec a, lane_vec b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+static inline lane_vec vec_is_zero(lane_vec a) { return _mm_cmpeq_epi8(a, _mm_setzero_si128()); }
+static inline lane_vec vec_is_negative(lane_vec a) { return _mm_cmplt_epi8(a, _mm_setzero_si128()); }
+#else
+#define LANE_WIDTH 1
+typedef uint8_t lane_vec;
+static inline lane_vec vec_load(const uint8_t * p) { return *p; }
+static inline void vec_store(uint8_t * p, lane_vec v) { *p = v; }
+static inline lane_vec vec_splat(uint8_t b) { return b; }
+static inline lane_vec vec_and(lane_vec a, lane_vec b) { return a & b; }
+static inline lane_vec vec_or(lane_vec a, lane_vec b) { return a | b; }
+static inline lane_vec vec_xor(lane_vec a, lane_vec b) { return a ^ b; }
+static inline lane_vec vec_add(lane_vec a, lane_vec b) { return a + b; }
+static inline lane_vec vec_select(lane_vec mask, lane_vec a, lane_vec b) { return (mask & a) | (~mask & b); }
+static inline lane_vec vec_is_zero(lane_vec a) { return (a == 0) ? 0xFF : 0x00; }
+static inline lane_vec vec_is_negative(lane_vec a) { return (a & BYTE_HIGH_BIT) ? 0xFF : 0x00; }
+#endif
+
+// Operations on whole lane arrays, applied only where the group mask is set
+enum LaneOp {
+    LANE_LOAD, // dst = operand
+    LANE_AND,  // dst = dst & operand
+    LANE_ORA,  // dst = dst | operand
+    LANE_EOR,  // dst = dst ^ operand
+    LANE_COPY, // dst = src
+    LANE_ADD   // dst = dst + operand
+};
+
+static inline void lane_op(LaneOp op, uint8_t * dst, const uint8_t * src, uint8_t operand,
+                           const uint8_t * group, uint8_t * N, uint8_t * Z)
+{
+    lane_vec one = vec_splat(1);
+    lane_vec value = vec_splat(operand);
+    for(size_t i = 0; i < LOCKSTEP_MAX_LANES; i += LANE_WIDTH)
+    {
+        lane_vec mask = vec_load(group + i);
+        lane_vec current = vec_load(dst + i);
+        lane_vec result;
+        switch(op)
+        {
+            case LANE_LOAD: result = value; break;
+            case LANE_AND: result = vec_and(current, value); break;
+            case LANE_ORA: result = vec_or(current, value); break;
+            case LANE_EOR: result = vec_xor(current, value); break;
+            case LANE_COPY: result = vec_load(src + i); break;
+            default: result = vec_add(current, value); break;
+        }
+        vec_store(dst + i, vec_select(mask, result, current));
+        vec_store(N + i, vec_select(mask, vec_and(vec_is_negative(result), one), vec_load(N + i)));
+        vec_store(Z + i, vec_select(mask, vec_and(vec_is_zero(result), one), vec_load(Z + i)));
+    }
+}
+
+static inline void lane_set_flag(uint8_t * flag, uint8_t value, const uint8_t * group)
+{
+    for(size_t i = 0; i < LOCKSTEP_MAX_LANES; i += LANE_WIDTH)
+    {
+        vec_store(flag + i, vec_select(vec_load(group + i), vec_splat(value), vec_load(flag + i)));
+    }
+}
+
+LockstepEngine::LockstepEngine() : lane_count(0), vector_count(0), scalar_count(0)
+{
+    memset(A, 0, sizeof(A));
+    memset(X, 0, sizeof(X));
+    memset(Y, 0, sizeof(Y));
+    memset(N, 0, sizeof(N));
+    memset(Z, 0, sizeof(Z));
+    memset(C, 0, sizeof(C));
+    memset(V, 0, sizeof(V));
+    memset(group, 0, sizeof(group));
+    memset(remaining, 0, sizeof(remaining));
+}
+
+bool LockstepEngine::add(MOS6502 * cpu)
+{
+    if(lane_count == LOCKSTEP_MAX_LANES)
+    {
+        return false;
+    }
+    cpus[lane_count++] = cpu;
+    return true;
+}
+
+size_t LockstepEngine::lanes()
+{
+    return lane_count;
+}
+
+uint64_t LockstepEngine::get_vector_instructions()
+{
+    return vector_count;
+}
+
+uint64_t LockstepEngine::get_scalar_instructions()
+{
+    return scalar_count;
+}
+
+void LockstepEngine::load_lane(size_t lane)
+{
+    MOS6502 * cpu = cpus[lane];
+    uint8_t status = cpu->get_status();
+    A[lane] = cpu->reg_A;
+    X[lane] = cpu->reg_X;
+    Y[lane] = cpu->reg_Y;
+    N[lane] = (status >> 7) & 1;
+    V[lane] = (status >> 6) & 1;
+    Z[lane] = (status >> 1) & 1;
+    C[lane] = status & 1;
+    other_status[lane] = status & 0x3C;
+    PC[lane] = cpu->reg_PC;
+}
+
+void LockstepEngine::store_lane(size_t lane)
+{
+    MOS6502 * cpu = cpus[lane];
+    cpu->reg_A = A[lane];
+    cpu->reg_X = X[lane];
+    cpu->reg_Y = Y[lane];
+    cpu->set_status(N[lane] << 7 | V[lane] << 6 | other_status[lane] | Z[lane] << 1 | C[lane]);
+    cpu->reg_PC = PC[lane];
+}
+
+// Bookkeeping the instances would have done themselves in step()
+void LockstepEngine::retire(uint8_t opcode, uint8_t length)
+{
+    for(size_t lane = 0; lane < lane_count; lane++)
+    {
+        if(group[lane])
+        {
+            MOS6502 * cpu = cpus[lane];
+            cpu->last_PC = PC[lane];
+            cpu->cycle_count += MOS6502::decoder[opcode].cycles;
+            cpu->instruction_count++;
+            remaining[lane]--;
+            PC[lane] += length;
+        }
+    }
+}
+
+// Mirrors MOS6502::branch(), including the self-loop halt. Runs after
+// retire(), so PC already points past the branch.
+void LockstepEngine::branch(uint8_t * flag, uint8_t expected, uint8_t operand)
+{
+    for(size_t lane = 0; lane < lane_count; lane++)
+    {
+        if(group[lane] && flag[lane] == expected)
+        {
+            MOS6502 * cpu = cpus[lane];
+            uint16_t target = PC[lane] + (int8_t)operand;
+            cpu->cycle_count += 1 + ((target ^ PC[lane]) > LOW_BYTE);
+            PC[lane] = target;
+            if(target == cpu->last_PC && (cpu->halt_conditions & MOS6502::HALT_ON_SELF_LOOP))
+            {
+                cpu->halt_reason = MOS6502::STOP_SELF_LOOP;
+                remaining[lane] = 0;
+            }
+        }
+    }
+}
+
+// Instructions vector_step() can run across a whole group
+static bool vectorisable(uint8_t opcode)
+{
+    switch(opcode)
+    {
+        case 0xA9: case 0xA2: case 0xA0: case 0x29: case 0x09: case 0x49:
+        case 0xAA: case 0xA8: case 0x8A: case 0x98:
+        case 0xE8: case 0xC8: case 0xCA: case 0x88:
+        case 0x18: case 0x38: case 0xB8: case 0xEA:
+        case 0x10: case 0x30: case 0x50: case 0x70:
+        case 0x90: case 0xB0: case 0xD0: case 0xF0:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Returns false for instructions the lanes cannot run together.
+bool LockstepEngine::vector_step(uint8_t opcode, uint8_t operand)
+{
+    switch(opcode)
+    {
+        case 0xA9: lane_op(LANE_LOAD, A, NULL, operand, group, N, Z); break; // LDA #
+        case 0xA2: lane_op(LANE_LOAD, X, NULL, operand, group, N, Z); break; // LDX #
+        case 0xA0: lane_op(LANE_LOAD, Y, NULL, operand, group, N, Z); break; // LDY #
+        case 0x29: lane_op(LANE_AND, A, NULL, operand, group, N, Z); break;  // AND #
+        case 0x09: lane_op(LANE_ORA, A, NULL, operand, group, N, Z); break;  // ORA #
+        case 0x49: lane_op(LANE_EOR, A, NULL, operand, group, N, Z); break;  // EOR #
+        case 0xAA: lane_op(LANE_COPY, X, A, 0, group, N, Z); break;          // TAX
+        case 0xA8: lane_op(LANE_COPY, Y, A, 0, group, N, Z); break;          // TAY
+        case 0x8A: lane_op(LANE_COPY, A, X, 0, group, N, Z); break;          // TXA
+        case 0x98: lane_op(LANE_COPY, A, Y, 0, group, N, Z); break;          // TYA
+        case 0xE8: lane_op(LANE_ADD, X, NULL, 0x01, group, N, Z); break;     // INX
+        case 0xC8: lane_op(LANE_ADD, Y, NULL, 0x01, group, N, Z); break;     // INY
+        case 0xCA: lane_op(LANE_ADD, X, NULL, 0xFF, group, N, Z); break;     // DEX
+        case 0x88: lane_op(LANE_ADD, Y, NULL, 0xFF, group, N, Z); break;     // DEY
+        case 0x18: lane_set_flag(C, 0, group); break;                        // CLC
+        case 0x38: lane_set_flag(C, 1, group); break;                        // SEC
+        case 0xB8: lane_set_flag(V, 0, group); break;                        // CLV
+        case 0xEA: break;                                                    // NOP
+        case 0x10: retire(opcode, 2); branch(N, 0, operand); return true;    // BPL
+        case 0x30: retire(opcode, 2); branch(N, 1, operand); return true;    // BMI
+        case 0x50: retire(opcode, 2); branch(V, 0, operand); return true;    // BVC
+        case 0x70: retire(opcode, 2); branch(V, 1, operand); return true;    // BVS
+        case 0x90: retire(opcode, 2); branch(C, 0, operand); return true;    // BCC
+        case 0xB0: retire(opcode, 2); branch(C, 1, operand); return true;    // BCS
+        case 0xD0: retire(opcode, 2); branch(Z, 0, operand); return true;    // BNE
+        case 0xF0: retire(opcode, 2); branch(Z, 1, operand); return true;    // BEQ
+        default: return false;
+    }
+
+    retire(opcode, (MOS6502::decoder[opcode].addr_mode == MOS6502::IMM) ? 2 : 1);
+    return true;
+}
+
+void LockstepEngine::run(uint64_t steps)
+{
+    for(size_t lane = 0; lane < lane_count; lane++)
+    {
+        load_lane(lane);
+        cpus[lane]->halt_reason = MOS6502::STOP_NONE;
+        remaining[lane] = steps;
+    }
+
+    while(true)
+    {
+        // lowest PC among lanes with work left leads the next group
+        int leader = -1;
+        for(size_t lane = 0; lane < lane_count; lane++)
+        {
+            if(remaining[lane] > 0 && (leader < 0 || PC[lane] < PC[leader]))
+            {
+                leader = lane;
+            }
+        }
+        if(leader < 0)
+        {
+            break;
+        }
+
+        MOS6502 * lead = cpus[leader];
+        uint16_t pc = PC[leader];
+        bool readable = lead->read_pages[pc >> PAGE_SHIFT] != NULL &&
+                        lead->read_pages[(uint16_t)(pc + 1) >> PAGE_SHIFT] != NULL;
+        uint8_t opcode = lead->peek_byte(pc);
+        uint8_t operand = lead->peek_byte(pc + 1);
+
+        // group lanes at the same PC that see the same code bytes there;
+        // traced or profiled lanes only group with each other, so they do
+        // not hold the rest back
+        size_t members = 0;
+        bool interrupted = false;
+        bool hooked = lead->instrumented();
+        for(size_t lane = 0; lane < lane_count; lane++)
+        {
+            bool same = remaining[lane] > 0 && PC[lane] == pc &&
+                        cpus[lane]->instrumented() == hooked &&
+                        cpus[lane]->peek_byte(pc) == opcode &&
+                        cpus[lane]->peek_byte(pc + 1) == operand;
+            group[lane] = same ? 0xFF : 0x00;
+            members += same;
+            interrupted |= same && (cpus[lane]->interrupt_pending ||
+                                    cpus[lane]->cycle_count >= cpus[lane]->next_event);
+        }
+
+        // pending interrupts, due events, tracing and profiling are left to
+        // the instances' own step()
+        interrupted |= hooked;
+        if(readable && !interrupted && vector_step(opcode, operand))
+        {
+            vector_count += members;
+            continue;
+        }
+
+        // fall back to the instances' own interpreter until each lane
+        // reaches something the group can run together again
+        for(size_t lane = 0; lane < lane_count; lane++)
+        {
+            if(group[lane])
+            {
+                MOS6502 * cpu = cpus[lane];
+                store_lane(lane);
+                do
+                {
+                    cpu->step();
+                    remaining[lane]--;
+                    scalar_count++;
+                    if(cpu->halt_reason != MOS6502::STOP_NONE)
+                    {
+                        remaining[lane] = 0;
+                    }
+                } while(remaining[lane] > 0 && !vectorisable(cpu->peek_byte(cpu->reg_PC)));
+                load_lane(lane);
+            }
+        }
+    }
+
+    for(size_t lane = 0; lane < lane_count; lane++)
+    {
+        store_lane(lane);
+        cpus[lane]->record_last_bytes();
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include <stdint.h>
+#include "mos6502.h"
+using namespace std;
+
+#define LOCKSTEP_MAX_LANES 32
+
+// Runs up to LOCKSTEP_MAX_LANES MOS6502 instances in lockstep on one host
+// core. Registers and N/Z/C/V live in structure-of-arrays lanes; lanes that
+// share a PC (and the same code bytes there) form a group, and register,
+// immediate and branch instructions execute across the group with SSE2 or
+// AVX2 (plain C++ otherwise). Anything that touches memory, zero page and
+// absolute loads and stores included, runs one lane at a time through that
+// instance's own step(), as does every other opcode and any lane whose code
+// differs, so memory-heavy code gains little. The group with the lowest PC
+// runs first, which lets diverged lanes meet up again after short forward
+// branches. Traced and profiled lanes always run through step(). State is
+// written back after each run(), so the instances end up exactly as if
+// each had run on its own.
+class LockstepEngine
+{
+private:
+    MOS6502 * cpus[LOCKSTEP_MAX_LANES];
+    size_t lane_count;
+
+    // lane registers; flags are 0 or 1 per lane
+    alignas(32) uint8_t A[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t X[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t Y[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t N[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t Z[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t C[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t V[LOCKSTEP_MAX_LANES];
+    alignas(32) uint8_t group[LOCKSTEP_MAX_LANES]; // 0xFF for lanes in the group
+    uint8_t other_status[LOCKSTEP_MAX_LANES];       // D, I, B and bit 5
+    uint16_t PC[LOCKSTEP_MAX_LANES];
+    uint64_t remaining[LOCKSTEP_MAX_LANES];
+
+    uint64_t vector_count;
+    uint64_t scalar_count;
+
+    void load_lane(size_t lane);
+    void store_lane(size_t lane);
+    bool vector_step(uint8_t opcode, uint8_t operand);
+    void branch(uint8_t * flag, uint8_t expected, uint8_t operand);
+    void retire(uint8_t opcode, uint8_t length);
+
+public:
+    LockstepEngine();
+
+    // returns false once every lane is taken
+    bool add(MOS6502 * cpu);
+    size_t lanes();
+
+    // run every lane for steps instructions, or until it halts
+    void run(uint64_t steps);
+
+    // instructions executed as lane groups and through step()
+    uint64_t get_vector_instructions();
+    uint64_t get_scalar_instructions();
+};
+
+#endif
@@ -0,0 +1,150 @@
+#include "mapper.h"
+
+BankedMemory::BankedMemory(size_t size) : storage(size, 0), load_error(MOS6502::LOAD_OK)
+{
+}
+
+bool BankedMemory::load(string filename, size_t offset)
+{
+    FILE * rom = fopen(filename.c_str(), "rb");
+    if(rom == NULL)
+    {
+        load_error = MOS6502::LOAD_OPEN_FAILED;
+        return false;
+    }
+    long size = -1;
+    if(fseek(rom, 0, SEEK_END) == 0)
+    {
+        size = ftell(rom);
+    }
+    if(size < 0 || fseek(rom, 0, SEEK_SET) != 0)
+    {
+        fclose(rom);
+        load_error = MOS6502::LOAD_READ_FAILED;
+        return false;
+    }
+    if(offset > storage.size() || (size_t)size > storage.size() - offset)
+    {
+        fclose(rom);
+        load_error = MOS6502::LOAD_TOO_LARGE;
+        return false;
+    }
+
+    size_t loaded = (size > 0) ? fread(&storage[offset], 1, (size_t)size, rom) : 0;
+    fclose(rom);
+    load_error = (loaded == (size_t)size) ? MOS6502::LOAD_OK : MOS6502::LOAD_READ_FAILED;
+    return load_error == MOS6502::LOAD_OK;
+}
+
+MOS6502::LoadError BankedMemory::get_load_error()
+{
+    return load_error;
+}
+
+uint8_t * BankedMemory::data()
+{
+    return storage.data();
+}
+
+size_t BankedMemory::size()
+{
+    return storage.size();
+}
+
+Mapper::Mapper(MOS6502 & cpu, BankedMemory & banks, uint32_t window_size)
+    : cpu(cpu), banks(banks), window_size(window_size)
+{
+    memset(under, 0, sizeof(under));
+}
+
+int Mapper::add_window(uint16_t location, bool writable)
+{
+    if(bank_count() == 0)
+    {
+        return -1;
+    }
+    Window window = {location, writable, 0};
+    windows.push_back(window);
+    select_bank(windows.size() - 1, 0);
+    return windows.size() - 1;
+}
+
+void Mapper::add_register(uint16_t first, uint16_t last, int window)
+{
+    Register reg = {first, last, window};
+    registers.push_back(reg);
+    claim_pages(first >> PAGE_SHIFT, last >> PAGE_SHIFT);
+}
+
+// Take the writes of pages first_page..last_page, remembering where they
+// went unless the mapper has them already. A window just mapped over a
+// page hands it back, so it is taken again.
+void Mapper::claim_pages(int first_page, int last_page)
+{
+    for(int page = first_page; page <= last_page; page++)
+    {
+        if(cpu.write_pages[page] != NULL || cpu.devices[page] != this)
+        {
+            under[page] = cpu.write_pages[page];
+        }
+    }
+    cpu.map_write_device(first_page, last_page, this);
+}
+
+bool Mapper::select_bank(int window, uint32_t bank)
+{
+    if(window < 0 || (size_t)window >= windows.size())
+    {
+        return false;
+    }
+    Window & selected = windows[window];
+    selected.bank = bank % bank_count(); // out of range banks mirror
+    cpu.map_memory(selected.location, window_size,
+                   banks.data() + (size_t)selected.bank * window_size, selected.writable);
+
+    // keep register pages inside the window routed to the mapper
+    for(size_t i = 0; i < registers.size(); i++)
+    {
+        claim_pages(registers[i].first >> PAGE_SHIFT, registers[i].last >> PAGE_SHIFT);
+    }
+    return true;
+}
+
+uint32_t Mapper::get_bank(int window)
+{
+    return windows[window].bank;
+}
+
+// a partial last window would map pages past the end of the storage
+uint32_t Mapper::bank_count()
+{
+    if(window_size == 0 || window_size % PAGE_SIZE != 0 || banks.size() % window_size != 0)
+    {
+        return 0;
+    }
+    return banks.size() / window_size;
+}
+
+uint8_t Mapper::read(uint16_t)
+{
+    return OPEN_BUS; // register pages outside any window read as open bus
+}
+
+void Mapper::write(uint16_t address, uint8_t value)
+{
+    bool decoded = false;
+    for(size_t i = 0; i < registers.size(); i++)
+    {
+        if(address >= registers[i].first && address <= registers[i].last)
+        {
+            select_bank(registers[i].window, value);
+            decoded = true;
+        }
+    }
+    // anything else on a register page goes where it would have
+    uint8_t * page = under[address >> PAGE_SHIFT];
+    if(!decoded && page != NULL)
+    {
+        cpu.write_through(page, address, value);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "mos6502.h"
+using namespace std;
+
+// Backing store for images larger than the 64K address space. Banks are
+// slices of it that a Mapper makes visible through windows.
+class BankedMemory
+{
+private:
+    vector<uint8_t> storage;
+    MOS6502::LoadError load_error;
+
+public:
+    BankedMemory(size_t size);
+
+    // copy a file in at offset; the whole file must fit, and
+    // get_load_error() says why not if it does not
+    bool load(string filename, size_t offset);
+    MOS6502::LoadError get_load_error();
+
+    uint8_t * data();
+    size_t size();
+};
+
+// Bank-switching hardware: fixed-size windows in the CPU address space,
+// each showing one bank of a BankedMemory. Writing a bank number to a
+// mapper register remaps its window by swapping page pointers, nothing is
+// copied. The mapper takes the writes of every page holding a register and
+// passes those that miss the registers on to the RAM or bank underneath.
+class Mapper : public BusDevice
+{
+private:
+    struct Window {
+        uint16_t location;
+        bool writable;
+        uint32_t bank;
+    };
+
+    struct Register {
+        uint16_t first;
+        uint16_t last;
+        int window;
+    };
+
+    MOS6502 & cpu;
+    BankedMemory & banks;
+    uint32_t window_size;
+    vector<Window> windows;
+    vector<Register> registers;
+    // where writes to each register page went before the mapper took them,
+    // NULL where they were dropped
+    uint8_t * under[PAGE_COUNT];
+
+    void claim_pages(int first_page, int last_page);
+
+public:
+    // window_size must be a multiple of 256, e.g. 0x1000, 0x2000 or 0x4000,
+    // and the BankedMemory a whole number of windows; windows cannot be
+    // added otherwise
+    Mapper(MOS6502 & cpu, BankedMemory & banks, uint32_t window_size);
+
+    // returns the index of the new window, which starts out on bank 0, or
+    // -1 if the sizes above are wrong
+    int add_window(uint16_t location, bool writable);
+    // writes anywhere in first..last select the bank of window
+    void add_register(uint16_t first, uint16_t last, int window);
+
+    // out of range banks mirror; false for an unknown window
+    bool select_bank(int window, uint32_t bank);
+    uint32_t get_bank(int window);
+    uint32_t bank_count(); // 0 if the sizes above are wrong
+
+    uint8_t read(uint16_t address);
+    void write(uint16_t address, uint8_t value);
+};
+
+#endif
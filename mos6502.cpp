@@ -1,212 +1,2009 @@
 #include "mos6502.h"
+#include "disassembler.h"
+#include "jit.h"
+#include "rom_image.h"
+#include "trace.h"
+#include "profiler.h"
+
+//TODO: BRK, decimal mode, document
+
+// opcode, operation, addressing mode, memory access, mnemonic, base cycles
+#define OPCODE_TABLE(X) \
+    X(0x00, BRK, IMP, NONE, "BRK", 7) \
+    X(0x01, ORA, IIX, READ, "ORA", 6) \
+    X(0x02, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x03, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x04, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x05, ORA, ZPG, READ, "ORA", 3) \
+    X(0x06, ASL, ZPG, RMW, "ASL", 5) \
+    X(0x07, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x08, PHP, IMP, NONE, "PHP", 3) \
+    X(0x09, ORA, IMM, READ, "ORA", 2) \
+    X(0x0A, ASL, ACC, RMW, "ASL", 2) \
+    X(0x0B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x0C, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x0D, ORA, ABS, READ, "ORA", 4) \
+    X(0x0E, ASL, ABS, RMW, "ASL", 6) \
+    X(0x0F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x10, BPL, REL, NONE, "BPL", 2) \
+    X(0x11, ORA, IIY, READ, "ORA", 5) \
+    X(0x12, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x13, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x14, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x15, ORA, ZPX, READ, "ORA", 4) \
+    X(0x16, ASL, ZPX, RMW, "ASL", 6) \
+    X(0x17, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x18, CLC, IMP, NONE, "CLC", 2) \
+    X(0x19, ORA, AIY, READ, "ORA", 4) \
+    X(0x1A, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x1B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x1C, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x1D, ORA, AIX, READ, "ORA", 4) \
+    X(0x1E, ASL, AIX, RMW, "ASL", 7) \
+    X(0x1F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x20, JSR, ABS, NONE, "JSR", 6) \
+    X(0x21, AND, IIX, READ, "AND", 6) \
+    X(0x22, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x23, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x24, BIT, ZPG, READ, "BIT", 3) \
+    X(0x25, AND, ZPG, READ, "AND", 3) \
+    X(0x26, ROL, ZPG, RMW, "ROL", 5) \
+    X(0x27, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x28, PLP, IMP, NONE, "PLP", 4) \
+    X(0x29, AND, IMM, READ, "AND", 2) \
+    X(0x2A, ROL, ACC, RMW, "ROL", 2) \
+    X(0x2B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x2C, BIT, ABS, READ, "BIT", 4) \
+    X(0x2D, AND, ABS, READ, "AND", 4) \
+    X(0x2E, ROL, ABS, RMW, "ROL", 6) \
+    X(0x2F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x30, BMI, REL, NONE, "BMI", 2) \
+    X(0x31, AND, IIY, READ, "AND", 5) \
+    X(0x32, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x33, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x34, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x35, AND, ZPX, READ, "AND", 4) \
+    X(0x36, ROL, ZPX, RMW, "ROL", 6) \
+    X(0x37, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x38, SEC, IMP, NONE, "SEC", 2) \
+    X(0x39, AND, AIY, READ, "AND", 4) \
+    X(0x3A, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x3B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x3C, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x3D, AND, AIX, READ, "AND", 4) \
+    X(0x3E, ROL, AIX, RMW, "ROL", 7) \
+    X(0x3F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x40, RTI, IMP, NONE, "RTI", 6) \
+    X(0x41, EOR, IIX, READ, "EOR", 6) \
+    X(0x42, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x43, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x44, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x45, EOR, ZPG, READ, "EOR", 3) \
+    X(0x46, LSR, ZPG, RMW, "LSR", 5) \
+    X(0x47, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x48, PHA, IMP, NONE, "PHA", 3) \
+    X(0x49, EOR, IMM, READ, "EOR", 2) \
+    X(0x4A, LSR, ACC, RMW, "LSR", 2) \
+    X(0x4B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x4C, JMP, ABS, NONE, "JMP", 3) \
+    X(0x4D, EOR, ABS, READ, "EOR", 4) \
+    X(0x4E, LSR, ABS, RMW, "LSR", 6) \
+    X(0x4F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x50, BVC, REL, NONE, "BVC", 2) \
+    X(0x51, EOR, IIY, READ, "EOR", 5) \
+    X(0x52, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x53, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x54, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x55, EOR, ZPX, READ, "EOR", 4) \
+    X(0x56, LSR, ZPX, RMW, "LSR", 6) \
+    X(0x57, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x58, CLI, IMP, NONE, "CLI", 2) \
+    X(0x59, EOR, AIY, READ, "EOR", 4) \
+    X(0x5A, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x5B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x5C, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x5D, EOR, AIX, READ, "EOR", 4) \
+    X(0x5E, LSR, AIX, RMW, "LSR", 7) \
+    X(0x5F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x60, RTS, IMP, NONE, "RTS", 6) \
+    X(0x61, ADC, IIX, READ, "ADC", 6) \
+    X(0x62, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x63, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x64, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x65, ADC, ZPG, READ, "ADC", 3) \
+    X(0x66, ROR, ZPG, RMW, "ROR", 5) \
+    X(0x67, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x68, PLA, IMP, NONE, "PLA", 4) \
+    X(0x69, ADC, IMM, READ, "ADC", 2) \
+    X(0x6A, ROR, ACC, RMW, "ROR", 2) \
+    X(0x6B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x6C, JMP, IND, NONE, "JMP", 5) \
+    X(0x6D, ADC, ABS, READ, "ADC", 4) \
+    X(0x6E, ROR, ABS, RMW, "ROR", 6) \
+    X(0x6F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x70, BVS, REL, NONE, "BVS", 2) \
+    X(0x71, ADC, IIY, READ, "ADC", 5) \
+    X(0x72, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x73, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x74, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x75, ADC, ZPX, READ, "ADC", 4) \
+    X(0x76, ROR, ZPX, RMW, "ROR", 6) \
+    X(0x77, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x78, SEI, IMP, NONE, "SEI", 2) \
+    X(0x79, ADC, AIY, READ, "ADC", 4) \
+    X(0x7A, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x7B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x7C, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x7D, ADC, AIX, READ, "ADC", 4) \
+    X(0x7E, ROR, AIX, RMW, "ROR", 7) \
+    X(0x7F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x80, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x81, STA, IIX, WRITE, "STA", 6) \
+    X(0x82, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x83, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x84, STY, ZPG, WRITE, "STY", 3) \
+    X(0x85, STA, ZPG, WRITE, "STA", 3) \
+    X(0x86, STX, ZPG, WRITE, "STX", 3) \
+    X(0x87, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x88, DEY, IMP, NONE, "DEY", 2) \
+    X(0x89, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x8A, TXA, IMP, NONE, "TXA", 2) \
+    X(0x8B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x8C, STY, ABS, WRITE, "STY", 4) \
+    X(0x8D, STA, ABS, WRITE, "STA", 4) \
+    X(0x8E, STX, ABS, WRITE, "STX", 4) \
+    X(0x8F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x90, BCC, REL, NONE, "BCC", 2) \
+    X(0x91, STA, IIY, WRITE, "STA", 6) \
+    X(0x92, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x93, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x94, STY, ZPX, WRITE, "STY", 4) \
+    X(0x95, STA, ZPX, WRITE, "STA", 4) \
+    X(0x96, STX, ZPY, WRITE, "STX", 4) \
+    X(0x97, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x98, TYA, IMP, NONE, "TYA", 2) \
+    X(0x99, STA, AIY, WRITE, "STA", 5) \
+    X(0x9A, TXS, IMP, NONE, "TXS", 2) \
+    X(0x9B, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x9C, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x9D, STA, AIX, WRITE, "STA", 5) \
+    X(0x9E, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0x9F, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xA0, LDY, IMM, READ, "LDY", 2) \
+    X(0xA1, LDA, IIX, READ, "LDA", 6) \
+    X(0xA2, LDX, IMM, READ, "LDX", 2) \
+    X(0xA3, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xA4, LDY, ZPG, READ, "LDY", 3) \
+    X(0xA5, LDA, ZPG, READ, "LDA", 3) \
+    X(0xA6, LDX, ZPG, READ, "LDX", 3) \
+    X(0xA7, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xA8, TAY, IMP, NONE, "TAY", 2) \
+    X(0xA9, LDA, IMM, READ, "LDA", 2) \
+    X(0xAA, TAX, IMP, NONE, "TAX", 2) \
+    X(0xAB, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xAC, LDY, ABS, READ, "LDY", 4) \
+    X(0xAD, LDA, ABS, READ, "LDA", 4) \
+    X(0xAE, LDX, ABS, READ, "LDX", 4) \
+    X(0xAF, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xB0, BCS, REL, NONE, "BCS", 2) \
+    X(0xB1, LDA, IIY, READ, "LDA", 5) \
+    X(0xB2, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xB3, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xB4, LDY, ZPX, READ, "LDY", 4) \
+    X(0xB5, LDA, ZPX, READ, "LDA", 4) \
+    X(0xB6, LDX, ZPY, READ, "LDX", 4) \
+    X(0xB7, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xB8, CLV, IMP, NONE, "CLV", 2) \
+    X(0xB9, LDA, AIY, READ, "LDA", 4) \
+    X(0xBA, TSX, IMP, NONE, "TSX", 2) \
+    X(0xBB, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xBC, LDY, AIX, READ, "LDY", 4) \
+    X(0xBD, LDA, AIX, READ, "LDA", 4) \
+    X(0xBE, LDX, AIY, READ, "LDX", 4) \
+    X(0xBF, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xC0, CPY, IMM, READ, "CPY", 2) \
+    X(0xC1, CMP, IIX, READ, "CMP", 6) \
+    X(0xC2, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xC3, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xC4, CPY, ZPG, READ, "CPY", 3) \
+    X(0xC5, CMP, ZPG, READ, "CMP", 3) \
+    X(0xC6, DEC, ZPG, RMW, "DEC", 5) \
+    X(0xC7, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xC8, INY, IMP, NONE, "INY", 2) \
+    X(0xC9, CMP, IMM, READ, "CMP", 2) \
+    X(0xCA, DEX, IMP, NONE, "DEX", 2) \
+    X(0xCB, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xCC, CPY, ABS, READ, "CPY", 4) \
+    X(0xCD, CMP, ABS, READ, "CMP", 4) \
+    X(0xCE, DEC, ABS, RMW, "DEC", 6) \
+    X(0xCF, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xD0, BNE, REL, NONE, "BNE", 2) \
+    X(0xD1, CMP, IIY, READ, "CMP", 5) \
+    X(0xD2, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xD3, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xD4, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xD5, CMP, ZPX, READ, "CMP", 4) \
+    X(0xD6, DEC, ZPX, RMW, "DEC", 6) \
+    X(0xD7, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xD8, CLD, IMP, NONE, "CLD", 2) \
+    X(0xD9, CMP, AIY, READ, "CMP", 4) \
+    X(0xDA, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xDB, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xDC, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xDD, CMP, AIX, READ, "CMP", 4) \
+    X(0xDE, DEC, AIX, RMW, "DEC", 7) \
+    X(0xDF, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xE0, CPX, IMM, READ, "CPX", 2) \
+    X(0xE1, SBC, IIX, READ, "SBC", 6) \
+    X(0xE2, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xE3, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xE4, CPX, ZPG, READ, "CPX", 3) \
+    X(0xE5, SBC, ZPG, READ, "SBC", 3) \
+    X(0xE6, INC, ZPG, RMW, "INC", 5) \
+    X(0xE7, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xE8, INX, IMP, NONE, "INX", 2) \
+    X(0xE9, SBC, IMM, READ, "SBC", 2) \
+    X(0xEA, NOP, IMP, NONE, "NOP", 2) \
+    X(0xEB, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xEC, CPX, ABS, READ, "CPX", 4) \
+    X(0xED, SBC, ABS, READ, "SBC", 4) \
+    X(0xEE, INC, ABS, RMW, "INC", 6) \
+    X(0xEF, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xF0, BEQ, REL, NONE, "BEQ", 2) \
+    X(0xF1, SBC, IIY, READ, "SBC", 5) \
+    X(0xF2, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xF3, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xF4, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xF5, SBC, ZPX, READ, "SBC", 4) \
+    X(0xF6, INC, ZPX, RMW, "INC", 6) \
+    X(0xF7, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xF8, SED, IMP, NONE, "SED", 2) \
+    X(0xF9, SBC, AIY, READ, "SBC", 4) \
+    X(0xFA, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xFB, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xFC, ILLEGAL, IMP, NONE, "ILL", 2) \
+    X(0xFD, SBC, AIX, READ, "SBC", 4) \
+    X(0xFE, INC, AIX, RMW, "INC", 7) \
+    X(0xFF, ILLEGAL, IMP, NONE, "ILL", 2)
+
+#define DECODER_ENTRY(opcode, op, mode, access, name, cycles) {&MOS6502::op_##op, mode, access, name, cycles},
+#define THREADED_CASE(opcode, op, mode, access, name, cycles) \
+    case opcode: \
+        op_##op(operand<mode>(access)); \
+        if((access == WRITE || access == RMW) && pending_write != NONE) \
+        { \
+            complete_write(); \
+        } \
+        cycle_count += cycles; \
+        break;
+
+// as THREADED_CASE, with the operand taken from a pre-decoded micro-op
+#define TRANSLATED_CASE(opcode, op, mode, access, name, cycles) \
+    case opcode: \
+        op_##op(translated_operand<mode>(*uop, access)); \
+        if((access == WRITE || access == RMW) && pending_write != NONE) \
+        { \
+            complete_write(); \
+        } \
+        cycle_count += cycles; \
+        break;
+
+// Blocks are looked up by start address. Each page remembers which block
+// starts have code on it, so a write there only drops those blocks.
+struct MOS6502::TranslationCache {
+    struct Block {
+        uint32_t first; // index of the first micro-op in ops
+        uint16_t count;
+        uint16_t start;
+        uint16_t last;  // address of the last instruction
+        uint32_t runs;
+        JitCompiler::NativeBlock native;
+    };
+
+    int32_t entry[MEMORY_SIZE]; // block index by start address, -1 if none
+    vector<Block> blocks;
+    vector<MicroOp> ops;
+    vector<uint16_t> page_starts[PAGE_COUNT];
+    bool flush_pending; // drop everything before the next block runs
+    JitCompiler * jit;  // created for the NATIVE core only
+
+    TranslationCache() : flush_pending(true), jit(NULL) {}
+    ~TranslationCache() { delete jit; }
+};
+
+// Binary min-heap on (cycle, id); ids only grow, so events due on the same
+// cycle come out in the order they were scheduled.
+struct MOS6502::EventQueue {
+    struct Event {
+        uint64_t cycle;
+        uint64_t id;
+        EventCallback callback;
+        const void * owner; // NULL for events that copy with the CPU
+    };
+
+    vector<Event> heap;
+    uint64_t next_id;
+
+    EventQueue() : next_id(0) {}
+
+    // heap order for the standard heap algorithms, earliest event on top
+    static bool later(const Event & a, const Event & b)
+    {
+        return a.cycle != b.cycle ? a.cycle > b.cycle : a.id > b.id;
+    }
+};
+
+const MOS6502::Instruction MOS6502::decoder[256] =
+{
+    OPCODE_TABLE(DECODER_ENTRY)
+};
+
+MOS6502::MOS6502()
+{
+    initialize(NULL);
+}
+
+MOS6502::MOS6502(string filename)
+{
+    initialize(NULL);
+    load(filename);
+}
+
+MOS6502::MOS6502(string filename, uint16_t location)
+{
+    initialize(NULL);
+    load(filename, location);
+}
+
+MOS6502::MOS6502(uint8_t * external_memory)
+{
+    initialize(external_memory);
+}
+
+MOS6502::MOS6502(const RomImage & rom, uint16_t location)
+{
+    initialize(NULL);
+    map_rom(rom, location);
+}
+
+MOS6502::MOS6502(const MOS6502 & other)
+{
+    memory = new uint8_t[MEMORY_SIZE];
+    owns_memory = true;
+    translation = NULL;
+    events = NULL;
+    trace = NULL;
+    profiler = NULL;
+    *this = other;
+}
+
+MOS6502::~MOS6502()
+{
+    if(owns_memory)
+    {
+        delete[] memory;
+    }
+    delete translation;
+    delete events;
+}
+
+void * MOS6502::operator new(size_t size)
+{
+    void * block;
+    if(posix_memalign(&block, CACHE_LINE_SIZE, size) != 0)
+    {
+        throw bad_alloc();
+    }
+    return block;
+}
+
+void * MOS6502::operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void MOS6502::operator delete(void * block)
+{
+    free(block);
+}
+
+void MOS6502::operator delete[](void * block)
+{
+    free(block);
+}
+
+// Memory contents are copied into this CPU's own buffer, and page pointers
+// into the source's memory are rebased onto it; anything else (devices,
+// external pages) stays shared. Trace buffers and profilers take records
+// from a single CPU, so this one keeps its own, and events they own stay
+// with the source.
+MOS6502 & MOS6502::operator=(const MOS6502 & other)
+{
+    if(this != &other)
+    {
+        uint8_t * own_memory = memory;
+        bool owned = owns_memory;
+        TraceBuffer * own_trace = trace;
+        Profiler * own_profiler = profiler;
+        delete translation;
+        delete events;
+        memcpy(static_cast<void *>(this), &other, sizeof(MOS6502));
+        memory = own_memory;
+        owns_memory = owned;
+        trace = own_trace;
+        profiler = own_profiler;
+        memcpy(memory, other.memory, MEMORY_SIZE);
+        translation = NULL;
+        memset(code_pages, 0, PAGE_COUNT);
+        if(other.events != NULL)
+        {
+            events = new EventQueue(*other.events);
+            vector<EventQueue::Event> & heap = events->heap;
+            size_t kept = 0;
+            for(size_t i = 0; i < heap.size(); i++)
+            {
+                if(heap[i].owner == NULL)
+                {
+                    heap[kept++] = heap[i];
+                }
+            }
+            heap.resize(kept);
+            make_heap(heap.begin(), heap.end(), EventQueue::later);
+            next_event = heap.empty() ? NO_EVENT : heap.front().cycle;
+        }
+        for(int page = 0; page < PAGE_COUNT; page++)
+        {
+            if(read_pages[page] == &other.memory[page << PAGE_SHIFT])
+            {
+                read_pages[page] = &memory[page << PAGE_SHIFT];
+            }
+            if(write_pages[page] == &other.memory[page << PAGE_SHIFT])
+            {
+                write_pages[page] = &memory[page << PAGE_SHIFT];
+            }
+        }
+    }
+    return *this;
+}
+
+void MOS6502::initialize(uint8_t * external_memory)
+{
+    owns_memory = (external_memory == NULL);
+    memory = owns_memory ? new uint8_t[MEMORY_SIZE]() : external_memory;
+    core = REFERENCE;
+    for(int page = 0; page < PAGE_COUNT; page++)
+    {
+        read_pages[page] = &memory[page << PAGE_SHIFT];
+        write_pages[page] = &memory[page << PAGE_SHIFT];
+        devices[page] = NULL;
+    }
+    operand_addr = 0;
+    bus_latch = 0;
+    bus_original = 0;
+    pending_write = NONE;
+    memset(dirty_pages, 1, PAGE_COUNT);
+    halt_conditions = 0;
+    load_error = LOAD_OK;
+    halt_reason = STOP_NONE;
+    cycle_count = 0;
+    instruction_count = 0;
+    last_PC = 0;
+    last_bytes[0] = last_bytes[1] = last_bytes[2] = 0;
+    translation = NULL;
+    jit_threshold = JIT_THRESHOLD;
+    native_instructions = 0;
+    irq_lines = 0;
+    nmi_pending = false;
+    reset_pending = false;
+    interrupt_pending = false;
+    events = NULL;
+    next_event = NO_EVENT;
+    idle_skip = true;
+    idle_armed = false;
+    idle.branch = -1;
+    idle.rejected = -1;
+    idle_countdown = 1;
+    idle_cycles = 0;
+    trace = NULL;
+    profiler = NULL;
+    memset(code_pages, 0, PAGE_COUNT);
+    code_modified = false;
+    if(owns_memory)
+    {
+        // set RESET vector to first address after stack
+        memory[RESET_LOW] = 0x00;
+        memory[RESET_HIGH] = 0x02;
+    }
+    reset();
+}
+
+bool MOS6502::load(string filename)
+{
+    return load(filename, reg_PC);
+}
+
+// Only the pages the file covers are marked dirty.
+bool MOS6502::load(string filename, uint16_t location)
+{
+    FILE * rom = fopen(filename.c_str(), "rb");
+    if(rom == NULL)
+    {
+        load_error = LOAD_OPEN_FAILED;
+        return false;
+    }
+    long size = -1;
+    if(fseek(rom, 0, SEEK_END) == 0)
+    {
+        size = ftell(rom);
+    }
+    if(size < 0 || fseek(rom, 0, SEEK_SET) != 0)
+    {
+        fclose(rom);
+        load_error = LOAD_READ_FAILED;
+        return false;
+    }
+    if(size > MEMORY_SIZE - location)
+    {
+        fclose(rom);
+        load_error = LOAD_TOO_LARGE;
+        return false;
+    }
+
+    size_t loaded = fread(&memory[location], 1, (size_t)size, rom);
+    fclose(rom);
+    if(loaded > 0)
+    {
+        int first = location >> PAGE_SHIFT;
+        int last = (location + loaded - 1) >> PAGE_SHIFT;
+        memset(&dirty_pages[first], 1, last - first + 1);
+        flush_translations();
+    }
+    load_error = (loaded == (size_t)size) ? LOAD_OK : LOAD_READ_FAILED;
+    return load_error == LOAD_OK;
+}
+
+bool MOS6502::map_rom(const RomImage & rom, uint16_t location)
+{
+    if(!rom.is_open())
+    {
+        load_error = LOAD_OPEN_FAILED;
+        return false;
+    }
+    if(location & LOW_BYTE)
+    {
+        load_error = LOAD_NOT_ALIGNED;
+        return false;
+    }
+    if(rom.size() > (size_t)(MEMORY_SIZE - location))
+    {
+        load_error = LOAD_TOO_LARGE;
+        return false;
+    }
+    // RomImage pads its last page, and read-only pages are never written
+    uint32_t size = (rom.size() + PAGE_SIZE - 1) & ~(uint32_t)LOW_BYTE;
+    map_memory(location, size, const_cast<uint8_t *>(rom.data()), false);
+    load_error = LOAD_OK;
+    return true;
+}
+
+MOS6502::LoadError MOS6502::get_load_error()
+{
+    return load_error;
+}
+
+void MOS6502::reset()
+{
+    reg_A = 0x00;
+    reg_X = 0x00;
+    reg_Y = 0x00;
+    reg_SP = SP_START;
+    reg_PC = read_word(RESET_LOW); // set program counter to RESET vector
+    reg_status = FLAG_U | FLAG_I;
+    set_NZ(0, 0);
+    update_interrupts();
+    if(profiler != NULL)
+    {
+        profiler->reset_calls();
+    }
+}
+
+void MOS6502::snapshot(Snapshot & state)
+{
+    state.A = reg_A;
+    state.X = reg_X;
+    state.Y = reg_Y;
+    state.status = get_status();
+    state.SP = reg_SP;
+    state.PC = reg_PC;
+    state.cycles = cycle_count;
+    memcpy(state.memory, memory, MEMORY_SIZE);
+    memset(dirty_pages, 0, PAGE_COUNT);
+}
+
+void MOS6502::restore(const Snapshot & state)
+{
+    reg_A = state.A;
+    reg_X = state.X;
+    reg_Y = state.Y;
+    set_status(state.status);
+    reg_SP = state.SP;
+    reg_PC = state.PC;
+    cycle_count = state.cycles;
+    memcpy(memory, state.memory, MEMORY_SIZE);
+    memset(dirty_pages, 0, PAGE_COUNT);
+    flush_translations();
+    clear_run_state();
+}
+
+// Only pages written since the base snapshot are stored.
+void MOS6502::snapshot(SnapshotDelta & delta)
+{
+    delta.A = reg_A;
+    delta.X = reg_X;
+    delta.Y = reg_Y;
+    delta.status = get_status();
+    delta.SP = reg_SP;
+    delta.PC = reg_PC;
+    delta.cycles = cycle_count;
+    delta.pages.clear();
+    delta.data.clear();
+    for(int page = 0; page < PAGE_COUNT; page++)
+    {
+        if(dirty_pages[page])
+        {
+            delta.pages.push_back(page);
+            delta.data.insert(delta.data.end(), &memory[page << PAGE_SHIFT], &memory[(page + 1) << PAGE_SHIFT]);
+        }
+    }
+}
+
+// Pages dirtied since base that the delta does not hold go back to the
+// base contents, then the delta's pages are copied in. Nothing else is
+// touched, so the cost follows the number of changed pages.
+void MOS6502::restore(const Snapshot & base, const SnapshotDelta & delta)
+{
+    reg_A = delta.A;
+    reg_X = delta.X;
+    reg_Y = delta.Y;
+    set_status(delta.status);
+    reg_SP = delta.SP;
+    reg_PC = delta.PC;
+    cycle_count = delta.cycles;
+
+    for(int page = 0; page < PAGE_COUNT; page++)
+    {
+        if(dirty_pages[page])
+        {
+            memcpy(&memory[page << PAGE_SHIFT], &base.memory[page << PAGE_SHIFT], PAGE_SIZE);
+            dirty_pages[page] = 0;
+        }
+    }
+    for(size_t i = 0; i < delta.pages.size(); i++)
+    {
+        int page = delta.pages[i];
+        memcpy(&memory[page << PAGE_SHIFT], &delta.data[i * PAGE_SIZE], PAGE_SIZE);
+        dirty_pages[page] = 1;
+    }
+    flush_translations();
+    clear_run_state();
+}
+
+// Idle loop tracking and pending NMI and RESET edges belong to the run the
+// state came from, not to the restored one. IRQ lines stay, since devices
+// hold them.
+void MOS6502::clear_run_state()
+{
+    idle_armed = false;
+    idle.branch = -1;
+    idle.rejected = -1;
+    idle_countdown = 1;
+    nmi_pending = false;
+    reset_pending = false;
+    update_interrupts();
+}
+
+// File layout: magic, version (u32), A, X, Y, status, SP (u16), PC (u16),
+// cycles (u64), then the memory image. Multi-byte fields are little-endian
+// so files move between hosts.
+static void put_le(FILE * file, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+    {
+        fputc((value >> (8 * i)) & LOW_BYTE, file);
+    }
+}
+
+static uint64_t get_le(FILE * file, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)(fgetc(file) & LOW_BYTE) << (8 * i);
+    }
+    return value;
+}
+
+static bool snapshot_result(MOS6502::SnapshotError result, MOS6502::SnapshotError * error)
+{
+    if(error != NULL)
+    {
+        *error = result;
+    }
+    return result == MOS6502::SNAPSHOT_OK;
+}
+
+bool MOS6502::Snapshot::save(string filename, SnapshotError * error) const
+{
+    FILE * file = fopen(filename.c_str(), "wb");
+    if(file == NULL)
+    {
+        return snapshot_result(SNAPSHOT_OPEN_FAILED, error);
+    }
+
+    fwrite(SNAPSHOT_MAGIC, 1, strlen(SNAPSHOT_MAGIC), file);
+    put_le(file, SNAPSHOT_VERSION, 4);
+    put_le(file, A, 1);
+    put_le(file, X, 1);
+    put_le(file, Y, 1);
+    put_le(file, status, 1);
+    put_le(file, SP, 2);
+    put_le(file, PC, 2);
+    put_le(file, cycles, 8);
+    size_t written = fwrite(memory, 1, MEMORY_SIZE, file);
+    bool ok = (written == MEMORY_SIZE) && !ferror(file);
+    ok = (fclose(file) == 0) && ok;
+    return snapshot_result(ok ? SNAPSHOT_OK : SNAPSHOT_WRITE_FAILED, error);
+}
+
+bool MOS6502::Snapshot::load(string filename, SnapshotError * error)
+{
+    FILE * file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+    {
+        return snapshot_result(SNAPSHOT_OPEN_FAILED, error);
+    }
+
+    char magic[sizeof(SNAPSHOT_MAGIC)] = {0};
+    SnapshotError result = SNAPSHOT_BAD_FORMAT;
+    if(fread(magic, 1, strlen(SNAPSHOT_MAGIC), file) == strlen(SNAPSHOT_MAGIC) &&
+       strcmp(magic, SNAPSHOT_MAGIC) == 0 &&
+       get_le(file, 4) == SNAPSHOT_VERSION)
+    {
+        A = get_le(file, 1);
+        X = get_le(file, 1);
+        Y = get_le(file, 1);
+        status = get_le(file, 1);
+        SP = get_le(file, 2);
+        PC = get_le(file, 2);
+        cycles = get_le(file, 8);
+        bool ok = fread(memory, 1, MEMORY_SIZE, file) == MEMORY_SIZE;
+        result = ok ? SNAPSHOT_OK : SNAPSHOT_READ_FAILED;
+    }
+
+    fclose(file);
+    return snapshot_result(result, error);
+}
+
+MOS6502::StopReason MOS6502::run(uint64_t steps)
+{
+    return run_until(steps, -1, NULL, 0);
+}
+
+MOS6502::StopReason MOS6502::run(uint64_t steps, uint16_t stop_PC)
+{
+    return run_until(steps, stop_PC, NULL, 0);
+}
+
+MOS6502::StopReason MOS6502::run(uint64_t steps, const function<bool(MOS6502 &)> & predicate, uint64_t interval)
+{
+    return run_until(steps, -1, &predicate, interval);
+}
+
+MOS6502::StopReason MOS6502::run_until(uint64_t steps, int32_t stop_PC, const function<bool(MOS6502 &)> * predicate, uint64_t interval)
+{
+    StopReason reason;
+    idle_armed = idle_skip && profiler == NULL;
+    idle.branch = -1;
+    idle.rejected = -1;
+    bool hooked = instrumented();
+    if(core == THREADED)
+    {
+        reason = hooked ? run_loop<THREADED, true>(steps, stop_PC, predicate, interval)
+                        : run_loop<THREADED, false>(steps, stop_PC, predicate, interval);
+        record_last_bytes();
+    }
+    else if(core == TRANSLATED || core == NATIVE)
+    {
+        reason = hooked ? run_loop<TRANSLATED, true>(steps, stop_PC, predicate, interval)
+                        : run_loop<TRANSLATED, false>(steps, stop_PC, predicate, interval);
+        record_last_bytes();
+    }
+    else
+    {
+        reason = hooked ? run_loop<REFERENCE, true>(steps, stop_PC, predicate, interval)
+                        : run_loop<REFERENCE, false>(steps, stop_PC, predicate, interval);
+    }
+    idle_armed = false;
+    return reason;
+}
+
+// The predicate is only consulted between chunks of `interval` instructions,
+// so the inner loop is left with a counter, a PC compare and the halt flag.
+template<MOS6502::Core C, bool INSTRUMENTED>
+MOS6502::StopReason MOS6502::run_loop(uint64_t steps, int32_t stop_PC, const function<bool(MOS6502 &)> * predicate, uint64_t interval)
+{
+    if(predicate == NULL || interval == 0)
+    {
+        interval = steps;
+    }
+
+    halt_reason = STOP_NONE;
+    while(steps > 0)
+    {
+        uint64_t chunk = (steps < interval) ? steps : interval;
+        steps -= chunk;
+
+        for(uint64_t i = 0; i < chunk; )
+        {
+            if(cycle_count >= next_event)
+            {
+                dispatch_events();
+            }
+
+            if(C == TRANSLATED)
+            {
+                i += run_block<INSTRUMENTED>(chunk - i, stop_PC, NO_EVENT);
+            }
+            else if(INSTRUMENTED)
+            {
+                step_instrumented<C>(cycle_count);
+                i++;
+            }
+            else if(C == THREADED)
+            {
+                step_threaded();
+                i++;
+            }
+            else
+            {
+                step_reference();
+                i++;
+            }
+
+            if(halt_reason != STOP_NONE)
+            {
+                if(halt_reason != STOP_IDLE)
+                {
+                    instruction_count += i;
+                    return halt_reason;
+                }
+                halt_reason = STOP_NONE;
+                if(reg_PC != stop_PC)
+                {
+                    i += skip_idle_loop(instruction_count + i, chunk - i, NO_EVENT);
+                }
+            }
+            if(reg_PC == stop_PC)
+            {
+                instruction_count += i;
+                return STOP_PC;
+            }
+        }
+        instruction_count += chunk;
+
+        if(predicate != NULL && (*predicate)(*this))
+        {
+            return STOP_PREDICATE;
+        }
+    }
+
+    return STOP_COUNT;
+}
+
+uint64_t MOS6502::run_cycles(uint64_t budget)
+{
+    uint64_t target = cycle_count + budget;
+    idle_armed = idle_skip && profiler == NULL;
+    idle.branch = -1;
+    idle.rejected = -1;
+    halt_reason = STOP_NONE;
+    bool hooked = instrumented();
+    if(core == THREADED)
+    {
+        if(hooked)
+        {
+            run_cycles_loop<THREADED, true>(target);
+        }
+        else
+        {
+            run_cycles_loop<THREADED, false>(target);
+        }
+        record_last_bytes();
+    }
+    else if(core == TRANSLATED || core == NATIVE)
+    {
+        if(hooked)
+        {
+            run_cycles_loop<TRANSLATED, true>(target);
+        }
+        else
+        {
+            run_cycles_loop<TRANSLATED, false>(target);
+        }
+        record_last_bytes();
+    }
+    else
+    {
+        if(hooked)
+        {
+            run_cycles_loop<REFERENCE, true>(target);
+        }
+        else
+        {
+            run_cycles_loop<REFERENCE, false>(target);
+        }
+    }
+    idle_armed = false;
+    return cycle_count - target;
+}
+
+template<MOS6502::Core C, bool INSTRUMENTED>
+void MOS6502::run_cycles_loop(uint64_t target)
+{
+    while(cycle_count < target)
+    {
+        if(cycle_count >= next_event)
+        {
+            dispatch_events();
+        }
+        if(C == TRANSLATED)
+        {
+            // whole blocks up to the target; the block stops itself there
+            instruction_count += run_block<INSTRUMENTED>(~(uint64_t)0, -1, target);
+        }
+        else
+        {
+            if(INSTRUMENTED)
+            {
+                step_instrumented<C>(cycle_count);
+            }
+            else if(C == THREADED)
+            {
+                step_threaded();
+            }
+            else
+            {
+                step_reference();
+            }
+            instruction_count++;
+        }
+        if(halt_reason == STOP_IDLE)
+        {
+            halt_reason = STOP_NONE;
+            instruction_count += skip_idle_loop(instruction_count, ~(uint64_t)0, target);
+        }
+    }
+}
+
+void MOS6502::step()
+{
+    if(cycle_count >= next_event)
+    {
+        dispatch_events();
+    }
+    instruction_count++;
+    bool hooked = instrumented();
+    // the instruction's bytes before it runs, as it may overwrite them;
+    // record_last_bytes() reads them back only after an interrupt
+    uint16_t pc = reg_PC;
+    uint8_t bytes[3] = {peek_byte(pc), peek_byte(pc + 1), peek_byte(pc + 2)};
+    if(core == TRANSLATED || core == NATIVE)
+    {
+        if(hooked)
+        {
+            run_block<true>(1, -1, NO_EVENT);
+        }
+        else
+        {
+            run_block<false>(1, -1, NO_EVENT);
+        }
+    }
+    else if(core == THREADED)
+    {
+        if(hooked)
+        {
+            step_instrumented<THREADED>(cycle_count);
+        }
+        else
+        {
+            step_threaded();
+        }
+    }
+    else if(hooked)
+    {
+        step_instrumented<REFERENCE>(cycle_count);
+    }
+    else
+    {
+        step_reference();
+    }
+
+    if(core != REFERENCE)
+    {
+        if(last_PC == pc)
+        {
+            memcpy(last_bytes, bytes, sizeof(bytes));
+        }
+        else
+        {
+            record_last_bytes();
+        }
+    }
+}
+
+uint64_t MOS6502::step_block()
+{
+    if(core != TRANSLATED && core != NATIVE)
+    {
+        step();
+        return 1;
+    }
+    if(cycle_count >= next_event)
+    {
+        dispatch_events();
+    }
+    // a halt left over from an earlier step would end the block at once
+    halt_reason = STOP_NONE;
+    uint64_t count;
+    if(instrumented())
+    {
+        count = run_block<true>(~(uint64_t)0, -1, NO_EVENT);
+    }
+    else
+    {
+        count = run_block<false>(~(uint64_t)0, -1, NO_EVENT);
+    }
+    halt_reason = STOP_NONE;
+    instruction_count += count;
+    record_last_bytes();
+    return count;
+}
+
+inline void MOS6502::step_reference()
+{
+    if(interrupt_pending)
+    {
+        service_interrupt();
+    }
+    last_PC = reg_PC;
+    last_bytes[1] = peek_byte(reg_PC + 1);
+    last_bytes[2] = peek_byte(reg_PC + 2);
+    uint8_t current_instr_byte = fetch();
+    last_bytes[0] = current_instr_byte;
+    const Instruction & decoded_instr = decode(current_instr_byte);
+    execute(decoded_instr);
+}
+
+// Every opcode gets its own case with the addressing mode and operation
+// inlined, so the compiler emits a single jump table over fused handlers.
+inline void MOS6502::step_threaded()
+{
+    if(interrupt_pending)
+    {
+        service_interrupt();
+    }
+    last_PC = reg_PC;
+    switch(read_byte(reg_PC++))
+    {
+        OPCODE_TABLE(THREADED_CASE)
+    }
+}
+
+// The threaded core only tracks the PC of the last instruction; its bytes
+// are picked up from memory once the batch is done.
+void MOS6502::record_last_bytes()
+{
+    last_bytes[0] = peek_byte(last_PC);
+    last_bytes[1] = peek_byte(last_PC + 1);
+    last_bytes[2] = peek_byte(last_PC + 2);
+}
+
+bool MOS6502::instrumented()
+{
+    return trace != NULL || profiler != NULL;
+}
+
+// One REFERENCE or THREADED instruction with tracing or profiling on.
+// Pending interrupts are taken first, so the trace shows the handler's
+// first instruction rather than the one it displaced, and the profile
+// charges the cycles since start to it. Code on device pages is traced as
+// the 0s peek_byte() returns for it.
+template<MOS6502::Core C>
+inline void MOS6502::step_instrumented(uint64_t start)
+{
+    if(interrupt_pending)
+    {
+        service_interrupt();
+    }
+    uint16_t pc = reg_PC;
+    uint8_t opcode = peek_byte(pc);
+    if(trace != NULL)
+    {
+        uint8_t length = Disassembler::length(opcode);
+        trace->record(cycle_count, pc, opcode, (length > 1) ? peek_byte(pc + 1) : 0,
+                      (length > 2) ? peek_byte(pc + 2) : 0, reg_A, reg_X, reg_Y, reg_SP & LOW_BYTE, get_status());
+    }
+    if(C == THREADED)
+    {
+        step_threaded();
+    }
+    else
+    {
+        step_reference();
+    }
+    if(profiler != NULL)
+    {
+        profiler->record(pc, opcode, cycle_count - start, reg_PC, reg_SP & LOW_BYTE);
+    }
+}
+
+// Runs up to limit instructions of the block starting at PC, translating
+// it first if needed, and returns how many ran. Stops early on a halt, at
+// stop_PC, once a write may have changed the block's own code, or at the
+// first instruction boundary at or after cycle until or the next event.
+template<bool INSTRUMENTED>
+uint64_t MOS6502::run_block(uint64_t limit, int32_t stop_PC, uint64_t until)
+{
+    uint64_t start = cycle_count; // profiled instruction start, interrupt included
+    if(translation == NULL)
+    {
+        translation = new TranslationCache;
+    }
+    TranslationCache & cache = *translation;
+    if(cache.flush_pending || cache.ops.size() > TRANSLATION_OPS_LIMIT)
+    {
+        memset(cache.entry, 0xFF, sizeof(cache.entry));
+        cache.blocks.clear();
+        cache.ops.clear();
+        for(int page = 0; page < PAGE_COUNT; page++)
+        {
+            cache.page_starts[page].clear();
+        }
+        memset(code_pages, 0, PAGE_COUNT);
+        if(cache.jit != NULL)
+        {
+            cache.jit->clear();
+        }
+        cache.flush_pending = false;
+    }
+
+    if(interrupt_pending)
+    {
+        service_interrupt();
+    }
+    int32_t index = cache.entry[reg_PC];
+    if(index < 0)
+    {
+        index = translate_block(reg_PC);
+        if(index < 0)
+        {
+            // code on a device page is never cached
+            if(INSTRUMENTED)
+            {
+                step_instrumented<REFERENCE>(start);
+            }
+            else
+            {
+                step_reference();
+            }
+            return 1;
+        }
+    }
+
+    TranslationCache::Block & block = cache.blocks[index];
+    const MicroOp * uop = &cache.ops[block.first];
+    uint64_t count = (block.count < limit) ? block.count : limit;
+    uint64_t i = 0;
+    code_modified = false;
+
+    // Native code runs whole blocks only, so it is skipped when the block
+    // would have to stop part way, including for an event that may fall due
+    // inside it. What it leaves undone is interpreted. Tracing and
+    // profiling need every instruction to go through the interpreter.
+    uint64_t horizon = (until < next_event) ? until : next_event;
+    if(!INSTRUMENTED && core == NATIVE && count == block.count && (stop_PC <= block.start || stop_PC > block.last) &&
+       cycle_count + block.count * INSTRUCTION_MAX_CYCLES <= horizon)
+    {
+        if(block.native == NULL && ++block.runs == jit_threshold)
+        {
+            if(cache.jit == NULL)
+            {
+                cache.jit = new JitCompiler;
+            }
+            block.native = cache.jit->compile(uop, block.count, block.start);
+            if(cache.jit->exhausted())
+            {
+                cache.flush_pending = true;
+            }
+        }
+        if(block.native != NULL && !flag(FLAG_D))
+        {
+            i = run_native(index);
+            native_instructions += i;
+            if(i == count)
+            {
+                check_self_loop();
+                return count;
+            }
+            uop += i;
+        }
+    }
+
+    for(; i < count; i++, uop++)
+    {
+        if(INSTRUMENTED && trace != NULL)
+        {
+            trace->record(cycle_count, reg_PC, uop->opcode, uop->operand & LOW_BYTE, uop->operand >> 8,
+                          reg_A, reg_X, reg_Y, reg_SP & LOW_BYTE, get_status());
+        }
+        last_PC = reg_PC;
+        reg_PC += uop->length;
+        switch(uop->opcode)
+        {
+            OPCODE_TABLE(TRANSLATED_CASE)
+        }
+        if(INSTRUMENTED && profiler != NULL)
+        {
+            profiler->record(last_PC, uop->opcode, cycle_count - start, reg_PC, reg_SP & LOW_BYTE);
+            start = cycle_count;
+        }
+
+        if(halt_reason != STOP_NONE || reg_PC == stop_PC || code_modified || interrupt_pending ||
+           cycle_count >= next_event || cycle_count >= until)
+        {
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+// Decodes straight-line code from start up to the first instruction that
+// can change the flow of control, or BLOCK_MAX_LENGTH instructions. Only
+// RAM and ROM pages are translated. Returns the new block's index, or -1
+// if not even the first instruction could be translated.
+int32_t MOS6502::translate_block(uint16_t start)
+{
+    TranslationCache & cache = *translation;
+    TranslationCache::Block block;
+    block.first = cache.ops.size();
+    block.count = 0;
+    block.start = start;
+    block.runs = 0;
+    block.native = NULL;
+
+    uint16_t pc = start;
+    int registered_page = -1;
+    while(block.count < BLOCK_MAX_LENGTH)
+    {
+        uint8_t opcode = peek_byte(pc);
+        uint8_t length = Disassembler::length(opcode);
+        uint16_t last = pc + length - 1;
+        if(read_pages[pc >> PAGE_SHIFT] == NULL || read_pages[last >> PAGE_SHIFT] == NULL)
+        {
+            break;
+        }
+
+        MicroOp uop;
+        uop.opcode = opcode;
+        uop.length = length;
+        uop.operand = (length > 1) ? peek_byte(pc + 1) : 0;
+        uop.operand |= (length > 2) ? peek_byte(pc + 2) << 8 : 0;
+        cache.ops.push_back(uop);
+        block.count++;
+
+        uint8_t pages[2] = {(uint8_t)(pc >> PAGE_SHIFT), (uint8_t)(last >> PAGE_SHIFT)};
+        for(int i = 0; i < 2; i++)
+        {
+            if(pages[i] != registered_page)
+            {
+                cache.page_starts[pages[i]].push_back(start);
+                code_pages[pages[i]] = 1;
+                registered_page = pages[i];
+            }
+        }
+
+        block.last = pc;
+        pc += length;
+        const Instruction & instr = decoder[opcode];
+        if(instr.addr_mode == REL || instr.op_func == &MOS6502::op_JMP ||
+           instr.op_func == &MOS6502::op_JSR || instr.op_func == &MOS6502::op_RTS ||
+           instr.op_func == &MOS6502::op_RTI || instr.op_func == &MOS6502::op_BRK ||
+           instr.op_func == &MOS6502::op_ILLEGAL)
+        {
+            break;
+        }
+    }
+
+    if(block.count == 0)
+    {
+        return -1;
+    }
+    cache.blocks.push_back(block);
+    cache.entry[start] = cache.blocks.size() - 1;
+    return cache.entry[start];
+}
+
+// Hands the registers to a compiled block and takes back whatever it ran.
+// Blocks that wrap past $FFFF are never compiled.
+uint32_t MOS6502::run_native(int32_t index)
+{
+    TranslationCache::Block & block = translation->blocks[index];
+    if(block.last < block.start)
+    {
+        return 0;
+    }
+
+    JitContext context;
+    context.A = reg_A;
+    context.X = reg_X;
+    context.Y = reg_Y;
+    context.N = flag_N();
+    context.V = flag(FLAG_V);
+    context.Z = flag_Z();
+    context.C = flag(FLAG_C);
+    context.read_pages = read_pages;
+    context.write_pages = write_pages;
+    context.dirty_pages = dirty_pages;
+    context.code_pages = code_pages;
+
+    uint32_t ran = block.native(&context);
+    if(ran > 0)
+    {
+        reg_A = context.A;
+        reg_X = context.X;
+        reg_Y = context.Y;
+        set_NZ(context.N, context.Z);
+        set_flag(FLAG_V, context.V);
+        set_flag(FLAG_C, context.C);
+        reg_PC = context.PC;
+        last_PC = context.last_PC;
+        cycle_count += context.cycles;
+    }
+    return ran;
+}
+
+// Called on a write to a page marked in code_pages
+void MOS6502::invalidate_code(uint8_t page)
+{
+    if(translation != NULL)
+    {
+        vector<uint16_t> & starts = translation->page_starts[page];
+        for(size_t i = 0; i < starts.size(); i++)
+        {
+            translation->entry[starts[i]] = -1;
+        }
+        starts.clear();
+    }
+    code_pages[page] = 0;
+    code_modified = true;
+}
+
+// Memory changed behind the bus (loads, restores): drop every
+// block. The storage itself is only released once no block is running.
+void MOS6502::flush_translations()
+{
+    if(translation != NULL)
+    {
+        translation->flush_pending = true;
+    }
+    memset(code_pages, 0, PAGE_COUNT);
+    code_modified = true;
+}
+
+uint8_t MOS6502::fetch()
+{
+    return read_byte(reg_PC++);
+}
+
+const MOS6502::Instruction & MOS6502::decode(uint8_t byte)
+{
+    return decoder[byte];
+}
+
+void MOS6502::execute(const Instruction & instr)
+{
+    uint8_t * operand = operand_from_mode(instr.addr_mode, instr.access);
+    op_ptr operation = instr.op_func;
+    (this->*operation)(operand);
+    if(pending_write != NONE)
+    {
+        complete_write();
+    }
+    cycle_count += instr.cycles;
+}
+
+uint8_t * MOS6502::operand_from_mode(Mode m, Access access)
+{
+    switch(m)
+    {
+        case ACC: return operand<ACC>(access);
+        case IMM: return operand<IMM>(access);
+        case ABS: return operand<ABS>(access);
+        case ZPG: return operand<ZPG>(access);
+        case ZPX: return operand<ZPX>(access);
+        case ZPY: return operand<ZPY>(access);
+        case AIX: return operand<AIX>(access);
+        case AIY: return operand<AIY>(access);
+        case IMP: return operand<IMP>(access);
+        case REL: return operand<REL>(access);
+        case IIX: return operand<IIX>(access);
+        case IIY: return operand<IIY>(access);
+        case IND: return operand<IND>(access);
+    }
+
+    return operand<IMP>(access);
+}
+
+// Resolves the operand for a compile-time addressing mode, so the switch
+// folds away wherever the mode is known, as in the threaded core.
+// Indexed reads that cross a page boundary cost an extra cycle; writes and
+// read-modify-write instructions always take it and have it in their base
+// cycle count.
+template<MOS6502::Mode M>
+inline uint8_t * MOS6502::operand(Access access)
+{
+    uint16_t addr_location;
+    uint16_t addr;
+    bool page_penalty = (access == READ);
+
+    switch(M)
+    {
+        case ACC:
+            return &reg_A;
+
+        case IMM:
+        case REL:
+            return resolve(reg_PC++, READ);
+
+        case ABS:
+            addr = read_word(reg_PC);
+            reg_PC += 2;
+            break;
+
+        case ZPG:
+            addr = read_byte(reg_PC++);
+            break;
+
+        case ZPX:
+            addr = read_byte(reg_PC++) + reg_X;
+            break;
+
+        case ZPY:
+            addr = read_byte(reg_PC++) + reg_Y;
+            break;
+
+        case AIX:
+            addr_location = read_word(reg_PC);
+            addr = addr_location + reg_X;
+            reg_PC += 2;
+            cycle_count += page_penalty & ((addr ^ addr_location) > LOW_BYTE);
+            break;
+
+        case AIY:
+            addr_location = read_word(reg_PC);
+            addr = addr_location + reg_Y;
+            reg_PC += 2;
+            cycle_count += page_penalty & ((addr ^ addr_location) > LOW_BYTE);
+            break;
+
+        case IMP:
+            return &bus_latch; // unused
+
+        case IIX:
+            addr_location = read_byte(reg_PC++) + reg_X;
+            addr = read_word(addr_location);
+            break;
+
+        case IIY:
+            addr_location = read_byte(reg_PC++);
+            addr_location = read_word(addr_location);
+            addr = addr_location + reg_Y;
+            cycle_count += page_penalty & ((addr ^ addr_location) > LOW_BYTE);
+            break;
+
+        case IND:
+            addr_location = read_word(reg_PC);
+            reg_PC += 2;
+            addr = read_word(addr_location);
+            break;
+    }
+
+    operand_addr = addr;
+    return resolve(addr, access);
+}
+
+// operand<M>() for a pre-decoded instruction: the operand bytes were read
+// at translation time, only the index registers and pointers are live.
+template<MOS6502::Mode M>
+inline uint8_t * MOS6502::translated_operand(const MicroOp & uop, Access access)
+{
+    uint16_t addr_location;
+    uint16_t addr;
+    bool page_penalty = (access == READ);
+
+    switch(M)
+    {
+        case ACC:
+            return &reg_A;
+
+        case IMM:
+        case REL:
+            bus_latch = uop.operand;
+            return &bus_latch;
+
+        case ABS:
+        case ZPG:
+            addr = uop.operand;
+            break;
+
+        case ZPX:
+        case AIX:
+            addr = uop.operand + reg_X;
+            cycle_count += (M == AIX) & page_penalty & ((addr ^ uop.operand) > LOW_BYTE);
+            break;
+
+        case ZPY:
+        case AIY:
+            addr = uop.operand + reg_Y;
+            cycle_count += (M == AIY) & page_penalty & ((addr ^ uop.operand) > LOW_BYTE);
+            break;
+
+        case IMP:
+            return &bus_latch; // unused
+
+        case IIX:
+            addr = read_word(uop.operand + reg_X);
+            break;
 
-//TODO: interrupts, BRK, decimal mode, document
+        case IIY:
+            addr_location = read_word(uop.operand);
+            addr = addr_location + reg_Y;
+            cycle_count += page_penalty & ((addr ^ addr_location) > LOW_BYTE);
+            break;
 
-MOS6502::MOS6502()
+        case IND:
+            addr = read_word(uop.operand);
+            break;
+    }
+
+    operand_addr = addr;
+    return resolve(addr, access);
+}
+
+// RAM pages hand out a pointer straight into the page. Device pages, and
+// writes to pages without a write pointer, go through bus_latch instead and
+// settle with the device in complete_write() once the operation is done.
+inline uint8_t * MOS6502::resolve(uint16_t address, Access access)
 {
-    initialize();
+    uint8_t * page = (access == READ) ? read_pages[address >> PAGE_SHIFT] : write_pages[address >> PAGE_SHIFT];
+    if(page != NULL && (access != RMW || page == read_pages[address >> PAGE_SHIFT]))
+    {
+        if(access == WRITE || access == RMW)
+        {
+            dirty_pages[address >> PAGE_SHIFT] = 1;
+            if(code_pages[address >> PAGE_SHIFT])
+            {
+                invalidate_code(address >> PAGE_SHIFT);
+            }
+        }
+        return page + (address & LOW_BYTE);
+    }
+    return resolve_slow(address, access);
 }
 
-MOS6502::MOS6502(string filename)
+uint8_t * MOS6502::resolve_slow(uint16_t address, Access access)
 {
-    initialize();
-    load(filename);
+    if(access == READ || access == RMW)
+    {
+        bus_latch = read_byte(address);
+    }
+    bus_original = bus_latch;
+    pending_write = (access == WRITE || access == RMW) ? access : NONE;
+    return &bus_latch;
 }
 
-MOS6502::MOS6502(string filename, uint16_t location)
+// A read-modify-write on real hardware writes the unmodified value back
+// before the result, which some registers react to, so devices see both.
+void MOS6502::complete_write()
 {
-    initialize();
-    load(filename, location);
+    if(pending_write == RMW)
+    {
+        write_byte(operand_addr, bus_original);
+    }
+    pending_write = NONE;
+    write_byte(operand_addr, bus_latch);
 }
 
-void MOS6502::initialize()
+inline uint8_t MOS6502::read_byte(uint16_t address)
 {
-    // set RESET vector to first address after stack
-    memory[RESET_LOW] = 0x00;
-    memory[RESET_HIGH] = 0x02;
-    reset();
+    uint8_t * page = read_pages[address >> PAGE_SHIFT];
+    if(page != NULL)
+    {
+        return page[address & LOW_BYTE];
+    }
+    else if(devices[address >> PAGE_SHIFT] != NULL)
+    {
+        return devices[address >> PAGE_SHIFT]->read(address);
+    }
+    return OPEN_BUS;
 }
 
-bool MOS6502::load(string filename)
+inline void MOS6502::write_byte(uint16_t address, uint8_t val)
 {
-    FILE * rom = fopen(filename.c_str(), "rb");
-    if(rom != NULL)
+    uint8_t * page = write_pages[address >> PAGE_SHIFT];
+    if(page != NULL)
     {
-        fread(&memory[reg_PC], 1, (size_t)(MEMORY_SIZE - reg_PC), rom);
-        fclose(rom);
-        return true;
+        page[address & LOW_BYTE] = val;
+        dirty_pages[address >> PAGE_SHIFT] = 1;
+        if(code_pages[address >> PAGE_SHIFT])
+        {
+            invalidate_code(address >> PAGE_SHIFT);
+        }
     }
-    else
+    else if(devices[address >> PAGE_SHIFT] != NULL)
     {
-        cout << "Unable to open file " << filename << endl;
-        return false;
+        devices[address >> PAGE_SHIFT]->write(address, val);
     }
 }
 
-bool MOS6502::load(string filename, uint16_t location)
+inline uint16_t MOS6502::read_word(uint16_t address)
 {
-    FILE * rom = fopen(filename.c_str(), "rb");
-    if(rom != NULL)
+    uint8_t low = read_byte(address);
+    return low | read_byte(address + 1) << 8;
+}
+
+// side-effect free read for bookkeeping; device pages read as 0
+uint8_t MOS6502::peek_byte(uint16_t address)
+{
+    uint8_t * page = read_pages[address >> PAGE_SHIFT];
+    return (page != NULL) ? page[address & LOW_BYTE] : 0;
+}
+
+
+void MOS6502::map_device(uint8_t first_page, uint8_t last_page, BusDevice * device)
+{
+    for(int page = first_page; page <= last_page; page++)
     {
-        fread(&memory[location], 1, (size_t)(MEMORY_SIZE - location), rom);
-        fclose(rom);
-        return true;
+        read_pages[page] = NULL;
+        write_pages[page] = NULL;
+        devices[page] = device;
+        if(code_pages[page])
+        {
+            invalidate_code(page);
+        }
     }
-    else
+}
+
+void MOS6502::unmap_device(uint8_t first_page, uint8_t last_page)
+{
+    for(int page = first_page; page <= last_page; page++)
     {
-        cout << "Unable to open file " << filename << endl;
-        return false;
+        read_pages[page] = &memory[page << PAGE_SHIFT];
+        write_pages[page] = &memory[page << PAGE_SHIFT];
+        devices[page] = NULL;
+        if(code_pages[page])
+        {
+            invalidate_code(page);
+        }
     }
 }
 
-void MOS6502::reset()
+void MOS6502::write_through(uint8_t * page, uint16_t address, uint8_t val)
 {
-    reg_A = 0x00;
-    reg_X = 0x00;
-    reg_Y = 0x00;
-    reg_SP = SP_START;
-    reg_PC = (memory[RESET_HIGH] << 8) | memory[RESET_LOW]; // set program counter to RESET vector
-    reg_status = {0, 0, 1, 0, 0, 1, 0, 0};
+    page[address & LOW_BYTE] = val;
+    dirty_pages[address >> PAGE_SHIFT] = 1;
+    if(code_pages[address >> PAGE_SHIFT])
+    {
+        invalidate_code(address >> PAGE_SHIFT);
+    }
 }
 
-void MOS6502::run(uint16_t steps)
+void MOS6502::map_write_device(uint8_t first_page, uint8_t last_page, BusDevice * device)
 {
-    for (int i = 0; i < steps; i++)
+    for(int page = first_page; page <= last_page; page++)
     {
-        step();
+        write_pages[page] = NULL;
+        devices[page] = device;
     }
 }
 
-void MOS6502::step()
+// Only page pointers change, so remapping a bank window costs one pointer
+// per 256-byte page no matter how large the backing memory is.
+void MOS6502::map_memory(uint16_t location, uint32_t size, uint8_t * data, bool writable)
 {
-    uint8_t current_instr_byte = fetch();
-    Instruction decoded_instr = decode(current_instr_byte);
-    execute(decoded_instr);
+    for(uint32_t offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+        int page = ((location + offset) >> PAGE_SHIFT) & LOW_BYTE;
+        read_pages[page] = data + offset;
+        write_pages[page] = writable ? data + offset : NULL;
+        if(code_pages[page])
+        {
+            invalidate_code(page);
+        }
+    }
 }
 
-uint8_t MOS6502::fetch()
+void MOS6502::set_halt_conditions(unsigned conditions)
 {
-    return memory[reg_PC++];
+    halt_conditions = conditions;
 }
 
-MOS6502::Instruction MOS6502::decode(uint8_t byte)
+void MOS6502::set_core(Core selected)
 {
-    Instruction instr = decoder[byte];
-    return instr;
+    core = selected;
 }
 
-void MOS6502::execute(Instruction instr)
+MOS6502::Core MOS6502::get_core()
 {
-    last_instruction = instr.op_name;
-    uint8_t * operand = operand_from_mode(instr.addr_mode);
-    op_ptr operation = instr.op_func;
-    (this->*operation)(operand);
+    return core;
 }
 
-uint8_t * MOS6502::operand_from_mode(Mode m)
+void MOS6502::assert_irq(unsigned source_id)
 {
-    uint16_t addr_location;
-    uint16_t addr;
-    uint8_t * operand;
+    if(source_id >= IRQ_SOURCE_COUNT)
+    {
+        return;
+    }
+    irq_lines |= 1u << source_id;
+    update_interrupts();
+}
 
-    switch(m)
+void MOS6502::release_irq(unsigned source_id)
+{
+    if(source_id >= IRQ_SOURCE_COUNT)
     {
-        case ACC:
-            last_operand = "A";
-            operand = &reg_A;
-            break;
+        return;
+    }
+    irq_lines &= ~(1u << source_id);
+    update_interrupts();
+}
 
-        case IMM:
-            last_operand = "#$" + to_hex_string(memory[reg_PC]);
-            operand = &memory[reg_PC++];
-            break;
+void MOS6502::trigger_nmi()
+{
+    nmi_pending = true;
+    update_interrupts();
+}
 
-        case ABS:
-            last_operand = "$" + to_hex_string(memory[reg_PC] | memory[reg_PC + 1] << 8);
-            addr = (memory[reg_PC++] | memory[reg_PC++] << 8);
-            operand = &memory[addr];
-            break;
+void MOS6502::trigger_reset()
+{
+    reset_pending = true;
+    update_interrupts();
+}
 
-        case ZPG:
-            last_operand = "$" + to_hex_string(memory[reg_PC]);
-            addr = memory[reg_PC++];
-            operand = &memory[addr];
-            break;
+uint64_t MOS6502::schedule_event(uint64_t cycle, const EventCallback & callback, const void * owner)
+{
+    if(events == NULL)
+    {
+        events = new EventQueue;
+    }
+    EventQueue::Event event;
+    event.cycle = cycle;
+    event.id = events->next_id++;
+    event.callback = callback;
+    event.owner = owner;
+    events->heap.push_back(event);
+    push_heap(events->heap.begin(), events->heap.end(), EventQueue::later);
+    next_event = events->heap.front().cycle;
+    return event.id;
+}
 
-        case ZPX:
-            last_operand = "$" + to_hex_string(memory[reg_PC]) + ",X";
-            addr = memory[reg_PC++] + reg_X;
-            operand = &memory[addr];
-            break;
+bool MOS6502::cancel_event(uint64_t id)
+{
+    if(events == NULL)
+    {
+        return false;
+    }
+    vector<EventQueue::Event> & heap = events->heap;
+    for(size_t i = 0; i < heap.size(); i++)
+    {
+        if(heap[i].id == id)
+        {
+            heap.erase(heap.begin() + i);
+            make_heap(heap.begin(), heap.end(), EventQueue::later);
+            next_event = heap.empty() ? NO_EVENT : heap.front().cycle;
+            return true;
+        }
+    }
+    return false;
+}
 
-        case ZPY:
-            last_operand = "$" + to_hex_string(memory[reg_PC]) + ",Y";
-            addr = memory[reg_PC++] + reg_Y;
-            operand = &memory[addr];
-            break;
+uint64_t MOS6502::get_next_event()
+{
+    return next_event;
+}
 
-        case AIX:
-            last_operand = "$" + to_hex_string(memory[reg_PC] | memory[reg_PC + 1] << 8) + ",X";
-            addr = (memory[reg_PC++] | memory[reg_PC++] << 8) + reg_X;
-            operand = &memory[addr];
-            break;
+// Fires everything that is due. Each event leaves the heap before its
+// callback runs, so the callback is free to change the queue.
+void MOS6502::dispatch_events()
+{
+    vector<EventQueue::Event> & heap = events->heap;
+    while(!heap.empty() && heap.front().cycle <= cycle_count)
+    {
+        pop_heap(heap.begin(), heap.end(), EventQueue::later);
+        EventQueue::Event event = heap.back();
+        heap.pop_back();
+        next_event = heap.empty() ? NO_EVENT : heap.front().cycle;
+        event.callback(*this, event.cycle);
+    }
+    // the callback may have changed what an idle loop is waiting on
+    idle.branch = -1;
+}
 
-        case AIY:
-            last_operand = "$" + to_hex_string(memory[reg_PC] | memory[reg_PC + 1] << 8) + ",Y";
-            addr = (memory[reg_PC++] | memory[reg_PC++] << 8) + reg_Y;
-            operand = &memory[addr];
-            break;
+void MOS6502::set_idle_skip(bool enabled)
+{
+    idle_skip = enabled;
+}
 
-        case IMP:
-            last_operand = "";
-            operand = &memory[reg_PC]; // unused
-            break;
+uint64_t MOS6502::get_idle_cycles()
+{
+    return idle_cycles;
+}
 
-        case REL:
-            last_operand = "$" + to_hex_string(memory[reg_PC]);
-            operand = &memory[reg_PC++];
-            break;
+void MOS6502::set_trace(TraceBuffer * buffer)
+{
+    trace = buffer;
+}
 
-        case IIX:
-            last_operand = "($" + to_hex_string(memory[reg_PC]) + ",X)";
-            addr_location = memory[reg_PC++] + reg_X;
-            addr = (memory[addr_location] | memory[addr_location + 1] << 8);
-            operand = &memory[addr];
-            break;
+TraceBuffer * MOS6502::get_trace()
+{
+    return trace;
+}
 
-        case IIY:
-            last_operand = "($" + to_hex_string(memory[reg_PC]) + "),Y";
-            addr_location = memory[reg_PC++];
-            addr = (memory[addr_location] | memory[addr_location + 1] << 8) + reg_Y;
-            operand = &memory[addr];
-            break;
+void MOS6502::set_profiler(Profiler * counters)
+{
+    profiler = counters;
+}
 
-        case IND:
-            last_operand = "($" + to_hex_string(memory[reg_PC] | memory[reg_PC + 1] << 8) + ")";
-            addr_location = (memory[reg_PC++] | memory[reg_PC++] << 8);
-            addr = (memory[addr_location] | memory[addr_location + 1] << 8);
-            operand = &memory[addr];
-            break;
+Profiler * MOS6502::get_profiler()
+{
+    return profiler;
+}
+
+// Called from run() and run_cycles() when a branch or JMP has gone back
+// at most IDLE_LOOP_MAX_BYTES, with the number of instructions executed so
+// far. Loops whose body is straight-line code changing nothing but
+// registers are remembered; if the very next pass starts in the same state
+// the loop has settled and each further pass repeats it exactly. Those
+// passes are counted instead of run, stopping short of budget
+// instructions, cycle_limit and the next event. Loops that are still
+// changing are looked at again every IDLE_CHECK_INTERVAL passes. Returns
+// the instructions skipped.
+uint64_t MOS6502::skip_idle_loop(uint64_t executed, uint64_t budget, uint64_t cycle_limit)
+{
+    uint8_t status = get_status();
+    if(idle.branch >= 0)
+    {
+        bool same = idle.branch == last_PC && idle.start == reg_PC && idle.A == reg_A &&
+                    idle.X == reg_X && idle.Y == reg_Y && idle.status == status &&
+                    idle.SP == reg_SP && executed - idle.executed == idle.length;
+        if(!same)
+        {
+            idle.branch = -1;
+            idle_countdown = IDLE_CHECK_INTERVAL;
+            return 0;
+        }
+    }
+    else
+    {
+        idle.length = (last_PC != idle.rejected) ? idle_loop_length(reg_PC, last_PC) : 0;
+        if(idle.length == 0)
+        {
+            idle.rejected = last_PC;
+            idle_countdown = IDLE_CHECK_INTERVAL;
+            return 0;
+        }
+        idle.branch = last_PC;
+        idle.start = reg_PC;
+        idle.A = reg_A;
+        idle.X = reg_X;
+        idle.Y = reg_Y;
+        idle.status = status;
+        idle.SP = reg_SP;
+        idle.executed = executed;
+        idle.cycle = cycle_count;
+        idle_countdown = 1;
+        return 0;
+    }
+
+    uint64_t period = cycle_count - idle.cycle;
+    uint64_t limit = (cycle_limit < next_event) ? cycle_limit : next_event;
+    uint64_t passes = 0;
+    if(!interrupt_pending && limit > cycle_count)
+    {
+        passes = (limit - cycle_count) / period;
+        if(passes > budget / idle.length)
+        {
+            passes = budget / idle.length;
+        }
+    }
+    cycle_count += passes * period;
+    idle_cycles += passes * period;
+    idle.executed = executed + passes * idle.length;
+    idle.cycle = cycle_count;
+    idle_countdown = 1;
+    return passes * idle.length;
+}
+
+// Instructions from start up to and including the branch or JMP at branch,
+// or 0 if any before it could change memory or the flow of control, or
+// reads anything but a fixed RAM address, an immediate or a stable device
+// register.
+uint16_t MOS6502::idle_loop_length(uint16_t start, uint16_t branch)
+{
+    uint16_t length = 0;
+    uint16_t pc = start;
+    while((uint16_t)(branch - pc) < IDLE_LOOP_MAX_BYTES)
+    {
+        uint8_t opcode = peek_byte(pc);
+        uint16_t last = pc + Disassembler::length(opcode) - 1;
+        if(read_pages[pc >> PAGE_SHIFT] == NULL || read_pages[last >> PAGE_SHIFT] == NULL)
+        {
+            return 0;
+        }
+        const Instruction & instr = decoder[opcode];
+        length++;
+        if(pc == branch)
+        {
+            return (instr.addr_mode == REL || (instr.op_func == &MOS6502::op_JMP && instr.addr_mode == ABS)) ? length : 0;
+        }
+
+        if(instr.addr_mode == REL || instr.op_func == &MOS6502::op_JMP ||
+           instr.op_func == &MOS6502::op_JSR || instr.op_func == &MOS6502::op_RTS ||
+           instr.op_func == &MOS6502::op_RTI || instr.op_func == &MOS6502::op_BRK ||
+           instr.op_func == &MOS6502::op_PHA || instr.op_func == &MOS6502::op_PHP ||
+           instr.op_func == &MOS6502::op_PLA || instr.op_func == &MOS6502::op_PLP ||
+           instr.op_func == &MOS6502::op_ILLEGAL || instr.access == WRITE ||
+           (instr.access == RMW && instr.addr_mode != ACC))
+        {
+            return 0;
+        }
+        if(instr.access == READ && instr.addr_mode != IMM)
+        {
+            if(instr.addr_mode != ZPG && instr.addr_mode != ABS)
+            {
+                return 0;
+            }
+            uint16_t address = peek_byte(pc + 1);
+            address |= (instr.addr_mode == ABS) ? peek_byte(pc + 2) << 8 : 0;
+            BusDevice * device = devices[address >> PAGE_SHIFT];
+            if(read_pages[address >> PAGE_SHIFT] == NULL && device != NULL && !device->stable(address))
+            {
+                return 0;
+            }
+        }
+        pc = last + 1;
     }
+    return 0;
+}
 
-    return operand;
+void MOS6502::set_jit_threshold(uint32_t runs)
+{
+    jit_threshold = runs;
 }
 
-string MOS6502::to_hex_string(uint16_t num)
+uint64_t MOS6502::get_native_instructions()
 {
-    stringstream strstr;
-    strstr << hex << num;
-    return strstr.str();
+    return native_instructions;
 }
 
 uint8_t MOS6502::get_memory()
 {
-    return memory[reg_PC];
+    return read_byte(reg_PC);
 }
 
 uint8_t MOS6502::get_memory(uint16_t location)
 {
-    return memory[location];
+    return read_byte(location);
 }
 
 uint8_t MOS6502::get_A()
@@ -236,25 +2033,32 @@ uint16_t MOS6502::get_PC()
 
 uint8_t MOS6502::get_status()
 {
-    uint8_t status_byte = (reg_status.N << 7 |
-                           reg_status.V << 6 |
-                           reg_status._ << 5 |
-                           reg_status.B << 4 |
-                           reg_status.D << 3 |
-                           reg_status.I << 2 |
-                           reg_status.Z << 1 |
-                           reg_status.C);
-    return status_byte;
+    return reg_status | flag_N() << 7 | flag_Z() << 1;
+}
+
+uint64_t MOS6502::get_cycles()
+{
+    return cycle_count;
+}
+
+uint64_t MOS6502::get_instructions()
+{
+    return instruction_count;
+}
+
+uint16_t MOS6502::get_last_PC()
+{
+    return last_PC;
 }
 
 string MOS6502::get_last_instr()
 {
-    return last_instruction + " " + last_operand;
+    return Disassembler::disassemble(last_bytes);
 }
 
 void MOS6502::set_memory(uint16_t location, uint8_t val)
 {
-    memory[location] = val;
+    write_byte(location, val);
 }
 
 void MOS6502::set_A(uint8_t val)
@@ -284,31 +2088,105 @@ void MOS6502::set_PC(uint16_t val)
 
 void MOS6502::set_status(uint8_t status_byte)
 {
-    reg_status.N = status_byte & 0x80;
-    reg_status.V = status_byte & 0x40;
-    reg_status._ = status_byte & 0x20;
-    reg_status.B = status_byte & 0x10;
-    reg_status.D = status_byte & 0x8;
-    reg_status.I = status_byte & 0x4;
-    reg_status.Z = status_byte & 0x2;
-    reg_status.C = status_byte & 0x1;
+    reg_status = status_byte & ~(FLAG_N | FLAG_Z);
+    set_NZ(status_byte & FLAG_N, status_byte & FLAG_Z);
+    update_interrupts();
+}
+
+// An op storing a result byte in NZ gives N = bit 7 and Z = (byte == 0).
+// Combinations no result byte can give, such as N and Z both set, are
+// stored as N in bit 8 and a low byte that is zero unless Z is clear.
+inline bool MOS6502::flag_N()
+{
+    return (reg_NZ & NZ_NEGATIVE) != 0;
+}
+
+inline bool MOS6502::flag_Z()
+{
+    return (reg_NZ & LOW_BYTE) == 0;
+}
+
+inline void MOS6502::set_NZ(bool negative, bool zero)
+{
+    reg_NZ = (negative << 8) | !zero;
+}
+
+inline bool MOS6502::flag(uint8_t mask)
+{
+    return (reg_status & mask) != 0;
+}
+
+inline void MOS6502::set_flag(uint8_t mask, bool value)
+{
+    reg_status = (reg_status & ~mask) | (-value & mask);
+}
+
+// Folds everything that can interrupt the program into one flag, so the
+// cores test a single bool per instruction. Must be called whenever a
+// line or the I flag changes.
+inline void MOS6502::update_interrupts()
+{
+    interrupt_pending = reset_pending || nmi_pending || (irq_lines != 0 && !flag(FLAG_I));
+}
+
+// Runs between instructions. RESET wins over NMI, NMI over IRQ.
+void MOS6502::service_interrupt()
+{
+    if(reset_pending)
+    {
+        reset_pending = false;
+        reset();
+        return;
+    }
+
+    uint16_t vector = IRQ_LOW;
+    if(nmi_pending)
+    {
+        nmi_pending = false;
+        vector = NMI_LOW;
+    }
+    write_byte(reg_SP--, reg_PC >> 8);
+    write_byte(reg_SP--, reg_PC & LOW_BYTE);
+    write_byte(reg_SP--, (get_status() & ~FLAG_B) | FLAG_U);
+    set_flag(FLAG_I, 1);
+    reg_PC = read_word(vector);
+    cycle_count += INTERRUPT_CYCLES;
+    update_interrupts();
+    if(profiler != NULL)
+    {
+        profiler->interrupt(reg_PC, (reg_SP + 3) & LOW_BYTE);
+    }
+}
+
+// Relative branch shared by the op_Bxx family: a taken branch costs one
+// extra cycle, and one more if it lands on a different page.
+inline void MOS6502::branch(bool condition, uint8_t *operand)
+{
+    int8_t memory_val = *operand;
+    if(condition)
+    {
+        uint16_t target = reg_PC + memory_val;
+        cycle_count += 1 + ((target ^ reg_PC) > LOW_BYTE);
+        reg_PC = target;
+        check_self_loop();
+    }
 }
 
-void MOS6502::op_ADC(uint8_t *operand)
+inline void MOS6502::op_ADC(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
-    uint16_t result = reg_A + memory_val + reg_status.C;
+    uint16_t result = reg_A + memory_val + flag(FLAG_C);
 
-    if(reg_status.D)
+    if(flag(FLAG_D))
     {
         uint16_t high_nibble = (reg_A  >> 4) + (memory_val >> 4);
-        uint8_t low_nibble = (reg_A & NIBBLE) + (memory_val & NIBBLE) + reg_status.C;
+        uint8_t low_nibble = (reg_A & NIBBLE) + (memory_val & NIBBLE) + flag(FLAG_C);
 
         if(low_nibble > 0x09)
         {
             low_nibble += 0x6;
             low_nibble &= NIBBLE;
-            high_nibble += 0x10;
+            high_nibble += 1;
         }
         if(high_nibble > 0x9)
         {
@@ -318,390 +2196,357 @@ void MOS6502::op_ADC(uint8_t *operand)
         result = (high_nibble << 4) | low_nibble;
     }
 
-    reg_status.C = result & CARRY_BIT;
+    set_flag(FLAG_C, result & CARRY_BIT);
     result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
     bool operand_test = !((reg_A ^ memory_val) & BYTE_HIGH_BIT);
     bool result_test = ((reg_A ^ result) & BYTE_HIGH_BIT);
-    reg_status.V = operand_test && result_test;
-    reg_status.Z = (result == 0);
+    set_flag(FLAG_V, operand_test && result_test);
+    reg_NZ = result;
 
     reg_A = result;
 }
 
-void MOS6502::op_AND(uint8_t *operand)
+inline void MOS6502::op_AND(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     reg_A = reg_A & memory_val;
-    reg_status.N = reg_A & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_A == 0);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_ASL(uint8_t *operand)
+inline void MOS6502::op_ASL(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result = memory_val << 1;
 
-    reg_status.C = result & CARRY_BIT;
+    set_flag(FLAG_C, result & CARRY_BIT);
     result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    reg_status.Z = (result == 0);
+    reg_NZ = result;
 
     *operand = result;
 }
 
-void MOS6502::op_BCC(uint8_t *operand)
+inline void MOS6502::op_BCC(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(!reg_status.C)
-    {
-        reg_PC += memory_val;
-    }
+    branch(!flag(FLAG_C), operand);
 }
 
-void MOS6502::op_BCS(uint8_t *operand)
+inline void MOS6502::op_BCS(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(reg_status.C)
-    {
-        reg_PC += memory_val;
-    }
+    branch(flag(FLAG_C), operand);
 }
 
-void MOS6502::op_BEQ(uint8_t *operand)
+inline void MOS6502::op_BEQ(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(reg_status.Z)
-    {
-        reg_PC += memory_val;
-    }
+    branch(flag_Z(), operand);
 }
 
-void MOS6502::op_BIT(uint8_t *operand)
+inline void MOS6502::op_BIT(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result = reg_A & memory_val;
-    reg_status.N = memory_val & BYTE_HIGH_BIT;
-    reg_status.V = memory_val & 0x40;
-    reg_status.Z = (result == 0);
+    set_flag(FLAG_V, memory_val & 0x40);
+    set_NZ(memory_val & BYTE_HIGH_BIT, result == 0);
 }
 
-void MOS6502::op_BMI(uint8_t *operand)
+inline void MOS6502::op_BMI(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(reg_status.N)
-    {
-        reg_PC += memory_val;
-    }
+    branch(flag_N(), operand);
 }
 
-void MOS6502::op_BNE(uint8_t *operand)
+inline void MOS6502::op_BNE(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(!reg_status.Z)
-    {
-        reg_PC += memory_val;
-    }
+    branch(!flag_Z(), operand);
 }
 
-void MOS6502::op_BPL(uint8_t *operand)
+inline void MOS6502::op_BPL(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(!reg_status.N)
+    branch(!flag_N(), operand);
+}
+
+inline void MOS6502::check_self_loop()
+{
+    if((uint16_t)(last_PC - reg_PC) < IDLE_LOOP_MAX_BYTES)
     {
-        reg_PC += memory_val;
+        if(reg_PC == last_PC && (halt_conditions & HALT_ON_SELF_LOOP))
+        {
+            halt_reason = STOP_SELF_LOOP;
+        }
+        else if(idle_armed && --idle_countdown == 0)
+        {
+            halt_reason = STOP_IDLE;
+        }
     }
 }
 
-void MOS6502::op_BRK(uint8_t *operand)
+inline void MOS6502::op_BRK(uint8_t *operand)
 {
     reg_PC++;
-    memory[reg_SP--] = reg_PC & HIGH_BYTE;
-    memory[reg_SP--] = reg_PC & LOW_BYTE;
-    reg_status.B = 1;
+    write_byte(reg_SP--, reg_PC >> 8);
+    write_byte(reg_SP--, reg_PC & LOW_BYTE);
+    set_flag(FLAG_B, 1);
     uint8_t status_byte = get_status();
-    memory[reg_SP--] = status_byte;
-    reg_status.I = 1;
-    reg_PC = (memory[IRQ_HIGH] << 8) | memory[IRQ_LOW];
+    write_byte(reg_SP--, status_byte);
+    set_flag(FLAG_I, 1);
+    update_interrupts();
+    reg_PC = read_word(IRQ_LOW);
+    if(halt_conditions & HALT_ON_BRK)
+    {
+        halt_reason = STOP_BRK;
+    }
 }
 
-void MOS6502::op_BVC(uint8_t *operand)
+inline void MOS6502::op_BVC(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(!reg_status.V)
-    {
-        reg_PC += memory_val;
-    }
+    branch(!flag(FLAG_V), operand);
 }
 
-void MOS6502::op_BVS(uint8_t *operand)
+inline void MOS6502::op_BVS(uint8_t *operand)
 {
-    int8_t memory_val = *operand;
-    if(reg_status.V)
-    {
-        reg_PC += memory_val;
-    }
+    branch(flag(FLAG_V), operand);
 }
 
-void MOS6502::op_CLC(uint8_t *operand)
+inline void MOS6502::op_CLC(uint8_t *operand)
 {
-    reg_status.C = 0;
+    set_flag(FLAG_C, 0);
 }
 
-void MOS6502::op_CLD(uint8_t *operand)
+inline void MOS6502::op_CLD(uint8_t *operand)
 {
-    reg_status.D = 0;
+    set_flag(FLAG_D, 0);
 }
 
-void MOS6502::op_CLI(uint8_t *operand)
+inline void MOS6502::op_CLI(uint8_t *operand)
 {
-    reg_status.I = 0;
+    set_flag(FLAG_I, 0);
+    update_interrupts();
 }
 
-void MOS6502::op_CLV(uint8_t *operand)
+inline void MOS6502::op_CLV(uint8_t *operand)
 {
-    reg_status.V = 0;
+    set_flag(FLAG_V, 0);
 }
 
-void MOS6502::op_CMP(uint8_t *operand)
+inline void MOS6502::op_CMP(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result;
 
     result = reg_A - memory_val;
 
-    reg_status.C = !(result & CARRY_BIT);
-    result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    bool operand_test = !((reg_A ^ memory_val) & BYTE_HIGH_BIT);
-    bool result_test = ((reg_A ^ result) & BYTE_HIGH_BIT);
-    reg_status.V = operand_test && result_test;
+    set_flag(FLAG_C, !(result & CARRY_BIT));
+    reg_NZ = result & LOW_BYTE; // Z when reg_A == memory_val; V is left alone
 }
 
-void MOS6502::op_CPX(uint8_t *operand)
+inline void MOS6502::op_CPX(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result;
 
     result = reg_X - memory_val;
 
-    reg_status.C = !(result & CARRY_BIT);
-    result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    bool operand_test = !((reg_A ^ memory_val) & BYTE_HIGH_BIT);
-    bool result_test = ((reg_A ^ result) & BYTE_HIGH_BIT);
-    reg_status.V = operand_test && result_test;
+    set_flag(FLAG_C, !(result & CARRY_BIT));
+    reg_NZ = result & LOW_BYTE; // Z when reg_X == memory_val; V is left alone
 }
 
-void MOS6502::op_CPY(uint8_t *operand)
+inline void MOS6502::op_CPY(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result;
 
     result = reg_Y - memory_val;
 
-    reg_status.C = !(result & CARRY_BIT);
-    result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    bool operand_test = !((reg_A ^ memory_val) & BYTE_HIGH_BIT);
-    bool result_test = ((reg_A ^ result) & BYTE_HIGH_BIT);
-    reg_status.V = operand_test && result_test;
+    set_flag(FLAG_C, !(result & CARRY_BIT));
+    reg_NZ = result & LOW_BYTE; // Z when reg_Y == memory_val; V is left alone
 }
 
-void MOS6502::op_DEC(uint8_t *operand)
+inline void MOS6502::op_DEC(uint8_t *operand)
 {
-    uint8_t memory_val = *operand--;
-    reg_status.N = memory_val & BYTE_HIGH_BIT;
-    reg_status.Z = (memory_val == 0);
+    uint8_t memory_val = --*operand;
+    reg_NZ = memory_val;
 }
 
-void MOS6502::op_DEX(uint8_t *operand)
+inline void MOS6502::op_DEX(uint8_t *operand)
 {
     reg_X--;
-    reg_status.N = reg_X & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_X == 0);
+    reg_NZ = reg_X;
 }
 
-void MOS6502::op_DEY(uint8_t *operand)
+inline void MOS6502::op_DEY(uint8_t *operand)
 {
     reg_Y--;
-    reg_status.N = reg_Y & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_Y == 0);
+    reg_NZ = reg_Y;
 }
 
-void MOS6502::op_EOR(uint8_t *operand)
+inline void MOS6502::op_EOR(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     reg_A = reg_A ^ memory_val;
-    reg_status.N = reg_A & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_A == 0);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_INC(uint8_t *operand)
+inline void MOS6502::op_INC(uint8_t *operand)
 {
-    uint8_t memory_val = *operand++;
-    reg_status.N = memory_val & BYTE_HIGH_BIT;
-    reg_status.Z = (memory_val == 0);
+    uint8_t memory_val = ++*operand;
+    reg_NZ = memory_val;
 }
 
-void MOS6502::op_INX(uint8_t *operand)
+inline void MOS6502::op_INX(uint8_t *operand)
 {
     reg_X++;
-    reg_status.N = reg_X & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_X == 0);
+    reg_NZ = reg_X;
 }
 
-void MOS6502::op_INY(uint8_t *operand)
+inline void MOS6502::op_INY(uint8_t *operand)
 {
     reg_Y++;
-    reg_status.N = reg_Y & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_Y == 0);
+    reg_NZ = reg_Y;
 }
 
-void MOS6502::op_JMP(uint8_t *operand)
+inline void MOS6502::op_JMP(uint8_t *operand)
 {
     //TODO: insert JMP bug
-    reg_PC = *operand;
+    reg_PC = operand_addr;
+    check_self_loop();
 }
 
-void MOS6502::op_JSR(uint8_t *operand)
+inline void MOS6502::op_JSR(uint8_t *operand)
 {
     reg_PC -= 1;
-    memory[reg_SP--] = reg_PC & HIGH_BYTE;
-    memory[reg_SP--] = reg_PC & LOW_BYTE;
-    reg_PC = *operand;
+    write_byte(reg_SP--, reg_PC >> 8);
+    write_byte(reg_SP--, reg_PC & LOW_BYTE);
+    reg_PC = operand_addr;
 }
 
-void MOS6502::op_LDA(uint8_t *operand)
+inline void MOS6502::op_LDA(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     reg_A = memory_val;
-    reg_status.N = reg_A & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_A == 0);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_LDX(uint8_t *operand)
+inline void MOS6502::op_LDX(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     reg_X = memory_val;
-    reg_status.N = reg_X & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_X == 0);
+    reg_NZ = reg_X;
 }
 
-void MOS6502::op_LDY(uint8_t *operand)
+inline void MOS6502::op_LDY(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     reg_Y = memory_val;
-    reg_status.N = reg_Y & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_Y == 0);
+    reg_NZ = reg_Y;
 }
 
-void MOS6502::op_LSR(uint8_t *operand)
+inline void MOS6502::op_LSR(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result;
-    reg_status.C = result & BYTE_LOW_BIT;
+    set_flag(FLAG_C, memory_val & BYTE_LOW_BIT);
 
     result = memory_val >> 1;
     result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    reg_status.Z = (result == 0);
+    reg_NZ = result;
 
     *operand = result;
 }
 
-void MOS6502::op_NOP(uint8_t *operand)
+inline void MOS6502::op_NOP(uint8_t *operand)
 {
     ;
 }
 
-void MOS6502::op_ORA(uint8_t *operand)
+inline void MOS6502::op_ORA(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     reg_A = reg_A | memory_val;
-    reg_status.N = reg_A & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_A == 0);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_PHA(uint8_t *operand)
+inline void MOS6502::op_PHA(uint8_t *operand)
 {
-    memory[reg_SP--] = reg_A;
+    write_byte(reg_SP--, reg_A);
 }
 
-void MOS6502::op_PHP(uint8_t *operand)
+inline void MOS6502::op_PHP(uint8_t *operand)
 {
     uint8_t status_byte = get_status();
-    memory[reg_SP--] = status_byte;
+    write_byte(reg_SP--, status_byte);
 }
 
-void MOS6502::op_PLA(uint8_t *operand)
+inline void MOS6502::op_PLA(uint8_t *operand)
 {
-    reg_A = memory[++reg_SP];
+    reg_A = read_byte(++reg_SP);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_PLP(uint8_t *operand)
+inline void MOS6502::op_PLP(uint8_t *operand)
 {
-    set_status(memory[++reg_SP]);
+    set_status(read_byte(++reg_SP));
 }
 
-void MOS6502::op_ROL(uint8_t *operand)
+inline void MOS6502::op_ROL(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result = memory_val << 1;
-    result |= reg_status.C;
+    result |= flag(FLAG_C);
 
-    reg_status.C = result & CARRY_BIT;
+    set_flag(FLAG_C, result & CARRY_BIT);
     result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    reg_status.Z = (result == 0);
+    reg_NZ = result;
 
     *operand = result;
 }
 
-void MOS6502::op_ROR(uint8_t *operand)
+inline void MOS6502::op_ROR(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
     uint16_t result = memory_val >> 1;;
-    result |= reg_status.C << 7;
+    result |= flag(FLAG_C) << 7;
 
-    reg_status.C = memory_val & BYTE_LOW_BIT;
+    set_flag(FLAG_C, memory_val & BYTE_LOW_BIT);
     result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    reg_status.Z = (result == 0);
+    reg_NZ = result;
 
     *operand = result;
 }
 
-void MOS6502::op_RTI(uint8_t *operand)
+inline void MOS6502::op_RTI(uint8_t *operand)
 {
-    set_status(memory[++reg_SP]);
-    reg_PC = memory[++reg_SP] & (memory[++reg_SP] << 8);
+    set_status(read_byte(++reg_SP));
+    uint8_t low = read_byte(++reg_SP);
+    uint8_t high = read_byte(++reg_SP);
+    reg_PC = (high << 8) | low;
 }
 
-void MOS6502::op_RTS(uint8_t *operand)
+inline void MOS6502::op_RTS(uint8_t *operand)
 {
-    reg_PC = (memory[++reg_SP] & (memory[++reg_SP] << 8)) + 1;
+    uint8_t low = read_byte(++reg_SP);
+    uint8_t high = read_byte(++reg_SP);
+    reg_PC = ((high << 8) | low) + 1;
 }
 
-void MOS6502::op_SBC(uint8_t *operand)
+inline void MOS6502::op_SBC(uint8_t *operand)
 {
     uint8_t memory_val = *operand;
-    uint16_t result = (reg_A - memory_val) - (1 - reg_status.C);
+    uint16_t result = (reg_A - memory_val) - (1 - flag(FLAG_C));
 
-    bool operand_test = !((reg_A ^ memory_val) & BYTE_HIGH_BIT);
+    // overflow when A and the operand differ in sign and the result's sign
+    // differs from A's
+    bool operand_test = ((reg_A ^ memory_val) & BYTE_HIGH_BIT);
     bool result_test = ((reg_A ^ result) & BYTE_HIGH_BIT);
-    reg_status.V = operand_test && result_test;
+    set_flag(FLAG_V, operand_test && result_test);
 
-    if(reg_status.D)
+    if(flag(FLAG_D))
     {
         uint16_t high_nibble = (reg_A >> 4) - (memory_val >> 4);
-        uint8_t low_nibble = (reg_A & NIBBLE) - (memory_val & NIBBLE)  - (1 - reg_status.C);
+        uint8_t low_nibble = (reg_A & NIBBLE) - (memory_val & NIBBLE)  - (1 - flag(FLAG_C));
 
         if(low_nibble > 0x9)
         {
             low_nibble -= 0x6;
             low_nibble &= NIBBLE;
-            high_nibble -= 0x10;
+            high_nibble -= 1;
         }
         if(high_nibble > 0x9)
         {
@@ -711,85 +2556,84 @@ void MOS6502::op_SBC(uint8_t *operand)
         result = (high_nibble << 4) | low_nibble;
     }
 
-    reg_status.C = !(result & CARRY_BIT);
+    set_flag(FLAG_C, !(result & CARRY_BIT));
     result &= LOW_BYTE; // fit result to one byte
-    reg_status.N = result & BYTE_HIGH_BIT;
-    reg_status.Z = (result == 0);
+    reg_NZ = result;
 
     reg_A = result;
 }
 
-void MOS6502::op_SEC(uint8_t *operand)
+inline void MOS6502::op_SEC(uint8_t *operand)
 {
-    reg_status.C = 1;
+    set_flag(FLAG_C, 1);
 }
 
-void MOS6502::op_SED(uint8_t *operand)
+inline void MOS6502::op_SED(uint8_t *operand)
 {
-    reg_status.D = 1;
+    set_flag(FLAG_D, 1);
 }
 
-void MOS6502::op_SEI(uint8_t *operand)
+inline void MOS6502::op_SEI(uint8_t *operand)
 {
-    reg_status.I = 1;
+    set_flag(FLAG_I, 1);
+    update_interrupts();
 }
 
-void MOS6502::op_STA(uint8_t *operand)
+inline void MOS6502::op_STA(uint8_t *operand)
 {
     *operand = reg_A;
 }
 
-void MOS6502::op_STX(uint8_t *operand)
+inline void MOS6502::op_STX(uint8_t *operand)
 {
     *operand = reg_X;
 }
 
-void MOS6502::op_STY(uint8_t *operand)
+inline void MOS6502::op_STY(uint8_t *operand)
 {
     *operand = reg_Y;
 }
 
-void MOS6502::op_TAX(uint8_t *operand)
+inline void MOS6502::op_TAX(uint8_t *operand)
 {
     reg_X = reg_A;
-    reg_status.N = reg_X & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_X == 0);
+    reg_NZ = reg_X;
 }
 
-void MOS6502::op_TAY(uint8_t *operand)
+inline void MOS6502::op_TAY(uint8_t *operand)
 {
     reg_Y = reg_A;
-    reg_status.N = reg_Y & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_Y == 0);
+    reg_NZ = reg_Y;
 }
 
-void MOS6502::op_TSX(uint8_t *operand)
+inline void MOS6502::op_TSX(uint8_t *operand)
 {
     reg_X = reg_SP;
-    reg_status.N = reg_X & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_X == 0);
+    reg_NZ = reg_X;
 }
 
-void MOS6502::op_TXA(uint8_t *operand)
+inline void MOS6502::op_TXA(uint8_t *operand)
 {
     reg_A = reg_X;
-    reg_status.N = reg_A & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_A == 0);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_TXS(uint8_t *operand)
+inline void MOS6502::op_TXS(uint8_t *operand)
 {
-    reg_SP = reg_X;
+    reg_SP = 0x100 | reg_X; // the stack stays on page 1
 }
 
-void MOS6502::op_TYA(uint8_t *operand)
+inline void MOS6502::op_TYA(uint8_t *operand)
 {
     reg_A = reg_Y;
-    reg_status.N = reg_A & BYTE_HIGH_BIT;
-    reg_status.Z = (reg_A == 0);
+    reg_NZ = reg_A;
 }
 
-void MOS6502::op_ILLEGAL(uint8_t *operand)
+inline void MOS6502::op_ILLEGAL(uint8_t *operand)
 {
     cerr << "Undefined instruction at memory location 0x" << hex << (reg_PC - 1) << endl;
-}
\ No newline at end of file
+    if(halt_conditions & HALT_ON_ILLEGAL)
+    {
+        halt_reason = STOP_ILLEGAL;
+    }
+}
\ No newline at end of file
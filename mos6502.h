@@ -1,18 +1,47 @@
+#ifndef MOS6502_H
+#define MOS6502_H
+
 #include <iostream>
 #include <sstream>
 #include <iomanip>
 #include <string>
 #include <stdio.h>
 #include <stdint.h>
-#include <map>
+#include <stdlib.h>
+#include <functional>
+#include <algorithm>
+#include <string.h>
+#include <vector>
+#include <new>
 using namespace std;
 
 #define MEMORY_SIZE 0x10000
+#define CACHE_LINE_SIZE 64
+#define NMI_LOW 0xFFFA       // NMI vector low byte
+#define NMI_HIGH 0xFFFB      // NMI vector high byte
 #define RESET_LOW 0xFFFC     // RESET vector low byte
 #define RESET_HIGH 0xFFFD    // RESET vector high byte
 #define IRQ_LOW 0xFFFE       // IRQ vector low byte
 #define IRQ_HIGH 0xFFFF      // IRQ vector high byte
 #define SP_START 0x1FD       // Stack Pointer start address
+#define INTERRUPT_CYCLES 7   // cycles to take an IRQ or NMI
+#define IRQ_SOURCE_COUNT 32  // one bit each in irq_lines
+#define INSTRUCTION_MAX_CYCLES 7
+#define NO_EVENT 0xFFFFFFFFFFFFFFFFULL // next_event with nothing scheduled
+
+#define SNAPSHOT_MAGIC "M6502SNP"
+#define SNAPSHOT_VERSION 1
+
+#define PAGE_SHIFT 8         // 256-byte pages
+#define PAGE_SIZE 0x100
+#define PAGE_COUNT 0x100
+#define OPEN_BUS 0xFF        // read from a page with nothing mapped
+
+#define BLOCK_MAX_LENGTH 64            // instructions per translated block
+#define TRANSLATION_OPS_LIMIT 0x40000  // cached micro-ops before a full flush
+#define JIT_THRESHOLD 64               // block runs before NATIVE compiles it
+#define IDLE_LOOP_MAX_BYTES 16         // span of loops checked for idling
+#define IDLE_CHECK_INTERVAL 64         // short loop passes between checks
 
 #define LOW_BYTE 0xFF
 #define HIGH_BYTE 0xFF
@@ -20,30 +49,128 @@ using namespace std;
 #define BYTE_HIGH_BIT 0x80
 #define BYTE_LOW_BIT 0x01
 #define CARRY_BIT 0x100
+#define FLAG_N 0x80          // status register bits
+#define FLAG_V 0x40
+#define FLAG_U 0x20          // unused, reads as set after reset
+#define FLAG_B 0x10
+#define FLAG_D 0x08
+#define FLAG_I 0x04
+#define FLAG_Z 0x02
+#define FLAG_C 0x01
+#define NZ_NEGATIVE 0x180    // lazy N: bit 7 of a result, or bit 8 when set
+                             // with set_NZ()
+
+class RomImage;
+class TraceBuffer;
+class Profiler;
+
+// Peripheral attached to one or more 256-byte pages of the address space
+class BusDevice
+{
+public:
+    virtual ~BusDevice() {}
+    virtual uint8_t read(uint16_t address) = 0;
+    virtual void write(uint16_t address, uint8_t value) = 0;
+    // true if reading address has no side effects and what it returns only
+    // changes from inside a scheduled event, so a loop polling it can be
+    // fast-forwarded to that event
+    virtual bool stable(uint16_t) { return false; }
+};
 
 class MOS6502
 {
-private:
-    typedef void (MOS6502::*op_ptr)(uint8_t*);
+    friend class Disassembler;
+    friend class LockstepEngine;
+    friend class JitCompiler;
+    friend class Profiler;
+    friend class Mapper;
 
-    uint8_t memory[MEMORY_SIZE];
-    uint8_t reg_A; // Accumulator
-    uint8_t reg_X;
-    uint8_t reg_Y;
-    uint16_t reg_SP; // Stack Pointer
-    uint16_t reg_PC; // Program Counter
-    
-    struct StatusRegister {
-        bool N; // Negative
-        bool V; // Overflow
-        bool _;
-        bool B; // Break
-        bool D; // Decimal
-        bool I; // Interrupt Disable
-        bool Z; // Zero
-        bool C; // Carry
-    } reg_status;
+public:
+    // interpreter core used by step() and run()
+    enum Core {
+        REFERENCE,  // fetch, decode and execute through the opcode table
+        THREADED,   // per-opcode handlers with the addressing mode fused in,
+                    // dispatched through a single jump table
+        TRANSLATED, // basic blocks decoded once into cached micro-ops, dropped
+                    // again when a write lands on a page holding their code
+        NATIVE      // TRANSLATED, with hot blocks compiled to x86-64 code
+                    // where the host allows it
+    };
+
+    // why run() returned
+    enum StopReason {
+        STOP_NONE,      // still running
+        STOP_COUNT,     // instruction count reached
+        STOP_PC,        // stop PC reached
+        STOP_PREDICATE, // caller predicate returned true
+        STOP_ILLEGAL,   // illegal opcode executed
+        STOP_BRK,       // BRK executed
+        STOP_SELF_LOOP, // jump or branch to itself
+        STOP_IDLE       // internal: short backward branch, never returned
+    };
+
+    // why a Snapshot::save() or load() failed
+    enum SnapshotError {
+        SNAPSHOT_OK,
+        SNAPSHOT_OPEN_FAILED,
+        SNAPSHOT_READ_FAILED,  // file ends early
+        SNAPSHOT_WRITE_FAILED,
+        SNAPSHOT_BAD_FORMAT    // not a snapshot, or another version
+    };
+
+    // Complete CPU state as plain data, so it can be copied with memcpy.
+    // Bank windows and devices live outside the CPU and are not included.
+    struct Snapshot {
+        uint8_t A;
+        uint8_t X;
+        uint8_t Y;
+        uint8_t status; // packed as by get_status()
+        uint16_t SP;
+        uint16_t PC;
+        uint64_t cycles;
+        uint8_t memory[MEMORY_SIZE];
+
+        // versioned little-endian file format; error, if given, says why
+        // one failed
+        bool save(string filename, SnapshotError * error = NULL) const;
+        bool load(string filename, SnapshotError * error = NULL);
+    };
+
+    // Registers plus only the pages written since a base Snapshot was taken
+    // or restored. Restoring one needs that same base.
+    struct SnapshotDelta {
+        uint8_t A;
+        uint8_t X;
+        uint8_t Y;
+        uint8_t status;
+        uint16_t SP;
+        uint16_t PC;
+        uint64_t cycles;
+        vector<uint8_t> pages; // page numbers, in ascending order
+        vector<uint8_t> data;  // PAGE_SIZE bytes for each entry in pages
+    };
+
+    // timed callback; gets the cycle the event was scheduled for, which
+    // may be a few cycles behind get_cycles()
+    typedef function<void(MOS6502 &, uint64_t)> EventCallback;
+
+    // why the last load() or map_rom() failed
+    enum LoadError {
+        LOAD_OK,
+        LOAD_OPEN_FAILED, // missing or unreadable file, or no image open
+        LOAD_READ_FAILED,
+        LOAD_TOO_LARGE,   // image runs past $FFFF from its location
+        LOAD_NOT_ALIGNED  // ROM mappings start on a page boundary
+    };
+
+    // optional halts for run(), combined as a bit mask
+    enum HaltCondition {
+        HALT_ON_ILLEGAL = 0x1,
+        HALT_ON_BRK = 0x2,
+        HALT_ON_SELF_LOOP = 0x4
+    };
 
+    // addressing modes, as Disassembler::mode() reports them
     enum Mode {
         ACC, // Accumulator mode
         IMM, // Immediate mode
@@ -60,282 +187,170 @@ private:
         IND  // Indirect mode
     };
 
+private:
+    typedef void (MOS6502::*op_ptr)(uint8_t*);
+
+    enum Access {
+        NONE,  // no memory operand
+        READ,  // operand is read
+        WRITE, // operand is written
+        RMW    // operand is read, modified and written back
+    };
+
     struct Instruction {
         op_ptr op_func;
         Mode addr_mode;
-        string op_name;
+        Access access;
+        const char * op_name;
+        uint8_t cycles; // base cycle count
+    };
+
+    // One pre-decoded instruction of a translated block. Immediate and
+    // branch operands hold their value, the other modes the address (or
+    // base address) their operand bytes encode.
+    struct MicroOp {
+        uint8_t opcode;
+        uint8_t length;
+        uint16_t operand;
     };
 
-    string last_instruction;
-    string last_operand;
+    struct TranslationCache;
+    struct EventQueue;
+
+    // state at the end of the last pass round a short loop, see
+    // skip_idle_loop()
+    struct IdleLoop {
+        int32_t branch;   // -1 if none
+        int32_t rejected; // branch of the last loop found unable to idle
+        uint16_t start;
+        uint16_t length; // instructions per pass
+        uint8_t A;
+        uint8_t X;
+        uint8_t Y;
+        uint8_t status;
+        uint16_t SP;
+        uint64_t executed; // instructions executed at that point
+        uint64_t cycle;
+    };
+
+    // Hot state leads the object on a cache line of its own: everything
+    // an instruction touches besides the page tables fits in that line.
+    alignas(CACHE_LINE_SIZE) uint8_t reg_A; // Accumulator
+    uint8_t reg_X;
+    uint8_t reg_Y;
+    uint16_t reg_SP; // Stack Pointer
+    uint16_t reg_PC; // Program Counter
+    // status is kept apart from A/X/Y: the compiler merges their copies to
+    // and from JitContext into wider loads and stores, which stall when
+    // they straddle a fresh byte store to the flags
+    uint8_t reg_status; // packed as pushed by PHP, N and Z bits unused
+    // N and Z are not kept as flags: most instructions that set them are
+    // followed by another that overwrites them, so only the result is
+    // stored and the flags are worked out when something reads them
+    uint16_t reg_NZ; // lazy Negative and Zero, see flag_N() and flag_Z()
+    uint16_t last_PC; // start of the last executed instruction
+    uint16_t operand_addr; // effective address of the last memory operand
+    bool interrupt_pending; // an interrupt needs servicing now
+    bool code_modified;     // set when the running block may be stale
+    StopReason halt_reason;
+    uint64_t cycle_count; // cycles elapsed since power on
+    uint64_t instruction_count; // instructions executed since power on
+    uint64_t next_event; // cycle of the earliest event, NO_EVENT if none
+    // MEMORY_SIZE bytes, allocated by the CPU unless handed to the
+    // constructor; the object holds no pointers into itself, so it can be
+    // moved with memcpy
+    uint8_t * memory;
+    bool owns_memory;
 
-    void initialize();
+    Core core;
+
+    // Bus: pages with a pointer are plain memory, NULL pages go to devices
+    uint8_t * read_pages[PAGE_COUNT];
+    uint8_t * write_pages[PAGE_COUNT];
+    BusDevice * devices[PAGE_COUNT];
+    uint8_t bus_latch;     // stands in for a device operand during an op
+    uint8_t bus_original;  // latch value before the op ran
+    Access pending_write;  // device write owed once the op has run
+    uint8_t dirty_pages[PAGE_COUNT]; // pages written since the last snapshot
+    unsigned halt_conditions;
+    LoadError load_error;
+
+    // raw bytes of the last executed instruction, formatted on demand
+    uint8_t last_bytes[3];
+
+    // translated blocks, allocated on first use; never shared by copies
+    TranslationCache * translation;
+    uint8_t code_pages[PAGE_COUNT]; // pages holding translated code
+    uint32_t jit_threshold;
+    uint64_t native_instructions; // run as compiled code since power on
+
+    uint32_t irq_lines;     // one bit per asserted IRQ source
+    bool nmi_pending;       // NMI edge seen, not yet taken
+    bool reset_pending;
+
+    // scheduled events, allocated on first use; copies get their own queue
+    EventQueue * events;
+
+    bool idle_skip;   // fast-forward idle loops, on by default
+    bool idle_armed;  // inside run() or run_cycles(), which do the skipping
+    IdleLoop idle;
+    uint32_t idle_countdown; // short loop passes until the next check
+    uint64_t idle_cycles; // cycles skipped since power on
+
+    // NULL unless in use; never carried over to copies
+    TraceBuffer * trace;
+    Profiler * profiler;
+
+    void initialize(uint8_t * external_memory);
+
+    StopReason run_until(uint64_t steps, int32_t stop_PC, const function<bool(MOS6502 &)> * predicate, uint64_t interval);
+    template<Core C, bool INSTRUMENTED> StopReason run_loop(uint64_t steps, int32_t stop_PC, const function<bool(MOS6502 &)> * predicate, uint64_t interval);
+    template<Core C, bool INSTRUMENTED> void run_cycles_loop(uint64_t target);
+    void step_reference();
+    void step_threaded();
+    void record_last_bytes();
+    bool instrumented(); // tracing or profiling
+    template<Core C> void step_instrumented(uint64_t start);
+    template<bool INSTRUMENTED> uint64_t run_block(uint64_t limit, int32_t stop_PC, uint64_t until);
+    int32_t translate_block(uint16_t start);
+    uint32_t run_native(int32_t index);
+    void invalidate_code(uint8_t page);
+    void flush_translations();
+    void clear_run_state(); // after restore()
 
     uint8_t fetch();
-    Instruction decode(uint8_t byte);
-    void execute(Instruction instr);
-
-    uint8_t * operand_from_mode(Mode m);
-
-    string to_hex_string(uint16_t num);
-
-    map<uint8_t, Instruction> decoder = 
-    {{0x00, {&MOS6502::op_BRK, IMP, "BRK"}},
-     {0x01, {&MOS6502::op_ORA, IIX, "ORA"}},
-     {0x02, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x03, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x04, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x05, {&MOS6502::op_ORA, ZPG, "ORA"}},
-     {0x06, {&MOS6502::op_ASL, ZPG, "ASL"}},
-     {0x07, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x08, {&MOS6502::op_PHP, IMP, "PHP"}},
-     {0x09, {&MOS6502::op_ORA, IMM, "ORA"}},
-     {0x0A, {&MOS6502::op_ASL, ACC, "ASL"}},
-     {0x0B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x0C, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x0D, {&MOS6502::op_ORA, ABS, "ORA"}},
-     {0x0E, {&MOS6502::op_ASL, ABS, "ASL"}},
-     {0x0F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x10, {&MOS6502::op_BPL, REL, "BPL"}},
-     {0x11, {&MOS6502::op_ORA, IIY, "ORA"}},
-     {0x12, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x13, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x14, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x15, {&MOS6502::op_ORA, ZPX, "ORA"}},
-     {0x16, {&MOS6502::op_ASL, ZPX, "ASL"}},
-     {0x17, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x18, {&MOS6502::op_CLC, IMP, "CLC"}},
-     {0x19, {&MOS6502::op_ORA, AIY, "ORA"}},
-     {0x1A, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x1B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x1C, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x1D, {&MOS6502::op_ORA, AIX, "ORA"}},
-     {0x1E, {&MOS6502::op_ASL, AIX, "ASL"}},
-     {0x1F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x20, {&MOS6502::op_JSR, ABS, "JSR"}},
-     {0x21, {&MOS6502::op_AND, IIX, "AND"}},
-     {0x22, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x23, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x24, {&MOS6502::op_BIT, ZPG, "BIT"}},
-     {0x25, {&MOS6502::op_AND, ZPG, "AND"}},
-     {0x26, {&MOS6502::op_ROL, ZPG, "ROL"}},
-     {0x27, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x28, {&MOS6502::op_PLP, IMP, "PLP"}},
-     {0x29, {&MOS6502::op_AND, IMM, "AND"}},
-     {0x2A, {&MOS6502::op_ROL, ACC, "ROL"}},
-     {0x2B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x2C, {&MOS6502::op_BIT, ABS, "BIT"}},
-     {0x2D, {&MOS6502::op_AND, ABS, "AND"}},
-     {0x2E, {&MOS6502::op_ROL, ABS, "ROL"}},
-     {0x2F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x30, {&MOS6502::op_BMI, REL, "BMI"}},
-     {0x31, {&MOS6502::op_AND, IIY, "AND"}},
-     {0x32, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x33, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x34, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x35, {&MOS6502::op_AND, ZPX, "AND"}},
-     {0x36, {&MOS6502::op_ROL, ZPX, "ROL"}},
-     {0x37, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x38, {&MOS6502::op_SEC, IMP, "SEC"}},
-     {0x39, {&MOS6502::op_AND, AIY, "AND"}},
-     {0x3A, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x3B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x3C, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x3D, {&MOS6502::op_AND, AIX, "AND"}},
-     {0x3E, {&MOS6502::op_ROL, AIX, "ROL"}},
-     {0x3F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x40, {&MOS6502::op_RTI, IMP, "RTI"}},
-     {0x41, {&MOS6502::op_EOR, IIX, "EOR"}},
-     {0x42, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x43, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x44, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x45, {&MOS6502::op_EOR, ZPG, "EOR"}},
-     {0x46, {&MOS6502::op_LSR, ZPG, "LSR"}},
-     {0x47, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x48, {&MOS6502::op_PHA, IMP, "PHA"}},
-     {0x49, {&MOS6502::op_EOR, IMM, "EOR"}},
-     {0x4A, {&MOS6502::op_LSR, ACC, "LSR"}},
-     {0x4B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x4C, {&MOS6502::op_JMP, ABS, "JMP"}},
-     {0x4D, {&MOS6502::op_EOR, ABS, "EOR"}},
-     {0x4E, {&MOS6502::op_LSR, ABS, "LSR"}},
-     {0x4F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x50, {&MOS6502::op_BVC, REL, "BVC"}},
-     {0x51, {&MOS6502::op_EOR, IIY, "EOR"}},
-     {0x52, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x53, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x54, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x55, {&MOS6502::op_EOR, ZPX, "EOR"}},
-     {0x56, {&MOS6502::op_LSR, ZPX, "LSR"}},
-     {0x57, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x58, {&MOS6502::op_CLI, IMP, "CLI"}},
-     {0x59, {&MOS6502::op_EOR, AIY, "EOR"}},
-     {0x5A, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x5B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x5C, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x5D, {&MOS6502::op_EOR, AIX, "EOR"}},
-     {0x5E, {&MOS6502::op_LSR, AIX, "LSR"}},
-     {0x5F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x60, {&MOS6502::op_RTS, IMP, "RTS"}},
-     {0x61, {&MOS6502::op_ADC, IIX, "ADC"}},
-     {0x62, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x63, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x64, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x65, {&MOS6502::op_ADC, ZPG, "ADC"}},
-     {0x66, {&MOS6502::op_ROR, ZPG, "ROR"}},
-     {0x67, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x68, {&MOS6502::op_PLA, IMP, "PLA"}},
-     {0x69, {&MOS6502::op_ADC, IMM, "ADC"}},
-     {0x6A, {&MOS6502::op_ROR, ACC, "ROR"}},
-     {0x6B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x6C, {&MOS6502::op_JMP, IND, "JMP"}},
-     {0x6D, {&MOS6502::op_ADC, ABS, "ADC"}},
-     {0x6E, {&MOS6502::op_ROR, ABS, "ROR"}},
-     {0x6F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x70, {&MOS6502::op_BVS, REL, "BVS"}},
-     {0x71, {&MOS6502::op_ADC, IIY, "ADC"}},
-     {0x72, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x73, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x74, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x75, {&MOS6502::op_ADC, ZPX, "ADC"}},
-     {0x76, {&MOS6502::op_ROR, ZPX, "ROR"}},
-     {0x77, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x78, {&MOS6502::op_SEI, IMP, "SEI"}},
-     {0x79, {&MOS6502::op_ADC, AIY, "ADC"}},
-     {0x7A, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x7B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x7C, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x7D, {&MOS6502::op_ADC, AIX, "ADC"}},
-     {0x7E, {&MOS6502::op_ROR, AIX, "ROR"}},
-     {0x7F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x80, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x81, {&MOS6502::op_STA, IIX, "STA"}},
-     {0x82, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x83, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x84, {&MOS6502::op_STY, ZPG, "STY"}},
-     {0x85, {&MOS6502::op_STA, ZPG, "STA"}},
-     {0x86, {&MOS6502::op_STX, ZPG, "STX"}},
-     {0x87, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x88, {&MOS6502::op_DEY, IMP, "DEY"}},
-     {0x89, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x8A, {&MOS6502::op_TXA, IMP, "TXA"}},
-     {0x8B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x8C, {&MOS6502::op_STY, ABS, "STY"}},
-     {0x8D, {&MOS6502::op_STA, ABS, "STA"}},
-     {0x8E, {&MOS6502::op_STX, ABS, "STX"}},
-     {0x8F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x90, {&MOS6502::op_BCC, REL, "BCC"}},
-     {0x91, {&MOS6502::op_STA, IIY, "STA"}},
-     {0x92, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x93, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x94, {&MOS6502::op_STY, ZPX, "STY"}},
-     {0x95, {&MOS6502::op_STA, ZPX, "STA"}},
-     {0x96, {&MOS6502::op_STX, ZPY, "STX"}},
-     {0x97, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x98, {&MOS6502::op_TYA, IMP, "TYA"}},
-     {0x99, {&MOS6502::op_STA, AIY, "STA"}},
-     {0x9A, {&MOS6502::op_TXS, IMP, "TXS"}},
-     {0x9B, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x9C, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x9D, {&MOS6502::op_STA, AIX, "STA"}},
-     {0x9E, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0x9F, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xA0, {&MOS6502::op_LDY, IMM, "LDY"}},
-     {0xA1, {&MOS6502::op_LDA, IIX, "LDA"}},
-     {0xA2, {&MOS6502::op_LDX, IMM, "LDX"}},
-     {0xA3, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xA4, {&MOS6502::op_LDY, ZPG, "LDY"}},
-     {0xA5, {&MOS6502::op_LDA, ZPG, "LDA"}},
-     {0xA6, {&MOS6502::op_LDX, ZPG, "LDX"}},
-     {0xA7, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xA8, {&MOS6502::op_TAY, IMP, "TAY"}},
-     {0xA9, {&MOS6502::op_LDA, IMM, "LDA"}},
-     {0xAA, {&MOS6502::op_TAX, IMP, "TAX"}},
-     {0xAB, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xAC, {&MOS6502::op_LDY, ABS, "LDY"}},
-     {0xAD, {&MOS6502::op_LDA, ABS, "LDA"}},
-     {0xAE, {&MOS6502::op_LDX, ABS, "LDX"}},
-     {0xAF, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xB0, {&MOS6502::op_BCS, REL, "BCS"}},
-     {0xB1, {&MOS6502::op_LDA, IIY, "LDA"}},
-     {0xB2, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xB3, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xB4, {&MOS6502::op_LDY, ZPX, "LDY"}},
-     {0xB5, {&MOS6502::op_LDA, ZPX, "LDA"}},
-     {0xB6, {&MOS6502::op_LDX, ZPY, "LDX"}},
-     {0xB7, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xB8, {&MOS6502::op_CLV, IMP, "CLV"}},
-     {0xB9, {&MOS6502::op_LDA, AIY, "LDA"}},
-     {0xBA, {&MOS6502::op_TSX, IMP, "TSX"}},
-     {0xBB, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xBC, {&MOS6502::op_LDY, AIX, "LDY"}},
-     {0xBD, {&MOS6502::op_LDA, AIX, "LDA"}},
-     {0xBE, {&MOS6502::op_LDX, AIY, "LDX"}},
-     {0xBF, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xC0, {&MOS6502::op_CPY, IMM, "CPY"}},
-     {0xC1, {&MOS6502::op_CMP, IIX, "CMP"}},
-     {0xC2, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xC3, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xC4, {&MOS6502::op_CPY, ZPG, "CPY"}},
-     {0xC5, {&MOS6502::op_CMP, ZPG, "CMP"}},
-     {0xC6, {&MOS6502::op_DEC, ZPG, "DEC"}},
-     {0xC7, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xC8, {&MOS6502::op_INY, IMP, "INY"}},
-     {0xC9, {&MOS6502::op_CMP, IMM, "CMP"}},
-     {0xCA, {&MOS6502::op_DEX, IMP, "DEX"}},
-     {0xCB, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xCC, {&MOS6502::op_CPY, ABS, "CPY"}},
-     {0xCD, {&MOS6502::op_CMP, ABS, "CMP"}},
-     {0xCE, {&MOS6502::op_DEC, ABS, "DEC"}},
-     {0xCF, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xD0, {&MOS6502::op_BNE, REL, "BNE"}},
-     {0xD1, {&MOS6502::op_CMP, IIY, "CMP"}},
-     {0xD2, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xD3, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xD4, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xD5, {&MOS6502::op_CMP, ZPX, "CMP"}},
-     {0xD6, {&MOS6502::op_DEC, ZPX, "DEC"}},
-     {0xD7, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xD8, {&MOS6502::op_CLD, IMP, "CLD"}},
-     {0xD9, {&MOS6502::op_CMP, AIY, "CMP"}},
-     {0xDA, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xDB, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xDC, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xDD, {&MOS6502::op_CMP, AIX, "CMP"}},
-     {0xDE, {&MOS6502::op_DEC, AIX, "DEC"}},
-     {0xDF, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xE0, {&MOS6502::op_CPX, IMM, "CPX"}},
-     {0xE1, {&MOS6502::op_SBC, IIX, "SBC"}},
-     {0xE2, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xE3, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xE4, {&MOS6502::op_CPX, ZPG, "CPX"}},
-     {0xE5, {&MOS6502::op_SBC, ZPG, "SBC"}},
-     {0xE6, {&MOS6502::op_INC, ZPG, "INC"}},
-     {0xE7, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xE8, {&MOS6502::op_INX, IMP, "INX"}},
-     {0xE9, {&MOS6502::op_SBC, IMM, "SBC"}},
-     {0xEA, {&MOS6502::op_NOP, IMP, "NOP"}},
-     {0xEB, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xEC, {&MOS6502::op_CPX, ABS, "CPX"}},
-     {0xED, {&MOS6502::op_SBC, ABS, "SBC"}},
-     {0xEE, {&MOS6502::op_INC, ABS, "INC"}},
-     {0xEF, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xF0, {&MOS6502::op_BEQ, REL, "BEQ"}},
-     {0xF1, {&MOS6502::op_SBC, IIY, "SBC"}},
-     {0xF2, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xF3, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xF4, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xF5, {&MOS6502::op_SBC, ZPX, "SBC"}},
-     {0xF6, {&MOS6502::op_INC, ZPX, "INC"}},
-     {0xF7, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xF8, {&MOS6502::op_SED, IMP, "SED"}},
-     {0xF9, {&MOS6502::op_SBC, AIY, "SBC"}},
-     {0xFA, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xFB, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xFC, {&MOS6502::op_ILLEGAL, IMP, "ILL"}},
-     {0xFD, {&MOS6502::op_SBC, AIX, "SBC"}},
-     {0xFE, {&MOS6502::op_INC, AIX, "INC"}},
-     {0xFF, {&MOS6502::op_ILLEGAL, IMP, "ILL"}}};
+    const Instruction & decode(uint8_t byte);
+    void execute(const Instruction & instr);
+
+    uint8_t * operand_from_mode(Mode m, Access access);
+    template<Mode M> uint8_t * operand(Access access);
+    template<Mode M> uint8_t * translated_operand(const MicroOp & uop, Access access);
+    uint8_t * resolve(uint16_t address, Access access);
+    uint8_t * resolve_slow(uint16_t address, Access access);
+    void complete_write();
+
+    uint8_t read_byte(uint16_t address);
+    void write_byte(uint16_t address, uint8_t val);
+    // store to a page a write device has taken over, for the addresses it
+    // does not decode itself
+    void write_through(uint8_t * page, uint16_t address, uint8_t val);
+    uint16_t read_word(uint16_t address);
+    uint8_t peek_byte(uint16_t address);
+    bool flag_N();
+    bool flag_Z();
+    void set_NZ(bool negative, bool zero);
+    bool flag(uint8_t mask);
+    void set_flag(uint8_t mask, bool value);
+    void update_interrupts();
+    void service_interrupt();
+    void dispatch_events();
+    void branch(bool condition, uint8_t *operand);
+    void check_self_loop();
+    uint64_t skip_idle_loop(uint64_t executed, uint64_t budget, uint64_t cycle_limit);
+    uint16_t idle_loop_length(uint16_t start, uint16_t branch);
+
+    // opcode dispatch table, shared by all instances and indexed directly by opcode
+    static const Instruction decoder[256];
 
     void op_ADC(uint8_t *operand);
     void op_AND(uint8_t *operand);
@@ -400,12 +415,99 @@ public:
     MOS6502();
     MOS6502(string filename);
     MOS6502(string filename, uint16_t location);
+    // Runs on a caller-owned buffer of MEMORY_SIZE bytes instead of
+    // allocating one, so instances can live in an arena (hugepage-backed
+    // or otherwise). The buffer is used as is, RESET vector included, and
+    // must outlive the CPU. Placement new needs CACHE_LINE_SIZE alignment.
+    MOS6502(uint8_t * external_memory);
+    // maps a shared ROM image instead of loading a file; see map_rom()
+    MOS6502(const RomImage & rom, uint16_t location);
+    MOS6502(const MOS6502 & other);
+    MOS6502 & operator=(const MOS6502 & other);
+    ~MOS6502();
+
+    // the hot block needs cache line alignment, which plain new does not
+    // promise before C++17
+    static void * operator new(size_t size);
+    static void * operator new[](size_t size);
+    static void * operator new(size_t, void * place) { return place; }
+    static void operator delete(void * block);
+    static void operator delete[](void * block);
 
+    // copy a file into RAM at the PC or at location; the whole file must
+    // fit below $10000, and get_load_error() says why not if it does not
     bool load(string filename);
     bool load(string filename, uint16_t location);
+    // Map a RomImage read-only at location, which must be page aligned,
+    // without copying it. Any number of CPUs can share one image. Writes
+    // to it are dropped, or go to a device added with map_write_device().
+    bool map_rom(const RomImage & rom, uint16_t location);
+    LoadError get_load_error();
     void reset();
-    void run(uint16_t steps);
+    void snapshot(Snapshot & state);
+    void restore(const Snapshot & state);
+    // incremental snapshots relative to the last full snapshot or restore
+    void snapshot(SnapshotDelta & delta);
+    void restore(const Snapshot & base, const SnapshotDelta & delta);
+    StopReason run(uint64_t steps);
+    StopReason run(uint64_t steps, uint16_t stop_PC);
+    // predicate is checked every `interval` instructions
+    StopReason run(uint64_t steps, const function<bool(MOS6502 &)> & predicate, uint64_t interval);
+    uint64_t run_cycles(uint64_t budget); // returns cycles run past budget
     void step();
+    // Runs the rest of the current basic block on TRANSLATED and NATIVE,
+    // which lets NATIVE run it as compiled code, and one instruction on
+    // the other cores. Returns how many instructions ran.
+    uint64_t step_block();
+    // route pages first_page..last_page to a device instead of RAM
+    void map_device(uint8_t first_page, uint8_t last_page, BusDevice * device);
+    void unmap_device(uint8_t first_page, uint8_t last_page);
+    // send only writes to the device; reads keep their current mapping
+    void map_write_device(uint8_t first_page, uint8_t last_page, BusDevice * device);
+    // map size bytes of external memory at location (whole pages); writes
+    // to a read-only window go to the page's device, if any
+    void map_memory(uint16_t location, uint32_t size, uint8_t * data, bool writable);
+    void set_halt_conditions(unsigned conditions);
+    void set_core(Core selected);
+    Core get_core();
+    // runs a block needs before NATIVE compiles it; 1 compiles on first use
+    void set_jit_threshold(uint32_t runs);
+    uint64_t get_native_instructions(); // run as compiled code since power on
+    // IRQ is level-triggered and shared by up to 32 sources (0-31), and is
+    // taken while any source holds it and I is clear; other ids are
+    // ignored. NMI and RESET are edges. All are taken before the next
+    // instruction.
+    void assert_irq(unsigned source_id);
+    void release_irq(unsigned source_id);
+    void trigger_nmi();
+    void trigger_reset();
+    // Events fire between instructions, at the first boundary at or after
+    // their cycle, and ones due on the same cycle fire in the order they
+    // were scheduled. Callbacks may schedule and cancel events themselves.
+    // Returns an id for cancel_event(). Events with an owner, such as a
+    // sampling Profiler, are not copied with the CPU, since the owner only
+    // tracks this one.
+    uint64_t schedule_event(uint64_t cycle, const EventCallback & callback, const void * owner = NULL);
+    bool cancel_event(uint64_t id); // false if it already fired
+    uint64_t get_next_event();      // NO_EVENT if nothing is scheduled
+    // Loops that only poll RAM or stable device registers, such as JMP *
+    // or LDA flag / BEQ, are run once to check they have settled and then
+    // fast-forwarded to the next event or the end of the run. Cycle and
+    // instruction counts come out exactly as if every pass had run.
+    void set_idle_skip(bool enabled);
+    uint64_t get_idle_cycles(); // cycles fast-forwarded since power on
+    // Record every instruction into buffer before it runs, or stop with
+    // NULL. Runs without a trace or profiler go through loops compiled
+    // without either, so both cost nothing while off. NATIVE interprets
+    // while either is on, and passes fast-forwarded by idle skipping are
+    // not traced.
+    void set_trace(TraceBuffer * buffer);
+    TraceBuffer * get_trace();
+    // count every instruction and its cycles by PC and opcode, and by call
+    // path if it keeps a call graph, or stop with NULL; idle loops run in
+    // full while profiling
+    void set_profiler(Profiler * counters);
+    Profiler * get_profiler();
 
     uint8_t get_memory();
     uint8_t get_memory(uint16_t location);
@@ -415,6 +517,9 @@ public:
     uint16_t get_SP();
     uint16_t get_PC();
     uint8_t get_status();
+    uint64_t get_cycles();
+    uint64_t get_instructions();
+    uint16_t get_last_PC();
     string get_last_instr();
 
     void set_memory(uint16_t location, uint8_t memory_val);
@@ -425,4 +530,6 @@ public:
     void set_PC(uint16_t val);
     void set_status(uint8_t status_byte);
 
-};
\ No newline at end of file
+};
+
+#endif
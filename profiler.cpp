@@ -0,0 +1,665 @@
+#include "profiler.h"
+#include "disassembler.h"
+#include <ctype.h>
+
+static bool hotter(const Profiler::Bucket & a, const Profiler::Bucket & b)
+{
+    return a.cycles != b.cycles ? a.cycles > b.cycles : a.opcode < b.opcode;
+}
+
+static bool hotter_function(const Profiler::Function & a, const Profiler::Function & b)
+{
+    return a.inclusive != b.inclusive ? a.inclusive > b.inclusive : a.PC < b.PC;
+}
+
+// orders addresses by one of the counters; ties go to the lower address,
+// so reports are stable
+struct HotterAddress {
+    const uint64_t * key;
+
+    bool operator()(const Profiler::Entry & a, const Profiler::Entry & b) const
+    {
+        return key[a.PC] != key[b.PC] ? key[a.PC] > key[b.PC] : a.PC < b.PC;
+    }
+};
+
+// One line without its end of line; false at the end of the file.
+static bool read_line(FILE * file, string & line)
+{
+    line.clear();
+    int c;
+    while((c = fgetc(file)) != EOF && c != '\n')
+    {
+        if(c != '\r')
+        {
+            line += (char)c;
+        }
+    }
+    return c != EOF || !line.empty();
+}
+
+static string trim(const string & text)
+{
+    size_t first = text.find_first_not_of(" \t");
+    if(first == string::npos)
+    {
+        return "";
+    }
+    return text.substr(first, text.find_last_not_of(" \t") + 1 - first);
+}
+
+// "$C000" and "0xC000" are hex, anything else is hex only if hex is set;
+// false unless it fits in 16 bits
+static bool parse_address(string text, bool hex, uint16_t & address)
+{
+    if(text.size() > 1 && text[0] == '$')
+    {
+        text = text.substr(1);
+        hex = true;
+    }
+    else if(text.size() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
+    {
+        text = text.substr(2);
+        hex = true;
+    }
+    if(text.empty() || !isalnum((unsigned char)text[0]))
+    {
+        return false;
+    }
+    char * end;
+    unsigned long value = strtoul(text.c_str(), &end, hex ? 16 : 10);
+    if(*end != '\0' || value > 0xFFFF)
+    {
+        return false;
+    }
+    address = (uint16_t)value;
+    return true;
+}
+
+// value of key=value in a ca65 debug file line, up to the next comma
+static string dbg_field(const string & line, const string & key)
+{
+    size_t start = line.find("," + key + "=");
+    if(start == string::npos)
+    {
+        start = line.find("\t" + key + "=");
+    }
+    if(start == string::npos)
+    {
+        return "";
+    }
+    start += key.size() + 2;
+    size_t end = line.find(',', start);
+    return line.substr(start, (end == string::npos) ? string::npos : end - start);
+}
+
+// Fills in name and address from one line of a symbol file, see
+// load_symbols(); false if it holds no symbol.
+static bool parse_symbol(string line, string & name, uint16_t & address)
+{
+    if(line.compare(0, 4, "sym\t") == 0 || line.compare(0, 4, "sym ") == 0)
+    {
+        name = dbg_field(line, "name");
+        if(dbg_field(line, "type") != "lab" || name.size() < 3 || name[0] != '"' || name[name.size() - 1] != '"')
+        {
+            return false;
+        }
+        name = name.substr(1, name.size() - 2);
+        return parse_address(dbg_field(line, "val"), false, address);
+    }
+
+    line = trim(line.substr(0, line.find(';')));
+    if(line.empty() || line[0] == '#')
+    {
+        return false;
+    }
+    size_t equals = line.find('=');
+    if(equals != string::npos)
+    {
+        name = trim(line.substr(0, equals));
+        if(!name.empty() && name[name.size() - 1] == ':')
+        {
+            name = trim(name.substr(0, name.size() - 1));
+        }
+        return !name.empty() && name.find_first_of(" \t") == string::npos &&
+               parse_address(trim(line.substr(equals + 1)), false, address);
+    }
+
+    istringstream fields(line);
+    string first, second, third, rest;
+    fields >> first >> second >> third;
+    if(fields >> rest)
+    {
+        return false;
+    }
+    if(first == "al" && !third.empty())
+    {
+        // VICE: al C:C000 .name, where C is the memory space
+        size_t colon = second.find(':');
+        name = (third[0] == '.') ? third.substr(1) : third;
+        return !name.empty() && parse_address(second.substr(colon + 1), true, address);
+    }
+    name = second;
+    return third.empty() && !name.empty() && parse_address(first, true, address);
+}
+
+Profiler::Profiler()
+    : sampled(NULL), sample_event(0), sample_interval(0), call_graph(false)
+{
+    clear();
+}
+
+Profiler::~Profiler()
+{
+    stop_sampling();
+}
+
+// Scheduled every sample_interval cycles; events fire between
+// instructions, so the PC is that of the next one to run.
+void Profiler::sample(MOS6502 & cpu, uint64_t cycle)
+{
+    samples[cpu.get_PC()]++;
+    sample_event = cpu.schedule_event(cycle + sample_interval, bind(&Profiler::sample, this, placeholders::_1, placeholders::_2), this);
+}
+
+void Profiler::start_sampling(MOS6502 & cpu, uint64_t interval)
+{
+    stop_sampling();
+    sampled = &cpu;
+    sample_interval = (interval > 0) ? interval : 1;
+    sample_event = cpu.schedule_event(cpu.get_cycles() + sample_interval, bind(&Profiler::sample, this, placeholders::_1, placeholders::_2), this);
+}
+
+void Profiler::stop_sampling()
+{
+    if(sampled != NULL)
+    {
+        sampled->cancel_event(sample_event);
+        sampled = NULL;
+    }
+}
+
+void Profiler::clear()
+{
+    memset(executions, 0, sizeof(executions));
+    memset(cycles, 0, sizeof(cycles));
+    memset(samples, 0, sizeof(samples));
+    memset(opcode_executions, 0, sizeof(opcode_executions));
+    memset(opcode_cycles, 0, sizeof(opcode_cycles));
+
+    CallNode top = {0, 0, 0, 0};
+    nodes.assign(1, top);
+    children.clear();
+    lost_calls = 0;
+    reset_calls();
+}
+
+// Drops the frames of calls that a stack pointer of SP has returned from.
+void Profiler::unwind(uint8_t SP)
+{
+    while(depth > 0 && frames[depth - 1].SP <= SP)
+    {
+        depth--;
+    }
+    current = (depth > 0) ? frames[depth - 1].node : 0;
+}
+
+// SP is where the stack pointer will be once the call returns. Past
+// PROFILE_MAX_PATHS the call gets a frame on its caller's node, so its
+// return still matches; past PROFILE_MAX_DEPTH it gets no frame at all.
+void Profiler::call(uint16_t function, uint8_t SP)
+{
+    unwind(SP);
+    if(depth == PROFILE_MAX_DEPTH)
+    {
+        lost_calls++;
+        return;
+    }
+
+    uint64_t key = ((uint64_t)current << 16) | function;
+    unordered_map<uint64_t, uint32_t>::iterator found = children.find(key);
+    uint32_t node = current;
+    if(found != children.end())
+    {
+        node = found->second;
+    }
+    else if(nodes.size() < PROFILE_MAX_PATHS)
+    {
+        node = (uint32_t)nodes.size();
+        CallNode callee = {current, function, 0, 0};
+        nodes.push_back(callee);
+        children[key] = node;
+    }
+
+    if(node == current)
+    {
+        lost_calls++;
+    }
+    else
+    {
+        nodes[node].calls++;
+    }
+    frames[depth].node = node;
+    frames[depth].SP = SP;
+    depth++;
+    current = node;
+}
+
+void Profiler::interrupt(uint16_t handler, uint8_t SP)
+{
+    if(call_graph)
+    {
+        call(handler, SP);
+    }
+}
+
+void Profiler::reset_calls()
+{
+    depth = 0;
+    current = 0;
+}
+
+void Profiler::set_call_graph(bool enabled)
+{
+    call_graph = enabled;
+    reset_calls();
+}
+
+bool Profiler::get_call_graph()
+{
+    return call_graph;
+}
+
+uint64_t Profiler::get_lost_calls()
+{
+    return lost_calls;
+}
+
+bool Profiler::load_symbols(string filename)
+{
+    FILE * file = fopen(filename.c_str(), "r");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    string line, name;
+    uint16_t address;
+    while(read_line(file, line))
+    {
+        if(parse_symbol(line, name, address))
+        {
+            symbols.insert(make_pair(address, name));
+        }
+    }
+    bool read = !ferror(file);
+    fclose(file);
+    return read;
+}
+
+void Profiler::set_symbol(uint16_t address, string name)
+{
+    symbols[address] = name;
+}
+
+string Profiler::symbol(uint16_t address)
+{
+    map<uint16_t, string>::iterator found = symbols.find(address);
+    if(found != symbols.end())
+    {
+        return found->second;
+    }
+    char name[6];
+    snprintf(name, sizeof(name), "$%04X", address);
+    return name;
+}
+
+uint64_t Profiler::get_executions(uint16_t PC)
+{
+    return executions[PC];
+}
+
+uint64_t Profiler::get_cycles(uint16_t PC)
+{
+    return cycles[PC];
+}
+
+uint64_t Profiler::get_samples(uint16_t PC)
+{
+    return samples[PC];
+}
+
+uint64_t Profiler::get_opcode_executions(uint8_t opcode)
+{
+    return opcode_executions[opcode];
+}
+
+uint64_t Profiler::get_opcode_cycles(uint8_t opcode)
+{
+    return opcode_cycles[opcode];
+}
+
+uint64_t Profiler::total_executions()
+{
+    uint64_t total = 0;
+    for(int opcode = 0; opcode < 256; opcode++)
+    {
+        total += opcode_executions[opcode];
+    }
+    return total;
+}
+
+uint64_t Profiler::total_cycles()
+{
+    uint64_t total = 0;
+    for(int opcode = 0; opcode < 256; opcode++)
+    {
+        total += opcode_cycles[opcode];
+    }
+    return total;
+}
+
+uint64_t Profiler::total_samples()
+{
+    uint64_t total = 0;
+    for(int PC = 0; PC < MEMORY_SIZE; PC++)
+    {
+        total += samples[PC];
+    }
+    return total;
+}
+
+vector<Profiler::Entry> Profiler::hot_spots(size_t count, Rank rank)
+{
+    const uint64_t * key = (rank == BY_EXECUTIONS) ? executions : (rank == BY_SAMPLES) ? samples : cycles;
+    vector<Entry> entries;
+    for(int PC = 0; PC < MEMORY_SIZE; PC++)
+    {
+        if(executions[PC] != 0 || samples[PC] != 0)
+        {
+            Entry entry = {(uint16_t)PC, executions[PC], cycles[PC], samples[PC]};
+            entries.push_back(entry);
+        }
+    }
+
+    if(count == 0 || count > entries.size())
+    {
+        count = entries.size();
+    }
+    HotterAddress order = {key};
+    partial_sort(entries.begin(), entries.begin() + count, entries.end(), order);
+    entries.resize(count);
+    return entries;
+}
+
+vector<Profiler::Bucket> Profiler::opcodes()
+{
+    vector<Bucket> buckets;
+    for(int opcode = 0; opcode < 256; opcode++)
+    {
+        if(opcode_executions[opcode] != 0)
+        {
+            const MOS6502::Instruction & instr = MOS6502::decoder[opcode];
+            Bucket bucket = {string(instr.op_name) + " " + Disassembler::mode_name(instr.addr_mode), (uint8_t)opcode,
+                             opcode_executions[opcode], opcode_cycles[opcode]};
+            buckets.push_back(bucket);
+        }
+    }
+    sort(buckets.begin(), buckets.end(), hotter);
+    return buckets;
+}
+
+vector<Profiler::Bucket> Profiler::modes()
+{
+    vector<Bucket> buckets(PROFILE_MODES);
+    for(int mode = 0; mode < PROFILE_MODES; mode++)
+    {
+        buckets[mode].name = Disassembler::mode_name((MOS6502::Mode)mode);
+        buckets[mode].opcode = 0xFF;
+        buckets[mode].executions = 0;
+        buckets[mode].cycles = 0;
+    }
+    for(int opcode = 0xFF; opcode >= 0; opcode--)
+    {
+        if(opcode_executions[opcode] != 0)
+        {
+            Bucket & bucket = buckets[MOS6502::decoder[opcode].addr_mode];
+            bucket.opcode = opcode;
+            bucket.executions += opcode_executions[opcode];
+            bucket.cycles += opcode_cycles[opcode];
+        }
+    }
+
+    vector<Bucket> used;
+    for(int mode = 0; mode < PROFILE_MODES; mode++)
+    {
+        if(buckets[mode].executions != 0)
+        {
+            used.push_back(buckets[mode]);
+        }
+    }
+    sort(used.begin(), used.end(), hotter);
+    return used;
+}
+
+// Each node's cycles plus those of every path below it. Nodes are only
+// ever added after their parent, so one backwards pass is enough.
+vector<uint64_t> Profiler::inclusive_cycles()
+{
+    vector<uint64_t> inclusive(nodes.size());
+    for(size_t i = 0; i < nodes.size(); i++)
+    {
+        inclusive[i] = nodes[i].cycles;
+    }
+    for(size_t i = nodes.size() - 1; i > 0; i--)
+    {
+        inclusive[nodes[i].parent] += inclusive[i];
+    }
+    return inclusive;
+}
+
+string Profiler::path_name(uint32_t node)
+{
+    if(node == 0)
+    {
+        return "[top]";
+    }
+    string path = symbol(nodes[node].function);
+    for(node = nodes[node].parent; node != 0; node = nodes[node].parent)
+    {
+        path = symbol(nodes[node].function) + ";" + path;
+    }
+    return path;
+}
+
+// A recursive function's inclusive cycles are only counted at its
+// outermost frame on each path.
+vector<Profiler::Function> Profiler::functions()
+{
+    vector<uint64_t> inclusive = inclusive_cycles();
+    map<uint16_t, Function> found;
+    for(uint32_t i = 1; i < nodes.size(); i++)
+    {
+        uint16_t PC = nodes[i].function;
+        map<uint16_t, Function>::iterator entry = found.find(PC);
+        if(entry == found.end())
+        {
+            Function function = {PC, symbol(PC), 0, 0, 0};
+            entry = found.insert(make_pair(PC, function)).first;
+        }
+        entry->second.calls += nodes[i].calls;
+        entry->second.exclusive += nodes[i].cycles;
+
+        uint32_t caller = nodes[i].parent;
+        while(caller != 0 && nodes[caller].function != PC)
+        {
+            caller = nodes[caller].parent;
+        }
+        if(caller == 0)
+        {
+            entry->second.inclusive += inclusive[i];
+        }
+    }
+
+    vector<Function> ranked;
+    for(map<uint16_t, Function>::iterator entry = found.begin(); entry != found.end(); entry++)
+    {
+        ranked.push_back(entry->second);
+    }
+    sort(ranked.begin(), ranked.end(), hotter_function);
+    return ranked;
+}
+
+vector<Profiler::CallPath> Profiler::call_paths()
+{
+    vector<uint64_t> inclusive = inclusive_cycles();
+    vector<CallPath> paths;
+    for(uint32_t i = 0; i < nodes.size(); i++)
+    {
+        CallPath path = {path_name(i), nodes[i].calls, inclusive[i], nodes[i].cycles};
+        paths.push_back(path);
+    }
+    return paths;
+}
+
+string Profiler::report(size_t count, MOS6502 * cpu)
+{
+    uint64_t all_cycles = total_cycles();
+    uint64_t all_samples = total_samples();
+    double cycle_scale = (all_cycles > 0) ? 100.0 / all_cycles : 0;
+    double sample_scale = (all_samples > 0) ? 100.0 / all_samples : 0;
+    char line[160];
+    string text;
+
+    snprintf(line, sizeof(line), "%llu instructions, %llu cycles, %llu samples\n\n",
+             (unsigned long long)total_executions(), (unsigned long long)all_cycles, (unsigned long long)all_samples);
+    text += line;
+    text += "address      executions          cycles  cycles%  samples%  instruction\n";
+    vector<Entry> entries = hot_spots(count, (all_cycles == 0) ? BY_SAMPLES : BY_CYCLES);
+    for(size_t i = 0; i < entries.size(); i++)
+    {
+        const Entry & entry = entries[i];
+        string instruction;
+        if(cpu != NULL)
+        {
+            uint8_t bytes[3] = {cpu->peek_byte(entry.PC), cpu->peek_byte(entry.PC + 1), cpu->peek_byte(entry.PC + 2)};
+            instruction = Disassembler::disassemble(bytes);
+        }
+        map<uint16_t, string>::iterator label = symbols.find(entry.PC);
+        if(label != symbols.end())
+        {
+            instruction = label->second + ": " + instruction;
+        }
+        snprintf(line, sizeof(line), "$%04X   %15llu %15llu  %6.2f%%   %6.2f%%  %s\n", entry.PC,
+                 (unsigned long long)entry.executions, (unsigned long long)entry.cycles,
+                 entry.cycles * cycle_scale, entry.samples * sample_scale, instruction.c_str());
+        text += line;
+    }
+
+    const char * titles[2] = {"\nopcode       executions          cycles  cycles%\n",
+                              "\nmode         executions          cycles  cycles%\n"};
+    vector<Bucket> tables[2] = {opcodes(), modes()};
+    for(int t = 0; t < 2; t++)
+    {
+        text += titles[t];
+        for(size_t i = 0; i < tables[t].size(); i++)
+        {
+            const Bucket & bucket = tables[t][i];
+            snprintf(line, sizeof(line), "%-8s %15llu %15llu  %6.2f%%\n", bucket.name.c_str(),
+                     (unsigned long long)bucket.executions, (unsigned long long)bucket.cycles,
+                     bucket.cycles * cycle_scale);
+            text += line;
+        }
+    }
+
+    if(nodes.size() > 1)
+    {
+        text += "\nfunction             calls  inclusive cycles  cycles%  exclusive cycles  cycles%\n";
+        vector<Function> ranked = functions();
+        for(size_t i = 0; i < ranked.size() && (count == 0 || i < count); i++)
+        {
+            const Function & function = ranked[i];
+            snprintf(line, sizeof(line), " %15llu %17llu  %6.2f%% %17llu  %6.2f%%\n",
+                     (unsigned long long)function.calls, (unsigned long long)function.inclusive,
+                     function.inclusive * cycle_scale, (unsigned long long)function.exclusive,
+                     function.exclusive * cycle_scale);
+            text += function.name + string((function.name.size() < 10) ? 10 - function.name.size() : 0, ' ') + line;
+        }
+        if(lost_calls > 0)
+        {
+            snprintf(line, sizeof(line), "%llu calls past the call graph limits were charged to their caller\n",
+                     (unsigned long long)lost_calls);
+            text += line;
+        }
+    }
+    return text;
+}
+
+bool Profiler::save_csv(string filename, Table table)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    if(table == ADDRESSES)
+    {
+        fprintf(file, "address,executions,cycles,samples\n");
+        for(int PC = 0; PC < MEMORY_SIZE; PC++)
+        {
+            if(executions[PC] != 0 || samples[PC] != 0)
+            {
+                fprintf(file, "%d,%llu,%llu,%llu\n", PC, (unsigned long long)executions[PC],
+                        (unsigned long long)cycles[PC], (unsigned long long)samples[PC]);
+            }
+        }
+    }
+    else if(table == FUNCTIONS)
+    {
+        vector<Function> ranked = functions();
+        fprintf(file, "address,name,calls,inclusive,exclusive\n");
+        for(size_t i = 0; i < ranked.size(); i++)
+        {
+            fprintf(file, "%d,%s,%llu,%llu,%llu\n", ranked[i].PC, ranked[i].name.c_str(), (unsigned long long)ranked[i].calls,
+                    (unsigned long long)ranked[i].inclusive, (unsigned long long)ranked[i].exclusive);
+        }
+    }
+    else
+    {
+        vector<Bucket> buckets = (table == OPCODES) ? opcodes() : modes();
+        fprintf(file, (table == OPCODES) ? "opcode,name,executions,cycles\n" : "mode,executions,cycles\n");
+        for(size_t i = 0; i < buckets.size(); i++)
+        {
+            if(table == OPCODES)
+            {
+                fprintf(file, "%d,%s,", buckets[i].opcode, buckets[i].name.c_str());
+            }
+            else
+            {
+                fprintf(file, "%s,", buckets[i].name.c_str());
+            }
+            fprintf(file, "%llu,%llu\n", (unsigned long long)buckets[i].executions, (unsigned long long)buckets[i].cycles);
+        }
+    }
+
+    return fclose(file) == 0;
+}
+
+bool Profiler::save_folded(string filename)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    for(uint32_t i = 0; i < nodes.size(); i++)
+    {
+        if(nodes[i].cycles != 0)
+        {
+            fprintf(file, "%s %llu\n", path_name(i).c_str(), (unsigned long long)nodes[i].cycles);
+        }
+    }
+    return fclose(file) == 0;
+}
@@ -0,0 +1,211 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "mos6502.h"
+using namespace std;
+
+#define PROFILE_MODES 13 // addressing modes in MOS6502::Mode
+#define PROFILE_MAX_DEPTH 128     // shadow call stack frames
+#define PROFILE_MAX_PATHS 0x10000 // distinct call paths, top level included
+#define OP_BRK 0x00               // opcodes that move the shadow call stack
+#define OP_JSR 0x20
+#define OP_RTI 0x40
+#define OP_RTS 0x60
+
+// Where emulated code spends its time, kept in flat arrays indexed by PC
+// and by opcode.
+//
+// Attached with MOS6502::set_profiler(), it counts every instruction and
+// the cycles it took, which costs a few array increments per instruction.
+// The cycles of taking an interrupt count against the handler's first
+// instruction, so the totals match get_cycles(). Idle loops are not fast-
+// forwarded while a profiler is attached, so they show up at full weight.
+//
+// start_sampling() instead records the PC every so many cycles from a
+// scheduled event, which costs nothing per instruction and leaves idle
+// skipping on. Both can run at once.
+//
+// set_call_graph() also keeps a shadow call stack, pushed by JSR, BRK and
+// interrupts and popped by RTS and RTI, and charges cycles to the call
+// path they were spent under. Frames remember the stack pointer their
+// caller resumes at: a return pops every frame at or below where the
+// stack pointer ends up, and a call first drops frames whose return
+// address has already been pulled or overwritten, so code that discards
+// return addresses or resets the stack does not leave frames behind,
+// and an RTS or RTI used as a jump pops nothing.
+class Profiler
+{
+public:
+    enum Rank {
+        BY_CYCLES,
+        BY_EXECUTIONS,
+        BY_SAMPLES
+    };
+
+    enum Table {
+        ADDRESSES, // one row per PC that ran or was sampled
+        OPCODES,   // one row per opcode that ran
+        MODES,     // one row per addressing mode that ran
+        FUNCTIONS  // one row per called function
+    };
+
+    struct Entry {
+        uint16_t PC;
+        uint64_t executions;
+        uint64_t cycles;
+        uint64_t samples;
+    };
+
+    struct Bucket {
+        string name; // "LDA ZPX" for an opcode, "ZPX" for a mode
+        uint8_t opcode; // first opcode in the bucket
+        uint64_t executions;
+        uint64_t cycles;
+    };
+
+    struct Function {
+        uint16_t PC; // entry point
+        string name;
+        uint64_t calls;
+        uint64_t inclusive; // cycles in it and everything it called
+        uint64_t exclusive; // cycles in its own code
+    };
+
+    struct CallPath {
+        string stack; // frame names, outermost first, separated by ';'
+        uint64_t calls;
+        uint64_t inclusive;
+        uint64_t exclusive;
+    };
+
+private:
+    struct CallNode {
+        uint32_t parent;
+        uint16_t function;
+        uint64_t calls;
+        uint64_t cycles; // exclusive
+    };
+
+    struct Frame {
+        uint32_t node;
+        uint8_t SP; // stack pointer once the call returns
+    };
+
+    uint64_t executions[MEMORY_SIZE];
+    uint64_t cycles[MEMORY_SIZE];
+    uint64_t samples[MEMORY_SIZE];
+    uint64_t opcode_executions[256];
+    uint64_t opcode_cycles[256];
+
+    MOS6502 * sampled; // CPU the sampling event is scheduled on
+    uint64_t sample_event;
+    uint64_t sample_interval;
+
+    // nodes[0] is the top level, outside any call; children are looked
+    // up by parent node << 16 | function
+    bool call_graph;
+    vector<CallNode> nodes;
+    unordered_map<uint64_t, uint32_t> children;
+    Frame frames[PROFILE_MAX_DEPTH];
+    uint32_t depth;
+    uint32_t current; // node of the innermost frame
+    uint64_t lost_calls; // charged to their caller, past either limit
+
+    map<uint16_t, string> symbols;
+
+    void sample(MOS6502 & cpu, uint64_t cycle);
+    void call(uint16_t function, uint8_t SP);
+    void unwind(uint8_t SP);
+    vector<uint64_t> inclusive_cycles();
+    string path_name(uint32_t node);
+
+public:
+    Profiler();
+    ~Profiler();
+
+    // the CPU holds a pointer to it
+    Profiler(const Profiler & other) = delete;
+    Profiler & operator=(const Profiler & other) = delete;
+
+    // next_PC and SP are the CPU's once the instruction has run
+    inline void record(uint16_t PC, uint8_t opcode, uint64_t elapsed, uint16_t next_PC, uint8_t SP)
+    {
+        executions[PC]++;
+        cycles[PC] += elapsed;
+        opcode_executions[opcode]++;
+        opcode_cycles[opcode] += elapsed;
+        if(call_graph)
+        {
+            nodes[current].cycles += elapsed;
+            switch(opcode)
+            {
+                case OP_BRK: call(next_PC, SP + 3); break;
+                case OP_JSR: call(next_PC, SP + 2); break;
+                case OP_RTI:
+                case OP_RTS: unwind(SP); break;
+            }
+        }
+    }
+
+    // called by the CPU as it takes an interrupt, with the stack pointer
+    // from before it pushed anything, and as it resets
+    void interrupt(uint16_t handler, uint8_t SP);
+    void reset_calls();
+
+    // sample cpu's PC every interval cycles until stop_sampling()
+    void start_sampling(MOS6502 & cpu, uint64_t interval);
+    void stop_sampling();
+    void clear();
+
+    // Off by default; turning it on or off starts at the top level again.
+    // Functions are entered by JSR, BRK or an interrupt.
+    void set_call_graph(bool enabled);
+    bool get_call_graph();
+    uint64_t get_lost_calls();
+
+    // Names frames and hot spots. Each line of the file is one of
+    //   C000 reset                   plain; $ or 0x prefixes allowed
+    //   al C:C000 .reset             VICE, and ld65 -Ln as al 00C000 .reset
+    //   reset = $C000                ca65 assignments, := too
+    //   sym id=0,name="reset",...,val=0xC000,...,type=lab   ca65 --dbgfile
+    // Lines that match none of them are skipped; the first name for an
+    // address is kept. False if the file cannot be read.
+    bool load_symbols(string filename);
+    void set_symbol(uint16_t address, string name);
+    string symbol(uint16_t address); // its name, or $XXXX without one
+
+    uint64_t get_executions(uint16_t PC);
+    uint64_t get_cycles(uint16_t PC);
+    uint64_t get_samples(uint16_t PC);
+    uint64_t get_opcode_executions(uint8_t opcode);
+    uint64_t get_opcode_cycles(uint8_t opcode);
+    uint64_t total_executions();
+    uint64_t total_cycles();
+    uint64_t total_samples();
+
+    // up to count addresses, hottest first; count 0 returns all of them
+    vector<Entry> hot_spots(size_t count, Rank rank = BY_CYCLES);
+    vector<Bucket> opcodes(); // by cycles, hottest first
+    vector<Bucket> modes();   // by cycles, hottest first
+    vector<Function> functions(); // by inclusive cycles, hottest first
+    // every path the call graph reached, callers before their callees;
+    // the top level is "[top]"
+    vector<CallPath> call_paths();
+
+    // Ranked text report of the top count addresses, then the opcode and
+    // mode histograms and, with a call graph, the top count functions.
+    // Given the CPU, addresses are disassembled from its current memory.
+    string report(size_t count = 20, MOS6502 * cpu = NULL);
+    // comma separated with a header row; false if the file cannot be written
+    bool save_csv(string filename, Table table = ADDRESSES);
+    // One "outer;inner cycles" line per call path with cycles of its own,
+    // the folded format flamegraph.pl and speedscope read.
+    bool save_folded(string filename);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "rom_image.h"
+
+#ifdef ROM_IMAGE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+RomImage::RomImage() : bytes(NULL), length(0), reserved(0), opened(false), error(MOS6502::LOAD_OK)
+{
+}
+
+RomImage::RomImage(string filename) : bytes(NULL), length(0), reserved(0), opened(false), error(MOS6502::LOAD_OK)
+{
+    open(filename);
+}
+
+RomImage::~RomImage()
+{
+    close();
+}
+
+// The mapping is rounded up to whole 256-byte pages. mmap zero-fills the
+// tail of the last host page, which always covers that rounding, so the
+// padding costs nothing.
+bool RomImage::open(string filename)
+{
+    close();
+#ifdef ROM_IMAGE_MMAP
+    int file = ::open(filename.c_str(), O_RDONLY);
+    if(file < 0)
+    {
+        error = MOS6502::LOAD_OPEN_FAILED;
+        return false;
+    }
+    struct stat info;
+    if(fstat(file, &info) != 0)
+    {
+        ::close(file);
+        error = MOS6502::LOAD_READ_FAILED;
+        return false;
+    }
+    length = info.st_size;
+    reserved = (length + PAGE_SIZE - 1) & ~(size_t)LOW_BYTE;
+    if(reserved > 0)
+    {
+        void * mapped = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE, file, 0);
+        if(mapped == MAP_FAILED)
+        {
+            ::close(file);
+            length = reserved = 0;
+            error = MOS6502::LOAD_READ_FAILED;
+            return false;
+        }
+        bytes = (uint8_t *)mapped;
+    }
+    ::close(file);
+#else
+    FILE * file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+    {
+        error = MOS6502::LOAD_OPEN_FAILED;
+        return false;
+    }
+    long end = -1;
+    if(fseek(file, 0, SEEK_END) == 0)
+    {
+        end = ftell(file);
+    }
+    if(end < 0 || fseek(file, 0, SEEK_SET) != 0)
+    {
+        fclose(file);
+        error = MOS6502::LOAD_READ_FAILED;
+        return false;
+    }
+    length = end;
+    reserved = (length + PAGE_SIZE - 1) & ~(size_t)LOW_BYTE;
+    bytes = (reserved > 0) ? new uint8_t[reserved]() : NULL;
+    bool complete = fread(bytes, 1, length, file) == length;
+    fclose(file);
+    if(!complete)
+    {
+        close();
+        error = MOS6502::LOAD_READ_FAILED;
+        return false;
+    }
+#endif
+    opened = true;
+    error = MOS6502::LOAD_OK;
+    return true;
+}
+
+void RomImage::close()
+{
+    if(bytes != NULL)
+    {
+#ifdef ROM_IMAGE_MMAP
+        munmap(bytes, reserved);
+#else
+        delete[] bytes;
+#endif
+    }
+    bytes = NULL;
+    length = 0;
+    reserved = 0;
+    opened = false;
+}
+
+bool RomImage::is_open() const
+{
+    return opened;
+}
+
+const uint8_t * RomImage::data() const
+{
+    return bytes;
+}
+
+size_t RomImage::size() const
+{
+    return length;
+}
+
+MOS6502::LoadError RomImage::get_error() const
+{
+    return error;
+}
@@ -0,0 +1,47 @@
+#ifndef ROM_IMAGE_H
+#define ROM_IMAGE_H
+
+#include <string>
+#include <stddef.h>
+#include <stdint.h>
+#include "mos6502.h"
+using namespace std;
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ROM_IMAGE_MMAP
+#endif
+
+// A ROM file mapped read-only into host memory once and shared by any
+// number of CPUs through MOS6502::map_rom(). The bytes stay in the OS page
+// cache, so nothing is copied per instance. Hosts without mmap read the
+// file into a private buffer instead. Must outlive every CPU it is mapped
+// into.
+class RomImage
+{
+private:
+    uint8_t * bytes;
+    size_t length;
+    size_t reserved; // bytes mapped or allocated, a whole number of pages
+    bool opened;     // empty files open fine but have no bytes
+    MOS6502::LoadError error;
+
+public:
+    RomImage();
+    RomImage(string filename);
+    ~RomImage();
+
+    // owns its mapping
+    RomImage(const RomImage & other) = delete;
+    RomImage & operator=(const RomImage & other) = delete;
+
+    // drops any image already open; on failure get_error() says why
+    bool open(string filename);
+    void close();
+
+    bool is_open() const;
+    const uint8_t * data() const;
+    size_t size() const; // file size; reads past it up to the next page are 0
+    MOS6502::LoadError get_error() const;
+};
+
+#endif
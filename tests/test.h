@@ -0,0 +1,146 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include "mos6502.h"
+#include "disassembler.h"
+
+// Checks shared by the test programs. A failed check prints where it
+// failed and the test carries on; main() ends with test_result() so ctest
+// sees the failure.
+
+static int test_failures = 0;
+
+#define CHECK(condition) \
+    do \
+    { \
+        if(!(condition)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            test_failures++; \
+        } \
+    } while(0)
+
+#define CHECK_EQUAL(expected, actual) \
+    do \
+    { \
+        unsigned long long check_expected = (unsigned long long)(expected); \
+        unsigned long long check_actual = (unsigned long long)(actual); \
+        if(check_expected != check_actual) \
+        { \
+            fprintf(stderr, "%s:%d: %s is %llu (0x%llX), expected %llu (0x%llX)\n", __FILE__, __LINE__, #actual, \
+                    check_actual, check_actual, check_expected, check_expected); \
+            test_failures++; \
+        } \
+    } while(0)
+
+static const MOS6502::Core test_cores[] = {MOS6502::REFERENCE, MOS6502::THREADED, MOS6502::TRANSLATED, MOS6502::NATIVE};
+static const char * const test_core_names[] = {"reference", "threaded", "translated", "native"};
+#define TEST_CORE_COUNT 4
+
+// deterministic, so a failing seed can be rerun
+struct TestRandom {
+    uint32_t state;
+
+    TestRandom(uint32_t seed) : state(seed * 2654435761u + 1) {}
+
+    uint32_t next(uint32_t range)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % range;
+    }
+};
+
+// Random memory with code at $0200 biased toward loads, stores, branches,
+// calls and read-modify-write ops so that loops form, and the reset vector
+// pointing at it. Illegal opcodes are left out, as each one prints a
+// warning.
+inline void random_program(MOS6502 & cpu, uint32_t seed)
+{
+    static const uint8_t common[] = {
+        0xA9, 0x85, 0xE6, 0xC6, 0xD0, 0xF0, 0x4C, 0xE8, 0xCA, 0x8D,
+        0x9D, 0xBD, 0x18, 0x69, 0x91, 0xB1, 0xEE, 0x20, 0x60, 0x10,
+        0xC9, 0xE0, 0xC0, 0x9A, 0xE9, 0x2A, 0x6A, 0x24, 0x38, 0xF8
+    };
+    TestRandom random(seed);
+    vector<uint8_t> legal;
+    for(int opcode = 0; opcode < 256; opcode++)
+    {
+        if(Disassembler::mnemonic(opcode) != "ILL")
+        {
+            legal.push_back(opcode);
+        }
+    }
+    for(int i = 0; i < MEMORY_SIZE; i++)
+    {
+        cpu.set_memory(i, legal[random.next(legal.size())]);
+    }
+    for(int i = 0x200; i < 0x300; i++)
+    {
+        if(random.next(2))
+        {
+            cpu.set_memory(i, common[random.next(sizeof(common))]);
+        }
+    }
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+    cpu.reset();
+}
+
+// registers, counters and optionally memory; prints the first difference
+inline bool same_state(MOS6502 & expected, MOS6502 & actual, const char * what, bool memory = true)
+{
+    char difference[96] = "";
+    if(expected.get_A() != actual.get_A() || expected.get_X() != actual.get_X() || expected.get_Y() != actual.get_Y())
+    {
+        sprintf(difference, "A/X/Y %02X/%02X/%02X, expected %02X/%02X/%02X", actual.get_A(), actual.get_X(),
+                actual.get_Y(), expected.get_A(), expected.get_X(), expected.get_Y());
+    }
+    else if(expected.get_SP() != actual.get_SP() || expected.get_PC() != actual.get_PC())
+    {
+        sprintf(difference, "SP/PC %04X/%04X, expected %04X/%04X", actual.get_SP(), actual.get_PC(),
+                expected.get_SP(), expected.get_PC());
+    }
+    else if(expected.get_status() != actual.get_status())
+    {
+        sprintf(difference, "status %02X, expected %02X", actual.get_status(), expected.get_status());
+    }
+    else if(expected.get_cycles() != actual.get_cycles() || expected.get_instructions() != actual.get_instructions())
+    {
+        sprintf(difference, "cycles/instructions %llu/%llu, expected %llu/%llu",
+                (unsigned long long)actual.get_cycles(), (unsigned long long)actual.get_instructions(),
+                (unsigned long long)expected.get_cycles(), (unsigned long long)expected.get_instructions());
+    }
+    else if(memory)
+    {
+        for(int i = 0; i < MEMORY_SIZE; i++)
+        {
+            if(expected.get_memory(i) != actual.get_memory(i))
+            {
+                sprintf(difference, "memory $%04X %02X, expected %02X", i, actual.get_memory(i),
+                        expected.get_memory(i));
+                break;
+            }
+        }
+    }
+    if(difference[0] != '\0')
+    {
+        fprintf(stderr, "%s: %s\n", what, difference);
+        test_failures++;
+        return false;
+    }
+    return true;
+}
+
+inline int test_result()
+{
+    if(test_failures > 0)
+    {
+        fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,107 @@
+#include "test.h"
+#include "batch_runner.h"
+
+// Instances run by a BatchRunner end up as if each had run on its own.
+
+#define BATCH_INSTANCES 12
+#define BATCH_THREADS 3
+#define BATCH_STEPS 20000
+#define SHARED_LARGE "test_shared_large.bin"
+#define SHARED_SMALL "test_shared_small.bin"
+
+static void test_run()
+{
+    BatchRunner runner(BATCH_INSTANCES, BATCH_THREADS);
+    runner.set_slice(1000);
+    MOS6502 alone[BATCH_INSTANCES];
+    for(size_t i = 0; i < BATCH_INSTANCES; i++)
+    {
+        random_program(runner.instance(i), i + 1);
+        random_program(alone[i], i + 1);
+    }
+
+    for(size_t i = 0; i < BATCH_INSTANCES; i++)
+    {
+        CHECK((uintptr_t)&runner.instance(i) % CACHE_LINE_SIZE == 0);
+    }
+
+    BatchRunner::Report report = runner.run(BATCH_STEPS);
+    uint64_t instructions = 0;
+    for(size_t i = 0; i < BATCH_INSTANCES; i++)
+    {
+        CHECK_EQUAL(alone[i].run(BATCH_STEPS), report.reasons[i]);
+        same_state(alone[i], runner.instance(i), "batch");
+        instructions += alone[i].get_instructions();
+    }
+    CHECK_EQUAL(instructions, report.instructions);
+
+    // a stop PC given as a plain int picks the public overload
+    report = runner.run(BATCH_STEPS, 0x0200);
+    for(size_t i = 0; i < BATCH_INSTANCES; i++)
+    {
+        CHECK_EQUAL(alone[i].run(BATCH_STEPS, 0x0200), report.reasons[i]);
+        same_state(alone[i], runner.instance(i), "batch to a stop PC");
+    }
+}
+
+// fresh instances start like a default constructed MOS6502
+static void test_fresh()
+{
+    BatchRunner runner(3, 1);
+    MOS6502 alone;
+    for(size_t i = 0; i < runner.size(); i++)
+    {
+        same_state(alone, runner.instance(i), "fresh instance");
+    }
+    runner.instance(0).set_memory(0x1234, 0x56);
+    CHECK_EQUAL(0, runner.instance(1).get_memory(0x1234));
+}
+
+static void write_file(const char * name, uint8_t value, size_t size)
+{
+    FILE * file = fopen(name, "wb");
+    for(size_t i = 0; i < size; i++)
+    {
+        fputc(value, file);
+    }
+    fclose(file);
+}
+
+// loading a second image replaces the first, and a failed load keeps it
+static void test_load_shared()
+{
+    write_file(SHARED_LARGE, 0xAA, 2 * PAGE_SIZE);
+    write_file(SHARED_SMALL, 0xBB, PAGE_SIZE);
+    BatchRunner runner(3, 1);
+    CHECK(runner.load_shared(SHARED_LARGE, 0x8000));
+    CHECK(runner.load_shared(SHARED_SMALL, 0x8000));
+    for(size_t i = 0; i < runner.size(); i++)
+    {
+        CHECK_EQUAL(0xBB, runner.instance(i).get_memory(0x8000));
+        // the page only the first image covered is RAM again
+        CHECK_EQUAL(0x00, runner.instance(i).get_memory(0x8100));
+        runner.instance(i).set_memory(0x8100, i + 1);
+        CHECK_EQUAL(i + 1, runner.instance(i).get_memory(0x8100));
+    }
+
+    CHECK(!runner.load_shared("no_such_image.bin", 0x8000));
+    CHECK_EQUAL(MOS6502::LOAD_OPEN_FAILED, runner.get_load_error());
+    CHECK(!runner.load_shared(SHARED_LARGE, 0x8080));
+    CHECK_EQUAL(MOS6502::LOAD_NOT_ALIGNED, runner.get_load_error());
+    for(size_t i = 0; i < runner.size(); i++)
+    {
+        CHECK_EQUAL(0xBB, runner.instance(i).get_memory(0x8000));
+        runner.instance(i).set_memory(0x8000, 0x00);
+        CHECK_EQUAL(0xBB, runner.instance(i).get_memory(0x8000));
+    }
+    remove(SHARED_LARGE);
+    remove(SHARED_SMALL);
+}
+
+int main()
+{
+    test_fresh();
+    test_load_shared();
+    test_run();
+    return test_result();
+}
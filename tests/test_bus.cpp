@@ -0,0 +1,125 @@
+#include "test.h"
+
+// Read-modify-write instructions on device pages, on every core: one read,
+// the old value written back, then the new value.
+
+#define BUS_DEVICE_PAGE 0xD0
+#define BUS_WRITE_PAGE 0xD1 // RAM that sends writes to the device
+#define BUS_CODE 0x0200
+
+struct BusAccess {
+    char kind; // 'R' or 'W'
+    uint16_t address;
+    uint8_t value;
+};
+
+// one register per address, logging every access
+class RecordingDevice : public BusDevice
+{
+public:
+    uint8_t registers[PAGE_SIZE * 2];
+    vector<BusAccess> accesses;
+
+    RecordingDevice() { memset(registers, 0, sizeof(registers)); }
+
+    uint8_t read(uint16_t address)
+    {
+        uint8_t value = registers[address & (PAGE_SIZE * 2 - 1)];
+        BusAccess access = {'R', address, value};
+        accesses.push_back(access);
+        return value;
+    }
+
+    void write(uint16_t address, uint8_t value)
+    {
+        registers[address & (PAGE_SIZE * 2 - 1)] = value;
+        BusAccess access = {'W', address, value};
+        accesses.push_back(access);
+    }
+};
+
+struct RmwCase {
+    const char * name;
+    uint8_t bytes[3];
+    uint8_t X;
+    bool carry;     // C before
+    uint16_t address;
+    uint8_t before;
+    uint8_t after;
+    bool read;      // false where only writes reach the device
+    uint8_t status; // N, Z and C after
+};
+
+static const RmwCase rmw_cases[] = {
+    {"INC abs",          {0xEE, 0x00, 0xD0}, 0x00, false, 0xD000, 0x81, 0x82, true,  FLAG_N},
+    {"INC abs,X",        {0xFE, 0xFF, 0xCF}, 0x01, false, 0xD000, 0xFF, 0x00, true,  FLAG_Z},
+    {"ASL abs",          {0x0E, 0x10, 0xD0}, 0x00, false, 0xD010, 0x81, 0x02, true,  FLAG_C},
+    {"ASL abs,X",        {0x1E, 0x00, 0xD0}, 0x20, false, 0xD020, 0x40, 0x80, true,  FLAG_N},
+    {"ROR abs",          {0x6E, 0x30, 0xD0}, 0x00, true,  0xD030, 0x81, 0xC0, true,  FLAG_N | FLAG_C},
+    {"ROR abs,X",        {0x7E, 0x30, 0xD0}, 0x01, false, 0xD031, 0x01, 0x00, true,  FLAG_Z | FLAG_C},
+    {"INC write page",   {0xEE, 0x40, 0xD1}, 0x00, false, 0xD140, 0x7F, 0x80, false, FLAG_N},
+    {"ROR write page",   {0x6E, 0x41, 0xD1}, 0x00, true,  0xD141, 0x02, 0x81, false, FLAG_N},
+};
+
+static void test_rmw(MOS6502::Core core, const char * core_name, const RmwCase & test)
+{
+    MOS6502 cpu;
+    RecordingDevice device;
+    cpu.set_core(core);
+    for(int i = 0; i < 3; i++)
+    {
+        cpu.set_memory(BUS_CODE + i, test.bytes[i]);
+    }
+    // RAM the write page reads from, and the register the device page reads
+    cpu.set_memory(test.address, test.before);
+    device.registers[test.address & (PAGE_SIZE * 2 - 1)] = test.before;
+    cpu.map_device(BUS_DEVICE_PAGE, BUS_DEVICE_PAGE, &device);
+    cpu.map_write_device(BUS_WRITE_PAGE, BUS_WRITE_PAGE, &device);
+    cpu.set_PC(BUS_CODE);
+    cpu.set_X(test.X);
+    cpu.set_status(FLAG_U | (test.carry ? FLAG_C : 0));
+    cpu.step();
+
+    vector<BusAccess> expected;
+    BusAccess read = {'R', test.address, test.before};
+    BusAccess old_value = {'W', test.address, test.before};
+    BusAccess new_value = {'W', test.address, test.after};
+    if(test.read)
+    {
+        expected.push_back(read);
+    }
+    expected.push_back(old_value);
+    expected.push_back(new_value);
+
+    bool same = device.accesses.size() == expected.size();
+    for(size_t i = 0; same && i < expected.size(); i++)
+    {
+        same = device.accesses[i].kind == expected[i].kind && device.accesses[i].address == expected[i].address &&
+               device.accesses[i].value == expected[i].value;
+    }
+    if(!same)
+    {
+        fprintf(stderr, "%s on %s: device saw", test.name, core_name);
+        for(size_t i = 0; i < device.accesses.size(); i++)
+        {
+            fprintf(stderr, " %c $%04X %02X", device.accesses[i].kind, device.accesses[i].address,
+                    device.accesses[i].value);
+        }
+        fprintf(stderr, "\n");
+        test_failures++;
+    }
+    CHECK_EQUAL(FLAG_U | test.status, cpu.get_status());
+    CHECK_EQUAL(BUS_CODE + 3, cpu.get_PC());
+}
+
+int main()
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        for(size_t i = 0; i < sizeof(rmw_cases) / sizeof(rmw_cases[0]); i++)
+        {
+            test_rmw(test_cores[c], test_core_names[c], rmw_cases[i]);
+        }
+    }
+    return test_result();
+}
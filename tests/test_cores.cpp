@@ -0,0 +1,153 @@
+#include "test.h"
+
+// Every core has to leave the CPU exactly as REFERENCE does, whichever of
+// step(), run() and run_cycles() drives it.
+
+#define RANDOM_SEEDS 40
+#define RANDOM_CALLS 300 // run(), run_cycles() or step() calls per seed
+#define MEMORY_CHECK_INTERVAL 16 // calls between memory comparisons
+
+#define SUM_TOTAL 0x13BA // 1 + 2 + ... + 100
+#define SUM_RESULT 0x10
+#define SUM_DONE 0x0215  // its JMP *
+
+// adds 1 to 100 into a word at $10, then loops on JMP *
+static const uint8_t sum_program[] = {
+    0xA9, 0x00,       // 0200 LDA #0
+    0x85, 0x10,       // 0202 STA $10
+    0x85, 0x11,       // 0204 STA $11
+    0xA2, 0x64,       // 0206 LDX #100
+    0x8A,             // 0208 TXA
+    0x18,             // 0209 CLC
+    0x65, 0x10,       // 020A ADC $10
+    0x85, 0x10,       // 020C STA $10
+    0x90, 0x02,       // 020E BCC $0212
+    0xE6, 0x11,       // 0210 INC $11
+    0xCA,             // 0212 DEX
+    0xD0, 0xF3,       // 0213 BNE $0208
+    0x4C, 0x15, 0x02  // 0215 JMP $0215
+};
+
+static void load_sum(MOS6502 & cpu, MOS6502::Core core)
+{
+    cpu.set_core(core);
+    for(unsigned i = 0; i < sizeof(sum_program); i++)
+    {
+        cpu.set_memory(0x200 + i, sum_program[i]);
+    }
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+    cpu.reset();
+}
+
+static void check_sum(MOS6502 & cpu)
+{
+    CHECK_EQUAL(SUM_TOTAL & LOW_BYTE, cpu.get_memory(SUM_RESULT));
+    CHECK_EQUAL(SUM_TOTAL >> 8, cpu.get_memory(SUM_RESULT + 1));
+    CHECK_EQUAL(SUM_DONE, cpu.get_PC());
+}
+
+// the same answer and counts from run(), run_cycles() and step()
+static void test_sum()
+{
+    MOS6502 expected;
+    load_sum(expected, MOS6502::REFERENCE);
+    expected.set_halt_conditions(MOS6502::HALT_ON_SELF_LOOP);
+    CHECK_EQUAL(MOS6502::STOP_SELF_LOOP, expected.run(100000));
+    check_sum(expected);
+
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 by_run;
+        load_sum(by_run, test_cores[c]);
+        by_run.set_jit_threshold(1);
+        by_run.set_halt_conditions(MOS6502::HALT_ON_SELF_LOOP);
+        CHECK_EQUAL(MOS6502::STOP_SELF_LOOP, by_run.run(100000));
+        same_state(expected, by_run, test_core_names[c]);
+
+        MOS6502 by_cycles;
+        load_sum(by_cycles, test_cores[c]);
+        by_cycles.set_jit_threshold(1);
+        while(by_cycles.get_PC() != SUM_DONE)
+        {
+            by_cycles.run_cycles(5);
+        }
+        check_sum(by_cycles);
+
+        MOS6502 by_step;
+        load_sum(by_step, test_cores[c]);
+        by_step.set_jit_threshold(1);
+        while(by_step.get_PC() != SUM_DONE)
+        {
+            by_step.step();
+        }
+        check_sum(by_step);
+    }
+}
+
+// random programs, driven by the same random mix of calls on every core
+static void test_random(uint32_t seed)
+{
+    MOS6502 cpus[TEST_CORE_COUNT];
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        cpus[c].set_core(test_cores[c]);
+        cpus[c].set_jit_threshold(1);
+        random_program(cpus[c], seed);
+    }
+
+    TestRandom calls(seed + 1000);
+    for(int n = 0; n < RANDOM_CALLS; n++)
+    {
+        unsigned kind = calls.next(4);
+        unsigned amount = calls.next(100) + 1;
+        uint16_t stop_PC = 0x200 + calls.next(256);
+        for(int c = 0; c < TEST_CORE_COUNT; c++)
+        {
+            if(kind == 0)
+            {
+                cpus[c].run(amount);
+            }
+            else if(kind == 1)
+            {
+                cpus[c].run(amount, stop_PC);
+            }
+            else if(kind == 2)
+            {
+                cpus[c].run_cycles(amount);
+            }
+            else
+            {
+                cpus[c].step();
+            }
+        }
+        for(int c = 1; c < TEST_CORE_COUNT; c++)
+        {
+            bool memory = (n % MEMORY_CHECK_INTERVAL == 0) || n == RANDOM_CALLS - 1;
+            bool same = same_state(cpus[0], cpus[c], test_core_names[c], memory);
+            if(same && (cpus[0].get_last_PC() != cpus[c].get_last_PC() ||
+                        cpus[0].get_last_instr() != cpus[c].get_last_instr()))
+            {
+                fprintf(stderr, "%s: last instruction %s, expected %s\n", test_core_names[c],
+                        cpus[c].get_last_instr().c_str(), cpus[0].get_last_instr().c_str());
+                test_failures++;
+                same = false;
+            }
+            if(!same)
+            {
+                fprintf(stderr, "  seed %u, call %d\n", seed, n);
+                return;
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_sum();
+    for(uint32_t seed = 1; seed <= RANDOM_SEEDS; seed++)
+    {
+        test_random(seed);
+    }
+    return test_result();
+}
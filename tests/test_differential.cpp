@@ -0,0 +1,137 @@
+#include "test.h"
+
+// Instruction by instruction cross-checks of the faster paths against the
+// reference core: the threaded and translated cores, the lazy N and Z
+// flags, and idle loop skipping.
+
+#define STEP_SEEDS 20
+#define STEP_COUNT 20000
+#define STEP_RESTART 200 // steps between jumps to a random PC and status
+#define STEP_MEMORY_INTERVAL 1000 // steps between memory comparisons
+
+#define IDLE_FLAG 0x10
+#define IDLE_COUNTER 0x11
+#define IDLE_PERIOD 1000 // cycles between raising the flag
+#define IDLE_STEPS 100000
+
+// Random code entered at random PCs with random registers and status,
+// decimal mode included, so every legal opcode runs with every flag
+// combination. Status is compared after each instruction, which also
+// checks that the lazy N and Z agree with eager evaluation, and
+// set_status() re-seeds them on every restart.
+static void test_steps(uint32_t seed)
+{
+    MOS6502 cpus[TEST_CORE_COUNT];
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        cpus[c].set_core(test_cores[c]);
+        random_program(cpus[c], seed);
+    }
+
+    TestRandom random(seed + 2000);
+    for(int n = 0; n < STEP_COUNT; n++)
+    {
+        if(n % STEP_RESTART == 0)
+        {
+            uint16_t PC = random.next(MEMORY_SIZE);
+            uint8_t A = random.next(256);
+            uint8_t X = random.next(256);
+            uint8_t Y = random.next(256);
+            uint8_t status = random.next(256);
+            for(int c = 0; c < TEST_CORE_COUNT; c++)
+            {
+                cpus[c].set_PC(PC);
+                cpus[c].set_A(A);
+                cpus[c].set_X(X);
+                cpus[c].set_Y(Y);
+                cpus[c].set_status(status);
+            }
+        }
+        for(int c = 0; c < TEST_CORE_COUNT; c++)
+        {
+            cpus[c].step();
+        }
+        bool memory = (n % STEP_MEMORY_INTERVAL == 0) || n == STEP_COUNT - 1;
+        for(int c = 1; c < TEST_CORE_COUNT; c++)
+        {
+            bool same = same_state(cpus[0], cpus[c], test_core_names[c], memory);
+            if(same && cpus[0].get_last_instr() != cpus[c].get_last_instr())
+            {
+                fprintf(stderr, "%s: last instruction %s, expected %s\n", test_core_names[c],
+                        cpus[c].get_last_instr().c_str(), cpus[0].get_last_instr().c_str());
+                test_failures++;
+                same = false;
+            }
+            if(!same)
+            {
+                fprintf(stderr, "  seed %u, step %d, after %s at $%04X\n", seed, n,
+                        cpus[0].get_last_instr().c_str(), cpus[0].get_last_PC());
+                return;
+            }
+        }
+    }
+}
+
+// raises the flag the idle program waits on, every IDLE_PERIOD cycles
+static void raise_flag(MOS6502 & cpu, uint64_t cycle)
+{
+    cpu.set_memory(IDLE_FLAG, 1);
+    cpu.schedule_event(cycle + IDLE_PERIOD, raise_flag);
+}
+
+// waits for the flag, clears it and counts it
+static const uint8_t idle_program[] = {
+    0xA5, 0x10,       // 0200 LDA $10
+    0xF0, 0xFC,       // 0202 BEQ $0200
+    0xA9, 0x00,       // 0204 LDA #0
+    0x85, 0x10,       // 0206 STA $10
+    0xE6, 0x11,       // 0208 INC $11
+    0x4C, 0x00, 0x02  // 020A JMP $0200
+};
+
+static void load_idle(MOS6502 & cpu, MOS6502::Core core, bool skip)
+{
+    cpu.set_core(core);
+    cpu.set_idle_skip(skip);
+    for(unsigned i = 0; i < sizeof(idle_program); i++)
+    {
+        cpu.set_memory(0x200 + i, idle_program[i]);
+    }
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+    cpu.reset();
+    cpu.schedule_event(IDLE_PERIOD, raise_flag);
+}
+
+// skipped passes are counted as if they ran, so skipping changes nothing
+// but get_idle_cycles()
+static void test_idle()
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 full;
+        MOS6502 skipped;
+        load_idle(full, test_cores[c], false);
+        load_idle(skipped, test_cores[c], true);
+        full.run(IDLE_STEPS);
+        skipped.run(IDLE_STEPS);
+        same_state(full, skipped, test_core_names[c]);
+        CHECK_EQUAL(0, full.get_idle_cycles());
+        CHECK(skipped.get_idle_cycles() > 0);
+        CHECK(full.get_memory(IDLE_COUNTER) > 0);
+
+        full.run_cycles(IDLE_STEPS);
+        skipped.run_cycles(IDLE_STEPS);
+        same_state(full, skipped, test_core_names[c]);
+    }
+}
+
+int main()
+{
+    for(uint32_t seed = 1; seed <= STEP_SEEDS; seed++)
+    {
+        test_steps(seed);
+    }
+    test_idle();
+    return test_result();
+}
@@ -0,0 +1,53 @@
+#include "test.h"
+
+// Listing emulator memory reads it without touching devices.
+
+// counts reads, as a device with read side effects would see them
+class CountingDevice : public BusDevice
+{
+public:
+    int reads;
+
+    CountingDevice() : reads(0) {}
+    uint8_t read(uint16_t) { reads++; return 0xEA; }
+    void write(uint16_t, uint8_t) {}
+};
+
+static void test_listing()
+{
+    static const uint8_t program[] = {
+        0xA9, 0x40,       // 0200 LDA #$40
+        0x8D, 0x00, 0x03, // 0202 STA $0300
+        0xE8              // 0205 INX
+    };
+    MOS6502 cpu;
+    for(unsigned i = 0; i < sizeof(program); i++)
+    {
+        cpu.set_memory(0x200 + i, program[i]);
+    }
+    vector<string> listing = Disassembler::disassemble(cpu, 0x200, 0x205);
+    CHECK_EQUAL(3, listing.size());
+    if(listing.size() == 3)
+    {
+        CHECK(listing[0] == "0200: LDA #$40");
+        CHECK(listing[1] == "0202: STA $300");
+        CHECK(listing[2] == "0205: INX "); // no operand, same separator
+    }
+}
+
+static void test_devices()
+{
+    MOS6502 cpu;
+    CountingDevice device;
+    cpu.map_device(0xD0, 0xD0, &device);
+    vector<string> listing = Disassembler::disassemble(cpu, 0xD000, 0xD0FF);
+    CHECK_EQUAL(0, device.reads);
+    CHECK_EQUAL(PAGE_SIZE, listing.size()); // one BRK per byte
+}
+
+int main()
+{
+    test_listing();
+    test_devices();
+    return test_result();
+}
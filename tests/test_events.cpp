@@ -0,0 +1,153 @@
+#include "test.h"
+#include "jit.h"
+
+// The event scheduler: order on a shared cycle, cancelling, callbacks that
+// reschedule themselves, and firing at the same instruction boundary on
+// every core, TRANSLATED and NATIVE blocks included.
+
+#define EVENT_SHORT_PERIOD 37 // cycles between firings, shorter than a block
+#define EVENT_LONG_PERIOD 401 // long enough for compiled blocks in between
+#define EVENT_BUDGET 40000    // cycles per run_cycles() test
+#define EVENT_SLICES 50
+
+static string order; // tags of the fired events, in firing order
+static vector<uint64_t> firings; // scheduled cycle, cycle and PC per firing
+static uint64_t period;
+
+static void fire_a(MOS6502 &, uint64_t) { order += 'a'; }
+static void fire_b(MOS6502 &, uint64_t) { order += 'b'; }
+static void fire_c(MOS6502 &, uint64_t) { order += 'c'; }
+static void fire_d(MOS6502 &, uint64_t) { order += 'd'; }
+
+static void repeat(MOS6502 & cpu, uint64_t cycle)
+{
+    firings.push_back(cycle);
+    firings.push_back(cpu.get_cycles());
+    firings.push_back(cpu.get_PC());
+    cpu.schedule_event(cycle + period, repeat);
+}
+
+// a long straight run of register ops, so translated blocks are long, then
+// a jump back
+static void load_loop(MOS6502 & cpu, MOS6502::Core core)
+{
+    static const uint8_t ops[] = {0xE8, 0xC8, 0x8A, 0x69, 0x05, 0xAA, 0x98, 0x29, 0x7F, 0xCA, 0x18, 0xEA};
+    cpu.set_core(core);
+    cpu.set_jit_threshold(1);
+    uint16_t pc = 0x200;
+    for(int n = 0; n < 4; n++)
+    {
+        for(unsigned i = 0; i < sizeof(ops); i++)
+        {
+            cpu.set_memory(pc++, ops[i]);
+        }
+    }
+    cpu.set_memory(pc, 0x4C);
+    cpu.set_memory(pc + 1, 0x00);
+    cpu.set_memory(pc + 2, 0x02);
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+    cpu.reset();
+}
+
+// events due on the same cycle fire in the order they were scheduled
+static void test_order(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    load_loop(cpu, core);
+    order.clear();
+    uint64_t c = cpu.schedule_event(100, fire_c);
+    uint64_t a = cpu.schedule_event(100, fire_a);
+    uint64_t b = cpu.schedule_event(100, fire_b);
+    cpu.schedule_event(50, fire_d);
+    CHECK(c < a && a < b);
+    CHECK_EQUAL(50, cpu.get_next_event());
+    cpu.run_cycles(200);
+    CHECK(order == "dcab");
+    CHECK_EQUAL(NO_EVENT, cpu.get_next_event());
+}
+
+static void test_cancel(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    load_loop(cpu, core);
+    order.clear();
+    uint64_t a = cpu.schedule_event(50, fire_a);
+    uint64_t b = cpu.schedule_event(100, fire_b);
+    cpu.schedule_event(100, fire_c);
+    CHECK(cpu.cancel_event(a));
+    CHECK_EQUAL(100, cpu.get_next_event());
+    CHECK(!cpu.cancel_event(a));
+    CHECK(cpu.cancel_event(b));
+    cpu.run_cycles(200);
+    CHECK(order == "c");
+    CHECK(!cpu.cancel_event(b));
+}
+
+// a callback that reschedules itself keeps firing, each time at the first
+// instruction boundary at or after its cycle, and on the same boundary on
+// every core whichever way the CPU is run
+static void test_repeat(uint64_t every, bool by_cycles)
+{
+    period = every;
+    vector<uint64_t> expected;
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 cpu;
+        load_loop(cpu, test_cores[c]);
+        firings.clear();
+        cpu.schedule_event(period, repeat);
+        for(int n = 0; n < EVENT_SLICES; n++)
+        {
+            if(by_cycles)
+            {
+                cpu.run_cycles(EVENT_BUDGET / EVENT_SLICES);
+            }
+            else
+            {
+                cpu.run(EVENT_BUDGET / EVENT_SLICES / 2);
+            }
+        }
+        CHECK(firings.size() / 3 >= cpu.get_cycles() / period - 1);
+        for(size_t i = 0; i < firings.size(); i += 3)
+        {
+            if(firings[i + 1] < firings[i] || firings[i + 1] >= firings[i] + INSTRUCTION_MAX_CYCLES)
+            {
+                fprintf(stderr, "%s: event for cycle %llu fired at %llu\n", test_core_names[c],
+                        (unsigned long long)firings[i], (unsigned long long)firings[i + 1]);
+                test_failures++;
+                break;
+            }
+        }
+#ifdef JIT_X86_64
+        if(test_cores[c] == MOS6502::NATIVE && period == EVENT_LONG_PERIOD)
+        {
+            CHECK(cpu.get_native_instructions() > 0);
+        }
+#endif
+        if(c == 0)
+        {
+            expected = firings;
+        }
+        else if(firings != expected)
+        {
+            fprintf(stderr, "%s fires at different cycles or PCs from %s, by %s\n", test_core_names[c],
+                    test_core_names[0], by_cycles ? "run_cycles" : "run");
+            test_failures++;
+        }
+    }
+}
+
+int main()
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        test_order(test_cores[c]);
+        test_cancel(test_cores[c]);
+    }
+    test_repeat(EVENT_SHORT_PERIOD, true);
+    test_repeat(EVENT_SHORT_PERIOD, false);
+    test_repeat(EVENT_LONG_PERIOD, true);
+    test_repeat(EVENT_LONG_PERIOD, false);
+    return test_result();
+}
@@ -0,0 +1,150 @@
+#include "test.h"
+
+// IRQ, NMI and RESET on every core: IRQ is a shared level, NMI and RESET
+// are edges, and NMI wins over IRQ.
+
+#define IRQ_HANDLER 0x0300
+#define NMI_HANDLER 0x0400
+#define RESET_START 0x0500
+
+static const uint8_t main_program[] = {
+    0xEA,             // 0200 NOP
+    0xEA,             // 0201 NOP
+    0x4C, 0x00, 0x02  // 0202 JMP $0200
+};
+
+// IRQ counts in X, NMI in Y, and both return at once
+static void load_interrupts(MOS6502 & cpu, MOS6502::Core core)
+{
+    cpu.set_core(core);
+    for(unsigned i = 0; i < sizeof(main_program); i++)
+    {
+        cpu.set_memory(0x200 + i, main_program[i]);
+        cpu.set_memory(RESET_START + i, main_program[i]);
+    }
+    cpu.set_memory(IRQ_HANDLER, 0xE8);     // INX
+    cpu.set_memory(IRQ_HANDLER + 1, 0x40); // RTI
+    cpu.set_memory(NMI_HANDLER, 0xC8);     // INY
+    cpu.set_memory(NMI_HANDLER + 1, 0x40); // RTI
+    cpu.set_memory(IRQ_LOW, IRQ_HANDLER & LOW_BYTE);
+    cpu.set_memory(IRQ_HIGH, IRQ_HANDLER >> 8);
+    cpu.set_memory(NMI_LOW, NMI_HANDLER & LOW_BYTE);
+    cpu.set_memory(NMI_HIGH, NMI_HANDLER >> 8);
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+    cpu.reset();
+    cpu.set_status(FLAG_U); // I clear
+}
+
+// IRQ waits while I is set and keeps being taken for as long as it is held
+static void test_level(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    load_interrupts(cpu, core);
+    cpu.set_status(FLAG_U | FLAG_I);
+    cpu.assert_irq(0);
+    cpu.run(10);
+    CHECK_EQUAL(0, cpu.get_X());
+
+    cpu.set_status(FLAG_U);
+    uint64_t cycles = cpu.get_cycles();
+    cpu.step();
+    CHECK_EQUAL(IRQ_HANDLER + 1, cpu.get_PC());
+    CHECK_EQUAL(cycles + INTERRUPT_CYCLES + 2, cpu.get_cycles());
+    CHECK_EQUAL(0x1FA, cpu.get_SP());
+    CHECK(cpu.get_status() & FLAG_I);
+    // taken again after each RTI, two instructions a pass
+    cpu.run(9);
+    CHECK_EQUAL(5, cpu.get_X());
+
+    cpu.release_irq(0);
+    cpu.run(10);
+    CHECK_EQUAL(5, cpu.get_X());
+}
+
+// the line drops only once every source has released it
+static void test_shared(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    load_interrupts(cpu, core);
+    cpu.assert_irq(0);
+    cpu.assert_irq(IRQ_SOURCE_COUNT - 1);
+    cpu.run(4);
+    CHECK_EQUAL(2, cpu.get_X());
+    cpu.release_irq(0);
+    cpu.run(4);
+    CHECK_EQUAL(4, cpu.get_X());
+    cpu.release_irq(IRQ_SOURCE_COUNT - 1);
+    cpu.run(4);
+    CHECK_EQUAL(4, cpu.get_X());
+
+    // out of range ids touch no source
+    cpu.assert_irq(IRQ_SOURCE_COUNT);
+    cpu.run(4);
+    CHECK_EQUAL(4, cpu.get_X());
+    cpu.assert_irq(0);
+    cpu.release_irq(IRQ_SOURCE_COUNT);
+    cpu.run(4);
+    CHECK_EQUAL(6, cpu.get_X());
+}
+
+// NMI is taken once per edge, I or not, and before a held IRQ
+static void test_nmi(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    load_interrupts(cpu, core);
+    cpu.set_status(FLAG_U | FLAG_I);
+    cpu.trigger_nmi();
+    cpu.run(10);
+    CHECK_EQUAL(1, cpu.get_Y());
+
+    cpu.set_status(FLAG_U);
+    cpu.assert_irq(0);
+    cpu.trigger_nmi();
+    cpu.step();
+    CHECK_EQUAL(NMI_HANDLER + 1, cpu.get_PC());
+    CHECK_EQUAL(2, cpu.get_Y());
+    CHECK_EQUAL(0, cpu.get_X());
+    cpu.step(); // RTI, then the IRQ
+    cpu.step();
+    CHECK_EQUAL(IRQ_HANDLER + 1, cpu.get_PC());
+    CHECK_EQUAL(2, cpu.get_Y());
+    CHECK_EQUAL(1, cpu.get_X());
+}
+
+// RESET reloads the registers and PC from $FFFC, once
+static void test_reset(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    load_interrupts(cpu, core);
+    cpu.run(5);
+    cpu.set_A(0x55);
+    cpu.set_memory(RESET_LOW, RESET_START & LOW_BYTE);
+    cpu.set_memory(RESET_HIGH, RESET_START >> 8);
+    cpu.trigger_reset();
+    cpu.step();
+    CHECK_EQUAL(RESET_START + 1, cpu.get_PC());
+    CHECK_EQUAL(0, cpu.get_A());
+    CHECK_EQUAL(SP_START, cpu.get_SP());
+    CHECK(cpu.get_status() & FLAG_I);
+    cpu.set_A(0x66);
+    cpu.run(10);
+    CHECK_EQUAL(0x66, cpu.get_A());
+}
+
+int main()
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        int failures = test_failures;
+        test_level(test_cores[c]);
+        test_shared(test_cores[c]);
+        test_nmi(test_cores[c]);
+        test_reset(test_cores[c]);
+        if(test_failures > failures)
+        {
+            fprintf(stderr, "  on %s\n", test_core_names[c]);
+        }
+    }
+    return test_result();
+}
@@ -0,0 +1,192 @@
+#include "test.h"
+#include "jit.h"
+
+// NATIVE runs random code made of what the JIT compiles, a block at a
+// time, against REFERENCE stepping the same number of instructions.
+// Registers, flags, counters and memory are compared after every block.
+
+#define JIT_SEEDS 10
+#define JIT_BLOCKS 1500   // step_block() calls per seed
+#define JIT_SLICES 500    // run_cycles() calls per seed
+#define JIT_CODE 0x0400   // random code from here up to JIT_CODE_END
+#define JIT_CODE_END 0x0C00
+#define JIT_DATA 0x3000   // absolute operands, a page of it
+#define JIT_ZERO_PAGE 0x80 // zero page operands are below this
+
+static const uint8_t immediate_ops[] = {0xA9, 0xA2, 0xA0, 0x29, 0x09, 0x49, 0x69, 0xE9, 0xC9, 0xE0, 0xC0};
+static const uint8_t zero_page_ops[] = {0xA5, 0xA6, 0xA4, 0x85, 0x86, 0x84, 0x25, 0x05, 0x45,
+                                        0x65, 0xE5, 0xC5, 0xE4, 0xC4, 0xE6, 0xC6};
+static const uint8_t absolute_ops[] = {0xAD, 0xAE, 0xAC, 0x8D, 0x8E, 0x8C, 0x2D, 0x0D, 0x4D,
+                                       0x6D, 0xED, 0xCD, 0xEC, 0xCC, 0xEE, 0xCE};
+static const uint8_t implied_ops[] = {0xAA, 0xA8, 0x8A, 0x98, 0xE8, 0xC8, 0xCA, 0x88, 0x18, 0x38, 0xB8, 0xEA};
+static const uint8_t branch_ops[] = {0x10, 0x30, 0x50, 0x70, 0x90, 0xB0, 0xD0, 0xF0};
+static const uint8_t code_writes[] = {0x8D, 0x8E, 0x8C, 0xEE, 0xCE}; // STA STX STY INC DEC
+
+// Mostly compilable instructions with fixed operands, broken into blocks
+// by branches and jumps to other instructions. A few absolute writes
+// rewrite an immediate operand in the code itself, and the odd SED sends
+// blocks to the interpreter until a CLD.
+static void jit_program(MOS6502 & cpu, uint32_t seed)
+{
+    TestRandom random(seed);
+    for(int i = 0; i < PAGE_SIZE; i++)
+    {
+        cpu.set_memory(i, random.next(256));
+        cpu.set_memory(JIT_DATA + i, random.next(256));
+    }
+
+    uint16_t pc = JIT_CODE;
+    vector<uint16_t> starts;     // instruction addresses
+    vector<uint16_t> immediates; // operand addresses, for code to rewrite
+    vector<uint16_t> branches;   // branch and JMP operands, filled in below
+    while(pc < JIT_CODE_END)
+    {
+        starts.push_back(pc);
+        unsigned kind = random.next(100);
+        if(kind < 15)
+        {
+            cpu.set_memory(pc++, immediate_ops[random.next(sizeof(immediate_ops))]);
+            immediates.push_back(pc);
+            cpu.set_memory(pc++, random.next(256));
+        }
+        else if(kind < 40)
+        {
+            cpu.set_memory(pc++, zero_page_ops[random.next(sizeof(zero_page_ops))]);
+            cpu.set_memory(pc++, random.next(JIT_ZERO_PAGE));
+        }
+        else if(kind < 60)
+        {
+            uint8_t opcode = absolute_ops[random.next(sizeof(absolute_ops))];
+            uint16_t address = JIT_DATA + random.next(PAGE_SIZE);
+            if(random.next(50) == 0 && !immediates.empty())
+            {
+                opcode = code_writes[random.next(sizeof(code_writes))];
+                address = immediates[random.next(immediates.size())];
+            }
+            cpu.set_memory(pc++, opcode);
+            cpu.set_memory(pc++, address & LOW_BYTE);
+            cpu.set_memory(pc++, address >> 8);
+        }
+        else if(kind < 82)
+        {
+            cpu.set_memory(pc++, implied_ops[random.next(sizeof(implied_ops))]);
+        }
+        else if(kind < 97)
+        {
+            cpu.set_memory(pc++, branch_ops[random.next(sizeof(branch_ops))]);
+            branches.push_back(pc++);
+        }
+        else if(kind < 99)
+        {
+            cpu.set_memory(pc, 0x4C);
+            pc += 3;
+            branches.push_back(pc - 2);
+        }
+        else
+        {
+            cpu.set_memory(pc++, random.next(2) ? 0xF8 : 0xD8);
+        }
+    }
+    // running off the end starts over
+    cpu.set_memory(pc, 0x4C);
+    cpu.set_memory(pc + 1, JIT_CODE & LOW_BYTE);
+    cpu.set_memory(pc + 2, JIT_CODE >> 8);
+
+    for(size_t i = 0; i < branches.size(); i++)
+    {
+        uint16_t operand = branches[i];
+        if(cpu.get_memory(operand - 1) == 0x4C)
+        {
+            uint16_t target = starts[random.next(starts.size())];
+            cpu.set_memory(operand, target & LOW_BYTE);
+            cpu.set_memory(operand + 1, target >> 8);
+            continue;
+        }
+        // a nearby instruction, up to 20 either side
+        size_t here = lower_bound(starts.begin(), starts.end(), operand - 1) - starts.begin();
+        size_t low = (here > 20) ? here - 20 : 0;
+        size_t high = (here + 20 < starts.size()) ? here + 20 : starts.size() - 1;
+        uint16_t target = starts[low + random.next(high - low + 1)];
+        cpu.set_memory(operand, (uint8_t)(target - (operand + 1)));
+    }
+    cpu.set_memory(RESET_LOW, JIT_CODE & LOW_BYTE);
+    cpu.set_memory(RESET_HIGH, JIT_CODE >> 8);
+    cpu.reset();
+}
+
+static void test_blocks(uint32_t seed)
+{
+    static MOS6502::Snapshot expected_memory;
+    static MOS6502::Snapshot native_memory;
+    MOS6502 expected;
+    MOS6502 native;
+    native.set_core(MOS6502::NATIVE);
+    native.set_jit_threshold(1);
+    jit_program(expected, seed);
+    jit_program(native, seed);
+
+    for(int n = 0; n < JIT_BLOCKS; n++)
+    {
+        uint16_t start = native.get_PC();
+        uint64_t count = native.step_block();
+        CHECK(count > 0);
+        for(uint64_t i = 0; i < count; i++)
+        {
+            expected.step();
+        }
+        expected.snapshot(expected_memory);
+        native.snapshot(native_memory);
+        bool same = same_state(expected, native, "native", false);
+        if(same && memcmp(expected_memory.memory, native_memory.memory, MEMORY_SIZE) != 0)
+        {
+            fprintf(stderr, "native: memory differs\n");
+            test_failures++;
+            same = false;
+        }
+        if(!same)
+        {
+            fprintf(stderr, "  seed %u, block %d at $%04X, %u instructions\n", seed, n, start, (unsigned)count);
+            return;
+        }
+    }
+#ifdef JIT_X86_64
+    CHECK(native.get_native_instructions() > 0);
+#endif
+}
+
+// run_cycles() has to reach compiled code too
+static void test_cycles(uint32_t seed)
+{
+    MOS6502 expected;
+    MOS6502 native;
+    native.set_core(MOS6502::NATIVE);
+    native.set_jit_threshold(1);
+    jit_program(expected, seed);
+    jit_program(native, seed);
+
+    TestRandom random(seed + 3000);
+    for(int n = 0; n < JIT_SLICES; n++)
+    {
+        uint64_t budget = random.next(2000) + 1;
+        CHECK_EQUAL(expected.run_cycles(budget), native.run_cycles(budget));
+        if(!same_state(expected, native, "native run_cycles", false))
+        {
+            fprintf(stderr, "  seed %u, slice %d\n", seed, n);
+            return;
+        }
+    }
+    same_state(expected, native, "native run_cycles");
+#ifdef JIT_X86_64
+    CHECK(native.get_native_instructions() > 0);
+#endif
+}
+
+int main()
+{
+    for(uint32_t seed = 1; seed <= JIT_SEEDS; seed++)
+    {
+        test_blocks(seed);
+        test_cycles(seed);
+    }
+    return test_result();
+}
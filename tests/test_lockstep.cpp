@@ -0,0 +1,145 @@
+#include "test.h"
+#include "lockstep.h"
+
+// Every lane run by a LockstepEngine ends up as if its instance had run
+// on its own, however the lanes' data, branches and halts differ.
+
+#define LOCKSTEP_LANES 12
+#define LOCKSTEP_SEEDS 5
+#define LOCKSTEP_STEPS 3000
+#define LOCKSTEP_RUNS 3 // run() calls per test, so lanes carry state over
+
+// counts down from $10, flipping A each pass, then parks on a JMP *
+static const uint8_t count_program[] = {
+    0xA6, 0x10,       // 0200 LDX $10
+    0xA0, 0x00,       // 0202 LDY #0
+    0xA9, 0x00,       // 0204 LDA #0
+    0xC8,             // 0206 INY
+    0x49, 0x95,       // 0207 EOR #$95
+    0xCA,             // 0209 DEX
+    0xD0, 0xFA,       // 020A BNE $0206
+    0x30, 0x02,       // 020C BMI $0210
+    0xA2, 0x01,       // 020E LDX #1
+    0x85, 0x20,       // 0210 STA $20
+    0x4C, 0x12, 0x02  // 0212 JMP $0212
+};
+
+// runs the engine and a copy of each lane side by side, then compares
+static void check_lanes(MOS6502 * lanes, size_t count, uint64_t steps, const char * what)
+{
+    vector<MOS6502> serial(lanes, lanes + count);
+    LockstepEngine engine;
+    for(size_t lane = 0; lane < count; lane++)
+    {
+        CHECK(engine.add(&lanes[lane]));
+    }
+    for(int n = 0; n < LOCKSTEP_RUNS; n++)
+    {
+        engine.run(steps);
+        for(size_t lane = 0; lane < count; lane++)
+        {
+            serial[lane].run(steps);
+            bool same = same_state(serial[lane], lanes[lane], what);
+            if(same && serial[lane].get_last_instr() != lanes[lane].get_last_instr())
+            {
+                fprintf(stderr, "%s: last instruction %s, expected %s\n", what,
+                        lanes[lane].get_last_instr().c_str(), serial[lane].get_last_instr().c_str());
+                test_failures++;
+                same = false;
+            }
+            if(!same)
+            {
+                fprintf(stderr, "  lane %u, run %d\n", (unsigned)lane, n);
+                return;
+            }
+        }
+    }
+}
+
+// the same code over different counts: lanes loop a different number of
+// times, leave by different branches and halt at different points, and
+// some never halt
+static void test_divergent()
+{
+    static MOS6502 lanes[LOCKSTEP_LANES];
+    for(size_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        MOS6502 & cpu = lanes[lane];
+        cpu.set_core(test_cores[lane % TEST_CORE_COUNT]);
+        for(unsigned i = 0; i < sizeof(count_program); i++)
+        {
+            cpu.set_memory(0x200 + i, count_program[i]);
+        }
+        cpu.set_memory(0x10, lane * 37 + 1);
+        cpu.set_memory(RESET_LOW, 0x00);
+        cpu.set_memory(RESET_HIGH, 0x02);
+        cpu.reset();
+        if(lane % 3 != 0)
+        {
+            cpu.set_halt_conditions(MOS6502::HALT_ON_SELF_LOOP);
+        }
+    }
+
+    check_lanes(lanes, LOCKSTEP_LANES, LOCKSTEP_STEPS / 10, "divergent");
+    for(size_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        CHECK_EQUAL(0x0212, lanes[lane].get_PC());
+    }
+}
+
+// the group actually runs instructions together
+static void test_vectorised()
+{
+    static MOS6502 lanes[LOCKSTEP_LANES];
+    for(size_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        for(unsigned i = 0; i < sizeof(count_program); i++)
+        {
+            lanes[lane].set_memory(0x200 + i, count_program[i]);
+        }
+        lanes[lane].set_memory(0x10, 200);
+        lanes[lane].set_PC(0x200);
+    }
+    LockstepEngine engine;
+    for(size_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        engine.add(&lanes[lane]);
+    }
+    engine.run(500);
+    CHECK(engine.get_vector_instructions() > 0);
+    CHECK_EQUAL(LOCKSTEP_LANES * 500, engine.get_vector_instructions() + engine.get_scalar_instructions());
+}
+
+// random code: pairs of lanes share a program but differ in zero page
+// data, and the rest of the lanes run other programs entirely
+static void test_random(uint32_t seed)
+{
+    static MOS6502 lanes[LOCKSTEP_LANES];
+    TestRandom random(seed + 4000);
+    for(size_t lane = 0; lane < LOCKSTEP_LANES; lane++)
+    {
+        MOS6502 & cpu = lanes[lane];
+        cpu.set_core(test_cores[lane % TEST_CORE_COUNT]);
+        random_program(cpu, (lane < LOCKSTEP_LANES / 2) ? seed * 100 + lane / 2 : seed * 100 + lane);
+        for(int i = 0; i < 8; i++)
+        {
+            cpu.set_memory(random.next(0x100), random.next(256));
+        }
+        if(lane % 2)
+        {
+            cpu.set_halt_conditions(MOS6502::HALT_ON_SELF_LOOP | MOS6502::HALT_ON_BRK);
+        }
+    }
+    check_lanes(lanes, LOCKSTEP_LANES, LOCKSTEP_STEPS, "random");
+}
+
+int main()
+{
+    test_divergent();
+    test_vectorised();
+    for(uint32_t seed = 1; seed <= LOCKSTEP_SEEDS; seed++)
+    {
+        test_random(seed);
+    }
+    return test_result();
+}
@@ -0,0 +1,113 @@
+#include "test.h"
+#include "mapper.h"
+
+// Bank windows show the right slice of the backing store, and sizes that
+// would map past its end are refused.
+
+#define MAPPER_WINDOW 0x1000
+#define MAPPER_BANKS 4
+#define MAPPER_FILE "test_banks.bin"
+
+static void test_select()
+{
+    MOS6502 cpu;
+    BankedMemory banks(MAPPER_BANKS * MAPPER_WINDOW);
+    for(size_t i = 0; i < banks.size(); i++)
+    {
+        banks.data()[i] = i / MAPPER_WINDOW;
+    }
+    Mapper mapper(cpu, banks, MAPPER_WINDOW);
+    CHECK_EQUAL(MAPPER_BANKS, mapper.bank_count());
+    int window = mapper.add_window(0x8000, false);
+    CHECK_EQUAL(0, window);
+    mapper.add_register(0xFF00, 0xFF00, window);
+
+    CHECK_EQUAL(0, cpu.get_memory(0x8FFF));
+    cpu.set_memory(0xFF00, 2);
+    CHECK_EQUAL(2, mapper.get_bank(window));
+    CHECK_EQUAL(2, cpu.get_memory(0x8000));
+    CHECK_EQUAL(2, cpu.get_memory(0x8FFF));
+    CHECK(mapper.select_bank(window, MAPPER_BANKS + 1));
+    CHECK_EQUAL(1, cpu.get_memory(0x8000));
+    CHECK(!mapper.select_bank(window + 1, 0));
+}
+
+// writes on a register's page that miss the register still land
+static void test_register_pages()
+{
+    MOS6502 cpu;
+    BankedMemory banks(MAPPER_BANKS * MAPPER_WINDOW);
+    Mapper mapper(cpu, banks, MAPPER_WINDOW);
+    int rom = mapper.add_window(0x8000, false);
+    int ram = mapper.add_window(0xA000, true);
+    mapper.add_register(0xFF00, 0xFF00, rom);
+    mapper.add_register(0x8FF0, 0x8FF0, ram);
+    mapper.add_register(0xAFF0, 0xAFF1, ram);
+
+    // plain RAM, the vectors included
+    cpu.set_memory(RESET_LOW, 0x34);
+    cpu.set_memory(0xFF01, 0x12);
+    CHECK_EQUAL(0x34, cpu.get_memory(RESET_LOW));
+    CHECK_EQUAL(0x12, cpu.get_memory(0xFF01));
+    CHECK_EQUAL(0, mapper.get_bank(rom));
+
+    // the same page of a writable window, before and after switching banks
+    cpu.set_memory(0xAF00, 0x56);
+    CHECK_EQUAL(0x56, banks.data()[0x0F00]);
+    cpu.set_memory(0xAFF1, 3);
+    CHECK_EQUAL(3, mapper.get_bank(ram));
+    cpu.set_memory(0xAF02, 0x78);
+    CHECK_EQUAL(0x78, banks.data()[3 * MAPPER_WINDOW + 0x0F02]);
+    CHECK_EQUAL(0x78, cpu.get_memory(0xAF02));
+    CHECK_EQUAL(0x00, banks.data()[0x0F02]);
+
+    // a read-only window still drops them
+    cpu.set_memory(0x8F01, 0x9A);
+    CHECK_EQUAL(0x00, cpu.get_memory(0x8F01));
+    cpu.set_memory(0x8FF0, 2);
+    CHECK_EQUAL(2, mapper.get_bank(ram));
+}
+
+static void test_bad_sizes()
+{
+    MOS6502 cpu;
+    BankedMemory small(0x800);
+    Mapper too_small(cpu, small, MAPPER_WINDOW);
+    CHECK_EQUAL(0, too_small.bank_count());
+    CHECK_EQUAL(-1, too_small.add_window(0x8000, false));
+
+    BankedMemory partial(MAPPER_WINDOW + PAGE_SIZE);
+    Mapper uneven(cpu, partial, MAPPER_WINDOW);
+    CHECK_EQUAL(0, uneven.bank_count());
+    CHECK_EQUAL(-1, uneven.add_window(0x8000, false));
+}
+
+static void test_load()
+{
+    BankedMemory banks(2 * MAPPER_WINDOW);
+    FILE * file = fopen(MAPPER_FILE, "wb");
+    for(int i = 0; i < MAPPER_WINDOW; i++)
+    {
+        fputc(0x5A, file);
+    }
+    fclose(file);
+
+    CHECK(banks.load(MAPPER_FILE, MAPPER_WINDOW));
+    CHECK_EQUAL(MOS6502::LOAD_OK, banks.get_load_error());
+    CHECK_EQUAL(0x00, banks.data()[MAPPER_WINDOW - 1]);
+    CHECK_EQUAL(0x5A, banks.data()[MAPPER_WINDOW]);
+    CHECK(!banks.load(MAPPER_FILE, MAPPER_WINDOW + 1));
+    CHECK_EQUAL(MOS6502::LOAD_TOO_LARGE, banks.get_load_error());
+    CHECK(!banks.load("no_such_banks.bin", 0));
+    CHECK_EQUAL(MOS6502::LOAD_OPEN_FAILED, banks.get_load_error());
+    remove(MAPPER_FILE);
+}
+
+int main()
+{
+    test_select();
+    test_register_pages();
+    test_bad_sizes();
+    test_load();
+    return test_result();
+}
@@ -0,0 +1,229 @@
+#include "test.h"
+
+// Flags and registers after single instructions with known answers, on
+// every core. The compiled path is covered by running each case as a
+// block on NATIVE.
+
+#define OPCODE_CODE 0x0200
+
+struct OpcodeCase {
+    const char * name;
+    uint8_t bytes[3];
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t status;   // before, packed as by get_status()
+    uint8_t memory;   // at $10, for zero page operands
+    uint8_t expected; // status after
+};
+
+#define N FLAG_N
+#define V FLAG_V
+#define U FLAG_U
+#define Z FLAG_Z
+#define C FLAG_C
+
+// Compares set N, Z and C from reg - operand and leave V as it was.
+static const OpcodeCase compare_cases[] = {
+    {"CMP # equal",     {0xC9, 0x40}, 0x40, 0x00, 0x00, U,     0x00, U | Z | C},
+    {"CMP # less",      {0xC9, 0x41}, 0x40, 0x00, 0x00, U,     0x00, U | N},
+    {"CMP # greater",   {0xC9, 0x3F}, 0x40, 0x00, 0x00, U | Z, 0x00, U | C},
+    {"CMP # keeps V",   {0xC9, 0x80}, 0x7F, 0x00, 0x00, U | V, 0x00, U | V | N},
+    {"CMP # no V",      {0xC9, 0x01}, 0x80, 0x00, 0x00, U,     0x00, U | C},
+    {"CMP zp equal",    {0xC5, 0x10}, 0x00, 0x00, 0x00, U | N, 0x00, U | Z | C},
+    {"CPX # equal",     {0xE0, 0x7F}, 0x00, 0x7F, 0x00, U | V, 0x00, U | V | Z | C},
+    {"CPX # less",      {0xE0, 0x80}, 0x01, 0x7F, 0x00, U,     0x00, U | N},
+    {"CPX zp greater",  {0xE4, 0x10}, 0x80, 0x90, 0x00, U | Z, 0x10, U | N | C},
+    {"CPX abs equal",   {0xEC, 0x10, 0x00}, 0x00, 0x33, 0x00, U, 0x33, U | Z | C},
+    {"CPY # equal",     {0xC0, 0x00}, 0xFF, 0x00, 0x00, U,     0x00, U | Z | C},
+    {"CPY # less",      {0xC0, 0x01}, 0x00, 0x00, 0x00, U | V, 0x00, U | V | N},
+    {"CPY zp equal",    {0xC4, 0x10}, 0x80, 0x00, 0xA5, U,     0xA5, U | Z | C},
+    {"CPY abs greater", {0xCC, 0x10, 0x00}, 0x80, 0x00, 0x81, U, 0x01, U | N | C},
+};
+
+// SBC overflows when A and the operand differ in sign and the result's
+// sign differs from A's.
+static const OpcodeCase subtract_cases[] = {
+    {"SBC # into V",     {0xE9, 0x01}, 0x80, 0x00, 0x00, U | C,     0x00, U | V | C},
+    {"SBC # borrow V",   {0xE9, 0xFF}, 0x7F, 0x00, 0x00, U | C,     0x00, U | V | N},
+    {"SBC # clears V",   {0xE9, 0x01}, 0x05, 0x00, 0x00, U | V | C, 0x00, U | C},
+    {"SBC # from zero",  {0xE9, 0x80}, 0x00, 0x00, 0x00, U | C,     0x00, U | V | N},
+    {"SBC # same signs", {0xE9, 0x7F}, 0x00, 0x00, 0x00, U,         0x00, U | N},
+    {"SBC zp no V",      {0xE5, 0x10}, 0xF0, 0x00, 0x00, U | C,     0x70, U | N | C},
+    {"SBC zp to zero",   {0xE5, 0x10}, 0x70, 0x00, 0x00, U | C | V, 0x70, U | Z | C},
+};
+
+static void load_case(MOS6502 & cpu, MOS6502::Core core, const OpcodeCase & test)
+{
+    cpu.set_core(core);
+    cpu.set_jit_threshold(1);
+    for(int i = 0; i < 3; i++)
+    {
+        cpu.set_memory(OPCODE_CODE + i, test.bytes[i]);
+    }
+    // JMP * ends the block
+    uint16_t end = OPCODE_CODE + Disassembler::length(test.bytes[0]);
+    cpu.set_memory(end, 0x4C);
+    cpu.set_memory(end + 1, end & LOW_BYTE);
+    cpu.set_memory(end + 2, end >> 8);
+    cpu.set_memory(0x10, test.memory);
+    cpu.set_PC(OPCODE_CODE);
+    cpu.set_A(test.A);
+    cpu.set_X(test.X);
+    cpu.set_Y(test.Y);
+    cpu.set_status(test.status);
+}
+
+static void test_cases(const OpcodeCase * cases, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        const OpcodeCase & test = cases[i];
+        for(int c = 0; c < TEST_CORE_COUNT; c++)
+        {
+            MOS6502 cpu;
+            load_case(cpu, test_cores[c], test);
+            cpu.step();
+            if(cpu.get_status() != test.expected)
+            {
+                fprintf(stderr, "%s on %s: status %02X, expected %02X\n", test.name, test_core_names[c],
+                        cpu.get_status(), test.expected);
+                test_failures++;
+            }
+        }
+
+        // twice through, so the JIT compiles the block the second time
+        MOS6502 native;
+        for(int pass = 0; pass < 2; pass++)
+        {
+            load_case(native, MOS6502::NATIVE, test);
+            native.step_block();
+        }
+        if(native.get_status() != test.expected)
+        {
+            fprintf(stderr, "%s compiled: status %02X, expected %02X\n", test.name, native.get_status(),
+                    test.expected);
+            test_failures++;
+        }
+    }
+}
+
+// Decimal ADC and SBC carry between nibbles as 1, and out of the byte
+// through C.
+struct DecimalCase {
+    uint8_t opcode;
+    uint8_t A;
+    uint8_t operand;
+    bool carry;
+    uint8_t expected;
+    bool expected_carry;
+};
+
+static const DecimalCase decimal_cases[] = {
+    {0x69, 0x09, 0x01, false, 0x10, false},
+    {0x69, 0x12, 0x34, true,  0x47, false},
+    {0x69, 0x58, 0x46, false, 0x04, true},
+    {0x69, 0x99, 0x01, false, 0x00, true},
+    {0x69, 0x19, 0x29, false, 0x48, false},
+    {0xE9, 0x10, 0x01, true,  0x09, true},
+    {0xE9, 0x46, 0x12, true,  0x34, true},
+    {0xE9, 0x40, 0x13, false, 0x26, true},
+    {0xE9, 0x00, 0x01, true,  0x99, false},
+    {0xE9, 0x32, 0x19, true,  0x13, true},
+};
+
+static void test_decimal()
+{
+    for(size_t i = 0; i < sizeof(decimal_cases) / sizeof(decimal_cases[0]); i++)
+    {
+        const DecimalCase & test = decimal_cases[i];
+        for(int c = 0; c < TEST_CORE_COUNT; c++)
+        {
+            MOS6502 cpu;
+            cpu.set_core(test_cores[c]);
+            cpu.set_memory(OPCODE_CODE, test.opcode);
+            cpu.set_memory(OPCODE_CODE + 1, test.operand);
+            cpu.set_PC(OPCODE_CODE);
+            cpu.set_A(test.A);
+            cpu.set_status(FLAG_U | FLAG_D | (test.carry ? FLAG_C : 0));
+            cpu.step();
+            bool carry = (cpu.get_status() & FLAG_C) != 0;
+            if(cpu.get_A() != test.expected || carry != test.expected_carry)
+            {
+                fprintf(stderr, "%s $%02X, $%02X with C=%d on %s: $%02X C=%d, expected $%02X C=%d\n",
+                        Disassembler::mnemonic(test.opcode).c_str(), test.A, test.operand, test.carry,
+                        test_core_names[c], cpu.get_A(), carry, test.expected, test.expected_carry);
+                test_failures++;
+            }
+        }
+    }
+}
+
+// PLA sets N and Z from the pulled value, not the last result
+static void test_pla()
+{
+    static const uint8_t program[] = {
+        0xA9, 0x00, // LDA #0
+        0x68,       // PLA
+        0xA9, 0x80, // LDA #$80
+        0x68        // PLA
+    };
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 cpu;
+        cpu.set_core(test_cores[c]);
+        for(unsigned i = 0; i < sizeof(program); i++)
+        {
+            cpu.set_memory(OPCODE_CODE + i, program[i]);
+        }
+        cpu.set_memory(SP_START + 1, 0x90);
+        cpu.set_memory(SP_START + 2, 0x00);
+        cpu.set_PC(OPCODE_CODE);
+        cpu.run(2);
+        CHECK_EQUAL(0x90, cpu.get_A());
+        CHECK_EQUAL(FLAG_N, cpu.get_status() & (FLAG_N | FLAG_Z));
+        cpu.run(2);
+        CHECK_EQUAL(0x00, cpu.get_A());
+        CHECK_EQUAL(FLAG_Z, cpu.get_status() & (FLAG_N | FLAG_Z));
+    }
+}
+
+// TXS keeps the stack on page 1, so pushes after it land there
+static void test_txs()
+{
+    static const uint8_t program[] = {
+        0xA2, 0x80, // LDX #$80
+        0x9A,       // TXS
+        0xA9, 0x5A, // LDA #$5A
+        0x48,       // PHA
+        0xBA        // TSX
+    };
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 cpu;
+        cpu.set_core(test_cores[c]);
+        for(unsigned i = 0; i < sizeof(program); i++)
+        {
+            cpu.set_memory(OPCODE_CODE + i, program[i]);
+        }
+        cpu.set_PC(OPCODE_CODE);
+        cpu.step();
+        cpu.step();
+        CHECK_EQUAL(0x180, cpu.get_SP());
+        cpu.run(3);
+        CHECK_EQUAL(0x17F, cpu.get_SP());
+        CHECK_EQUAL(0x7F, cpu.get_X());
+        CHECK_EQUAL(0x5A, cpu.get_memory(0x180));
+        CHECK_EQUAL(0x00, cpu.get_memory(0x080));
+    }
+}
+
+int main()
+{
+    test_cases(compare_cases, sizeof(compare_cases) / sizeof(compare_cases[0]));
+    test_cases(subtract_cases, sizeof(subtract_cases) / sizeof(subtract_cases[0]));
+    test_decimal();
+    test_pla();
+    test_txs();
+    return test_result();
+}
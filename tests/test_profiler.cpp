@@ -0,0 +1,228 @@
+#include "test.h"
+#include "profiler.h"
+
+// The call graph folds cycles into the same call paths on every core.
+
+#define PROFILE_FILE "test_profile.folded"
+
+// main calls A twice and B once, and A calls B
+static const uint8_t calls_program[] = {
+    0x20, 0x10, 0x02, // 0200 JSR A
+    0x20, 0x20, 0x02, // 0203 JSR B
+    0x20, 0x10, 0x02, // 0206 JSR A
+    0x4C, 0x09, 0x02  // 0209 JMP $0209
+};
+static const uint8_t a_program[] = {
+    0xEA,             // 0210 NOP
+    0x20, 0x20, 0x02, // 0211 JSR B
+    0x60              // 0214 RTS
+};
+static const uint8_t b_program[] = {
+    0xE8,             // 0220 INX
+    0x60              // 0221 RTS
+};
+
+static void load_calls(MOS6502 & cpu)
+{
+    for(unsigned i = 0; i < sizeof(calls_program); i++)
+    {
+        cpu.set_memory(0x200 + i, calls_program[i]);
+    }
+    for(unsigned i = 0; i < sizeof(a_program); i++)
+    {
+        cpu.set_memory(0x210 + i, a_program[i]);
+    }
+    for(unsigned i = 0; i < sizeof(b_program); i++)
+    {
+        cpu.set_memory(0x220 + i, b_program[i]);
+    }
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+}
+
+static const Profiler::CallPath * find_path(const vector<Profiler::CallPath> & paths, string stack)
+{
+    for(size_t i = 0; i < paths.size(); i++)
+    {
+        if(paths[i].stack == stack)
+        {
+            return &paths[i];
+        }
+    }
+    fprintf(stderr, "no call path %s\n", stack.c_str());
+    test_failures++;
+    return NULL;
+}
+
+static void check_path(const vector<Profiler::CallPath> & paths, string stack, uint64_t calls, uint64_t inclusive,
+                       uint64_t exclusive)
+{
+    const Profiler::CallPath * path = find_path(paths, stack);
+    if(path != NULL)
+    {
+        CHECK_EQUAL(calls, path->calls);
+        CHECK_EQUAL(inclusive, path->inclusive);
+        CHECK_EQUAL(exclusive, path->exclusive);
+    }
+}
+
+static void test_call_paths(MOS6502::Core core, const char * name)
+{
+    MOS6502 cpu;
+    Profiler profiler;
+    profiler.set_call_graph(true);
+    profiler.set_symbol(0x0210, "A");
+    profiler.set_symbol(0x0220, "B");
+    cpu.set_core(core);
+    load_calls(cpu);
+    cpu.set_profiler(&profiler);
+    cpu.reset();
+    cpu.set_halt_conditions(MOS6502::HALT_ON_SELF_LOOP);
+    CHECK_EQUAL(MOS6502::STOP_SELF_LOOP, cpu.run(1000));
+    CHECK_EQUAL(cpu.get_cycles(), profiler.total_cycles());
+
+    // JSR is charged to the caller and RTS to the callee: A is NOP, JSR
+    // and RTS, 14 cycles, and B is INX and RTS, 8
+    vector<Profiler::CallPath> paths = profiler.call_paths();
+    CHECK_EQUAL(4, paths.size());
+    check_path(paths, "A", 2, 44, 28);
+    check_path(paths, "A;B", 2, 16, 16);
+    check_path(paths, "B", 1, 8, 8);
+    const Profiler::CallPath * top = find_path(paths, "[top]");
+    if(top != NULL)
+    {
+        CHECK_EQUAL(cpu.get_cycles(), top->inclusive);
+        CHECK_EQUAL(cpu.get_cycles() - 44 - 8, top->exclusive);
+    }
+
+    vector<Profiler::Function> functions = profiler.functions();
+    CHECK_EQUAL(2, functions.size());
+    if(functions.size() == 2)
+    {
+        CHECK(functions[0].name == "A" && functions[1].name == "B");
+        CHECK_EQUAL(2, functions[0].calls);
+        CHECK_EQUAL(44, functions[0].inclusive);
+        CHECK_EQUAL(3, functions[1].calls);
+        CHECK_EQUAL(24, functions[1].inclusive);
+        CHECK_EQUAL(24, functions[1].exclusive);
+    }
+
+    // folded stacks are the exclusive cycles of each path
+    CHECK(profiler.save_folded(PROFILE_FILE));
+    FILE * file = fopen(PROFILE_FILE, "r");
+    CHECK(file != NULL);
+    if(file != NULL)
+    {
+        char stack[64];
+        unsigned long long cycles;
+        int lines = 0;
+        while(fscanf(file, "%63s %llu", stack, &cycles) == 2)
+        {
+            const Profiler::CallPath * path = find_path(paths, stack);
+            if(path != NULL)
+            {
+                CHECK_EQUAL(path->exclusive, cycles);
+            }
+            lines++;
+        }
+        fclose(file);
+        CHECK_EQUAL(4, lines);
+    }
+    remove(PROFILE_FILE);
+    if(test_failures > 0)
+    {
+        fprintf(stderr, "  on %s\n", name);
+    }
+}
+
+// a return that skips frames, as code that pulls its return address and
+// RTSes to its caller's caller does, pops them all
+static void test_unwind()
+{
+    static const uint8_t program[] = {
+        0x20, 0x10, 0x02, // 0200 JSR $0210
+        0x4C, 0x03, 0x02, // 0203 JMP $0203
+    };
+    static const uint8_t outer[] = {
+        0x20, 0x20, 0x02, // 0210 JSR $0220
+        0xEA,             // 0213 NOP, never reached
+        0x60              // 0214 RTS
+    };
+    static const uint8_t inner[] = {
+        0x68,             // 0220 PLA
+        0x68,             // 0221 PLA
+        0x60              // 0222 RTS, back to 0203
+    };
+    MOS6502 cpu;
+    Profiler profiler;
+    profiler.set_call_graph(true);
+    for(unsigned i = 0; i < sizeof(program); i++)
+    {
+        cpu.set_memory(0x200 + i, program[i]);
+    }
+    for(unsigned i = 0; i < sizeof(outer); i++)
+    {
+        cpu.set_memory(0x210 + i, outer[i]);
+    }
+    for(unsigned i = 0; i < sizeof(inner); i++)
+    {
+        cpu.set_memory(0x220 + i, inner[i]);
+    }
+    cpu.set_memory(RESET_LOW, 0x00);
+    cpu.set_memory(RESET_HIGH, 0x02);
+    cpu.set_profiler(&profiler);
+    cpu.reset();
+    cpu.run(20);
+
+    vector<Profiler::CallPath> paths = profiler.call_paths();
+    CHECK_EQUAL(3, paths.size());
+    const Profiler::CallPath * top = find_path(paths, "[top]");
+    check_path(paths, "$0210;$0220", 1, 14, 14);
+    if(top != NULL)
+    {
+        // every JMP after the return is charged to the top level
+        CHECK_EQUAL(cpu.get_cycles() - 6 - 14, top->exclusive);
+    }
+}
+
+// copies of a CPU being sampled leave the sampling event behind, so they
+// neither feed the profiler nor call it once it is gone
+static void test_copy_sampled(MOS6502::Core core)
+{
+    MOS6502 cpu;
+    MOS6502 assigned;
+    cpu.set_core(core);
+    load_calls(cpu);
+    cpu.reset();
+    Profiler * profiler = new Profiler();
+    profiler->start_sampling(cpu, 50);
+    cpu.run(100);
+
+    MOS6502 copy(cpu);
+    assigned = cpu;
+    CHECK_EQUAL(NO_EVENT, copy.get_next_event());
+    CHECK_EQUAL(NO_EVENT, assigned.get_next_event());
+    uint64_t samples = profiler->total_samples();
+    copy.run(1000);
+    assigned.run(1000);
+    CHECK_EQUAL(samples, profiler->total_samples());
+    cpu.run(1000);
+    CHECK(profiler->total_samples() > samples);
+
+    delete profiler;
+    CHECK_EQUAL(NO_EVENT, cpu.get_next_event());
+    copy.run(1000);
+    assigned.run(1000);
+    cpu.run(1000);
+}
+
+int main()
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        test_call_paths(test_cores[c], test_core_names[c]);
+        test_copy_sampled(test_cores[c]);
+    }
+    test_unwind();
+    return test_result();
+}
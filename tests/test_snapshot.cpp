@@ -0,0 +1,167 @@
+#include "test.h"
+
+// Snapshots, deltas and the snapshot file format round-trip exactly:
+// restoring and running on gives the same CPU as never having stopped.
+
+#define SNAPSHOT_SEEDS 10
+#define SNAPSHOT_FILE "test_snapshot.snp"
+
+static void test_restore(uint32_t seed)
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 cpu;
+        cpu.set_core(test_cores[c]);
+        cpu.set_jit_threshold(1);
+        random_program(cpu, seed);
+        cpu.run(500);
+
+        MOS6502::Snapshot state;
+        cpu.snapshot(state);
+        MOS6502 straight = cpu;
+        straight.run(2000);
+
+        // restored into the CPU that took it, after it ran on and changed
+        // its code
+        cpu.run(3000);
+        cpu.restore(state);
+        cpu.run(2000);
+        CHECK_EQUAL(straight.get_cycles(), cpu.get_cycles());
+        CHECK_EQUAL(straight.get_PC(), cpu.get_PC());
+        CHECK_EQUAL(straight.get_status(), cpu.get_status());
+        for(int i = 0; i < MEMORY_SIZE; i++)
+        {
+            if(straight.get_memory(i) != cpu.get_memory(i))
+            {
+                fprintf(stderr, "%s seed %u: memory $%04X differs after restore\n", test_core_names[c], seed, i);
+                test_failures++;
+                break;
+            }
+        }
+    }
+}
+
+// a delta taken later restores over the base to the later state
+static void test_delta(uint32_t seed)
+{
+    MOS6502 cpu;
+    random_program(cpu, seed);
+    cpu.run(200);
+    MOS6502::Snapshot base;
+    cpu.snapshot(base);
+    cpu.run(300);
+
+    MOS6502::SnapshotDelta delta;
+    cpu.snapshot(delta);
+    MOS6502::Snapshot later;
+    cpu.snapshot(later);
+    CHECK(delta.pages.size() < PAGE_COUNT);
+    CHECK_EQUAL(delta.pages.size() * PAGE_SIZE, delta.data.size());
+
+    MOS6502 other;
+    random_program(other, seed + 1);
+    other.restore(base, delta);
+    MOS6502::Snapshot restored;
+    other.snapshot(restored);
+    CHECK_EQUAL(later.PC, restored.PC);
+    CHECK_EQUAL(later.SP, restored.SP);
+    CHECK_EQUAL(later.A, restored.A);
+    CHECK_EQUAL(later.status, restored.status);
+    CHECK_EQUAL(later.cycles, restored.cycles);
+    CHECK(memcmp(later.memory, restored.memory, MEMORY_SIZE) == 0);
+
+    // a delta with nothing written since the base holds no pages
+    other.snapshot(delta);
+    CHECK_EQUAL(0, delta.pages.size());
+}
+
+static void test_file(uint32_t seed)
+{
+    MOS6502 cpu;
+    random_program(cpu, seed);
+    cpu.run(1000);
+    MOS6502::Snapshot saved;
+    cpu.snapshot(saved);
+    CHECK(saved.save(SNAPSHOT_FILE));
+
+    MOS6502::Snapshot loaded;
+    CHECK(loaded.load(SNAPSHOT_FILE));
+    CHECK_EQUAL(saved.A, loaded.A);
+    CHECK_EQUAL(saved.X, loaded.X);
+    CHECK_EQUAL(saved.Y, loaded.Y);
+    CHECK_EQUAL(saved.status, loaded.status);
+    CHECK_EQUAL(saved.SP, loaded.SP);
+    CHECK_EQUAL(saved.PC, loaded.PC);
+    CHECK_EQUAL(saved.cycles, loaded.cycles);
+    CHECK(memcmp(saved.memory, loaded.memory, MEMORY_SIZE) == 0);
+    remove(SNAPSHOT_FILE);
+}
+
+static void test_bad_files()
+{
+    MOS6502::Snapshot state;
+    MOS6502::SnapshotError error;
+    remove(SNAPSHOT_FILE);
+    CHECK(!state.load(SNAPSHOT_FILE, &error));
+    CHECK_EQUAL(MOS6502::SNAPSHOT_OPEN_FAILED, error);
+    CHECK(!state.save("no_such_directory/" SNAPSHOT_FILE, &error));
+    CHECK_EQUAL(MOS6502::SNAPSHOT_OPEN_FAILED, error);
+
+    FILE * file = fopen(SNAPSHOT_FILE, "wb");
+    fputs("NOTASNAPSHOT", file);
+    fclose(file);
+    CHECK(!state.load(SNAPSHOT_FILE, &error));
+    CHECK_EQUAL(MOS6502::SNAPSHOT_BAD_FORMAT, error);
+
+    // cut short in the memory image
+    MOS6502 cpu;
+    cpu.snapshot(state);
+    CHECK(state.save(SNAPSHOT_FILE, &error));
+    CHECK_EQUAL(MOS6502::SNAPSHOT_OK, error);
+    file = fopen(SNAPSHOT_FILE, "rb");
+    vector<uint8_t> bytes(MEMORY_SIZE);
+    size_t length = fread(&bytes[0], 1, bytes.size(), file);
+    fclose(file);
+    file = fopen(SNAPSHOT_FILE, "wb");
+    fwrite(&bytes[0], 1, length, file);
+    fclose(file);
+    CHECK(!state.load(SNAPSHOT_FILE, &error));
+    CHECK_EQUAL(MOS6502::SNAPSHOT_READ_FAILED, error);
+    remove(SNAPSHOT_FILE);
+}
+
+// an NMI raised after the snapshot is not taken once it is restored
+static void test_pending()
+{
+    for(int c = 0; c < TEST_CORE_COUNT; c++)
+    {
+        MOS6502 cpu;
+        cpu.set_core(test_cores[c]);
+        cpu.set_memory(0xFFFA, 0x00);
+        cpu.set_memory(0xFFFB, 0x03);
+        for(int i = 0; i < 4; i++)
+        {
+            cpu.set_memory(0x200 + i, 0xEA); // NOP
+        }
+        cpu.reset();
+        MOS6502::Snapshot state;
+        cpu.snapshot(state);
+        cpu.trigger_nmi();
+        cpu.restore(state);
+        cpu.step();
+        CHECK_EQUAL(0x0201, cpu.get_PC());
+    }
+}
+
+int main()
+{
+    for(uint32_t seed = 1; seed <= SNAPSHOT_SEEDS; seed++)
+    {
+        test_restore(seed);
+        test_delta(seed);
+        test_file(seed);
+    }
+    test_bad_files();
+    test_pending();
+    return test_result();
+}
@@ -0,0 +1,161 @@
+#include "test.h"
+#include "trace.h"
+#include "trace_file.h"
+
+// Trace files read back record for record, from the start or after a seek,
+// whether written directly or drained from a CPU's TraceBuffer.
+
+#define TRACE_TEST_FILE "test_trace.trz"
+#define TRACE_OTHER_FILE "test_trace_other.trz"
+#define TRACE_TEST_RECORDS 5000
+#define TRACE_TEST_BLOCK 256 // records per block, small to get many blocks
+#define TRACE_SEEKS 200
+#define TRACE_CPU_STEPS 20000
+
+static bool same_record(const TraceRecord & a, const TraceRecord & b)
+{
+    return a.cycle == b.cycle && a.PC == b.PC && a.opcode == b.opcode && a.operand[0] == b.operand[0] &&
+           a.operand[1] == b.operand[1] && a.A == b.A && a.X == b.X && a.Y == b.Y && a.SP == b.SP &&
+           a.status == b.status;
+}
+
+// mostly straight-line code with the odd jump and register change, as a
+// CPU would produce
+static void make_records(vector<TraceRecord> & records, uint32_t seed)
+{
+    TestRandom random(seed);
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.PC = 0x0200;
+    for(int i = 0; i < TRACE_TEST_RECORDS; i++)
+    {
+        record.opcode = random.next(256);
+        uint8_t length = Disassembler::length(record.opcode);
+        record.operand[0] = (length > 1) ? random.next(256) : 0;
+        record.operand[1] = (length > 2) ? random.next(256) : 0;
+        if(random.next(3) == 0)
+        {
+            record.A = random.next(256);
+        }
+        if(random.next(10) == 0)
+        {
+            record.X = random.next(256);
+            record.status = random.next(256);
+        }
+        records.push_back(record);
+        record.cycle += 2 + random.next(6);
+        record.PC += (random.next(16) == 0) ? random.next(0x10000) : 1 + random.next(3);
+    }
+}
+
+static bool write_records(const char * filename, const vector<TraceRecord> & records)
+{
+    TraceWriter writer;
+    if(!writer.open(filename, TRACE_TEST_BLOCK))
+    {
+        return false;
+    }
+    writer.write(&records[0], records.size());
+    CHECK_EQUAL(records.size(), writer.size());
+    return writer.close();
+}
+
+static void test_round_trip()
+{
+    vector<TraceRecord> records;
+    make_records(records, 1);
+    CHECK(write_records(TRACE_TEST_FILE, records));
+
+    TraceReader reader;
+    CHECK(reader.open(TRACE_TEST_FILE));
+    CHECK_EQUAL(records.size(), reader.size());
+    TraceRecord record;
+    size_t read = 0;
+    while(reader.next(record))
+    {
+        if(read < records.size() && !same_record(records[read], record))
+        {
+            fprintf(stderr, "record %u differs\n", (unsigned)read);
+            test_failures++;
+            break;
+        }
+        read++;
+    }
+    CHECK_EQUAL(records.size(), read);
+
+    // random access, backwards as well as forwards
+    TestRandom random(2);
+    for(int i = 0; i < TRACE_SEEKS; i++)
+    {
+        uint64_t index = random.next(records.size());
+        CHECK(reader.seek(index));
+        CHECK_EQUAL(index, reader.tell());
+        CHECK(reader.next(record) && same_record(records[index], record));
+
+        uint64_t cycle = records[index].cycle - random.next(2);
+        CHECK(reader.seek_cycle(cycle));
+        uint64_t first = reader.tell();
+        CHECK(records[first].cycle >= cycle);
+        CHECK(first == 0 || records[first - 1].cycle < cycle);
+    }
+    CHECK(reader.seek(records.size()) && !reader.next(record));
+    CHECK(!reader.seek(records.size() + 1));
+    CHECK(!reader.seek_cycle(records.back().cycle + 1));
+
+    // first_difference finds a single changed record
+    uint64_t changed = records.size() / 3 + 5;
+    records[changed].Y ^= 1;
+    CHECK(write_records(TRACE_OTHER_FILE, records));
+    TraceReader other;
+    CHECK(other.open(TRACE_OTHER_FILE));
+    CHECK_EQUAL(changed, reader.first_difference(other));
+    CHECK(other.open(TRACE_TEST_FILE));
+    CHECK_EQUAL(records.size(), reader.first_difference(other));
+    other.close();
+    reader.close();
+    remove(TRACE_TEST_FILE);
+    remove(TRACE_OTHER_FILE);
+}
+
+// the file drained during a run holds what the ring records on its own
+static void test_drain()
+{
+    TraceBuffer ring(TRACE_CPU_STEPS * 2);
+    MOS6502 cpu;
+    random_program(cpu, 7);
+    MOS6502 drained = cpu;
+    cpu.set_trace(&ring);
+    cpu.run(TRACE_CPU_STEPS);
+    vector<TraceRecord> records(ring.size());
+    CHECK_EQUAL(records.size(), ring.read(&records[0], records.size()));
+
+    TraceBuffer small(1024); // drained through a ring that fills many times
+    CHECK(small.start_drain(TRACE_TEST_FILE));
+    drained.set_trace(&small);
+    drained.run(TRACE_CPU_STEPS);
+    drained.set_trace(NULL);
+    CHECK(small.stop_drain());
+
+    TraceReader reader;
+    CHECK(reader.open(TRACE_TEST_FILE));
+    CHECK_EQUAL(records.size(), reader.size());
+    TraceRecord record;
+    for(size_t i = 0; i < records.size(); i++)
+    {
+        if(!reader.next(record) || !same_record(records[i], record))
+        {
+            fprintf(stderr, "drained record %u differs\n", (unsigned)i);
+            test_failures++;
+            break;
+        }
+    }
+    reader.close();
+    remove(TRACE_TEST_FILE);
+}
+
+int main()
+{
+    test_round_trip();
+    test_drain();
+    return test_result();
+}
@@ -0,0 +1,187 @@
+#include "trace.h"
+#include "trace_file.h"
+#include <chrono>
+#include <vector>
+
+#define NO_LIMIT 0xFFFFFFFFFFFFFFFFULL
+
+TraceBuffer::TraceBuffer(size_t capacity)
+    : next(0), limit(NO_LIMIT), head(0), tail(0), stopping(false), writer(NULL),
+      cleared(0), overwritten(0)
+{
+    this->capacity = 1;
+    while(this->capacity < capacity)
+    {
+        this->capacity <<= 1;
+    }
+    mask = this->capacity - 1;
+    records = new TraceRecord[this->capacity]();
+}
+
+TraceBuffer::~TraceBuffer()
+{
+    stop_drain();
+    delete[] records;
+}
+
+// Only reached with a drain running: waits for it to free a slot.
+void TraceBuffer::make_room()
+{
+    while(true)
+    {
+        limit = tail.load(memory_order_acquire) + capacity;
+        if(next != limit)
+        {
+            return;
+        }
+        this_thread::yield();
+    }
+}
+
+// Without a drain the CPU never looks at tail, so records it has written
+// over are only dropped here.
+void TraceBuffer::skip_overwritten()
+{
+    uint64_t newest = head.load(memory_order_acquire);
+    uint64_t oldest = tail.load(memory_order_relaxed);
+    if(newest - oldest > capacity)
+    {
+        overwritten += newest - capacity - oldest;
+        tail.store(newest - capacity, memory_order_release);
+    }
+}
+
+size_t TraceBuffer::get_capacity()
+{
+    return capacity;
+}
+
+size_t TraceBuffer::size()
+{
+    uint64_t held = head.load(memory_order_acquire) - tail.load(memory_order_acquire);
+    return (held < capacity) ? held : capacity;
+}
+
+uint64_t TraceBuffer::get_recorded()
+{
+    return head.load(memory_order_acquire) - cleared;
+}
+
+uint64_t TraceBuffer::get_overwritten()
+{
+    uint64_t held = head.load(memory_order_acquire) - tail.load(memory_order_acquire);
+    return overwritten + ((held > capacity) ? held - capacity : 0);
+}
+
+size_t TraceBuffer::read(TraceRecord * out, size_t max)
+{
+    if(is_draining())
+    {
+        return 0;
+    }
+    skip_overwritten();
+    uint64_t oldest = tail.load(memory_order_relaxed);
+    uint64_t held = head.load(memory_order_relaxed) - oldest;
+    size_t count = (held < max) ? held : max;
+    for(size_t i = 0; i < count; i++)
+    {
+        out[i] = records[(oldest + i) & mask];
+    }
+    tail.store(oldest + count, memory_order_release);
+    return count;
+}
+
+void TraceBuffer::clear()
+{
+    if(is_draining())
+    {
+        return;
+    }
+    tail.store(next, memory_order_release);
+    cleared = next;
+    overwritten = 0;
+}
+
+bool TraceBuffer::start_drain(string filename)
+{
+    if(is_draining())
+    {
+        return false;
+    }
+    writer = new TraceWriter;
+    if(!writer->open(filename))
+    {
+        delete writer;
+        writer = NULL;
+        return false;
+    }
+
+    skip_overwritten();
+    limit = tail.load(memory_order_relaxed) + capacity;
+    stopping.store(false, memory_order_relaxed);
+    drain = thread(&TraceBuffer::drain_loop, this);
+    return true;
+}
+
+bool TraceBuffer::stop_drain()
+{
+    if(!is_draining())
+    {
+        return true;
+    }
+    stopping.store(true, memory_order_release);
+    drain.join();
+    bool ok = writer->close();
+    delete writer;
+    writer = NULL;
+    limit = NO_LIMIT;
+    return ok;
+}
+
+bool TraceBuffer::is_draining()
+{
+    return drain.joinable();
+}
+
+// Copies records out of the ring in batches as they are published, so the
+// CPU can reuse their slots while the batch is compressed, and sleeps while
+// there are none.
+void TraceBuffer::drain_loop()
+{
+    vector<TraceRecord> batch(TRACE_DRAIN_BATCH);
+    unsigned empty_polls = 0;
+    while(true)
+    {
+        bool stop = stopping.load(memory_order_acquire);
+        uint64_t oldest = tail.load(memory_order_relaxed);
+        uint64_t newest = head.load(memory_order_acquire);
+        if(oldest == newest)
+        {
+            if(stop)
+            {
+                return;
+            }
+            // a CPU that is tracing refills the ring quickly, so only
+            // sleep once it has stayed empty for a while
+            if(++empty_polls < TRACE_DRAIN_SPINS)
+            {
+                this_thread::yield();
+            }
+            else
+            {
+                this_thread::sleep_for(chrono::microseconds(TRACE_DRAIN_POLL_US));
+            }
+            continue;
+        }
+        empty_polls = 0;
+
+        uint64_t count = newest - oldest;
+        count = (count < TRACE_DRAIN_BATCH) ? count : TRACE_DRAIN_BATCH;
+        for(uint64_t i = 0; i < count; i++)
+        {
+            batch[i] = records[(oldest + i) & mask];
+        }
+        tail.store(oldest + count, memory_order_release);
+        writer->write(batch.data(), count);
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <atomic>
+#include <thread>
+#include <stddef.h>
+#include <stdint.h>
+using namespace std;
+
+#define TRACE_DEFAULT_RECORDS 0x10000 // ring capacity, rounded to a power of two
+#define TRACE_DRAIN_BATCH 4096        // records the drain writes at a time
+#define TRACE_DRAIN_SPINS 64          // empty polls before the drain sleeps
+#define TRACE_DRAIN_POLL_US 500       // drain sleep while the ring stays empty
+
+class TraceWriter;
+
+// CPU state just before an instruction runs. Operand bytes the
+// instruction does not use are 0.
+struct TraceRecord {
+    uint64_t cycle;
+    uint16_t PC;
+    uint8_t opcode;
+    uint8_t operand[2];
+    uint8_t A;
+    uint8_t X;
+    uint8_t Y;
+    uint8_t SP;     // low byte, the stack is always on page 1
+    uint8_t status; // packed as by get_status()
+};
+
+// Fixed-size ring of TraceRecords filled by one CPU (see
+// MOS6502::set_trace()). Recording is a few stores into preallocated
+// memory: nothing is allocated or formatted while the CPU runs.
+//
+// On its own the ring is a flight recorder: once full, each new record
+// replaces the oldest, and read() hands back the most recent ones after
+// the run. With a drain started, a background thread compresses records
+// into a trace file (see TraceWriter) as they arrive, and the CPU waits for
+// it rather than lose any.
+class TraceBuffer
+{
+private:
+    TraceRecord * records;
+    size_t capacity;
+    uint64_t mask;
+
+    // Written by the CPU only. next is the position of the next record;
+    // the CPU waits for room when it reaches limit, which stays at ~0
+    // unless a drain is running.
+    uint64_t next;
+    uint64_t limit;
+    atomic<uint64_t> head; // next, published to the reader
+    atomic<uint64_t> tail; // oldest record not yet read
+
+    thread drain;
+    atomic<bool> stopping;
+    TraceWriter * writer;
+
+    uint64_t cleared;     // position at the last clear()
+    uint64_t overwritten; // counted once the reader skips past them
+
+    void make_room();
+    void skip_overwritten();
+    void drain_loop();
+
+public:
+    TraceBuffer(size_t capacity = TRACE_DEFAULT_RECORDS);
+    ~TraceBuffer();
+
+    // the CPU holds a pointer to it
+    TraceBuffer(const TraceBuffer & other) = delete;
+    TraceBuffer & operator=(const TraceBuffer & other) = delete;
+
+    inline void record(uint64_t cycle, uint16_t PC, uint8_t opcode, uint8_t operand_low, uint8_t operand_high,
+                       uint8_t A, uint8_t X, uint8_t Y, uint8_t SP, uint8_t status)
+    {
+        uint64_t position = next;
+        if(position == limit)
+        {
+            make_room();
+        }
+        TraceRecord & entry = records[position & mask];
+        entry.cycle = cycle;
+        entry.PC = PC;
+        entry.opcode = opcode;
+        entry.operand[0] = operand_low;
+        entry.operand[1] = operand_high;
+        entry.A = A;
+        entry.X = X;
+        entry.Y = Y;
+        entry.SP = SP;
+        entry.status = status;
+        next = position + 1;
+        head.store(next, memory_order_release);
+    }
+
+    size_t get_capacity();
+    size_t size();            // records held and not yet read
+    uint64_t get_recorded();  // records taken since the last clear()
+    uint64_t get_overwritten(); // replaced before anyone read them
+
+    // None of the calls below may overlap with the CPU running.
+
+    // moves up to max of the oldest held records into out; not while a
+    // drain is running
+    size_t read(TraceRecord * out, size_t max);
+    void clear(); // not while a drain is running
+    // writes every record from now on, held ones first, to a trace file;
+    // false if it cannot be created
+    bool start_drain(string filename);
+    // writes whatever is left and closes the file; false if a write failed
+    bool stop_drain();
+    bool is_draining();
+};
+
+#endif
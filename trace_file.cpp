@@ -0,0 +1,765 @@
+#include "trace_file.h"
+#include "disassembler.h"
+#include <algorithm>
+#include <string.h>
+
+#define TRACE_FILE_HEADER 16   // magic, version, records per block
+#define TRACE_INDEX_ENTRY 24
+#define TRACE_TRAILER 32
+#define TRACE_RECORD_MAX 20    // longest delta encoded record
+
+// delta record tag: what follows it, and the cycle delta in the low bits
+#define TAG_PC 0x80            // PC, when not the instruction after the last
+#define TAG_CODE 0x40          // opcode and operand bytes
+#define TAG_REGS 0x20          // mask of changed registers, then their values
+#define TAG_CYCLES 0x1F
+#define CYCLES_ABSOLUTE 0x1F   // cycle count follows in full
+
+#define REG_A 0x01
+#define REG_X 0x02
+#define REG_Y 0x04
+#define REG_SP 0x08
+#define REG_P 0x10
+
+#define CODE_SEEN 0x1000000    // marks an entry in the code table as set
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_RUN_MASK 0x0F       // lengths of 15 and up carry extra bytes
+
+static void put_le(uint8_t * out, uint64_t value, int bytes)
+{
+    for(int i = 0; i < bytes; i++)
+    {
+        out[i] = (value >> (8 * i)) & 0xFF;
+    }
+}
+
+static uint64_t get_le(const uint8_t * in, int bytes)
+{
+    uint64_t value = 0;
+    for(int i = 0; i < bytes; i++)
+    {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+static bool seek_to(FILE * file, uint64_t offset)
+{
+#if defined(_WIN32)
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+static uint64_t file_size(FILE * file)
+{
+#if defined(_WIN32)
+    return (_fseeki64(file, 0, SEEK_END) == 0) ? _ftelli64(file) : 0;
+#else
+    return (fseeko(file, 0, SEEK_END) == 0) ? ftello(file) : 0;
+#endif
+}
+
+static bool same_record(const TraceRecord & a, const TraceRecord & b)
+{
+    return a.cycle == b.cycle && a.PC == b.PC && a.opcode == b.opcode &&
+           a.operand[0] == b.operand[0] && a.operand[1] == b.operand[1] &&
+           a.A == b.A && a.X == b.X && a.Y == b.Y && a.SP == b.SP && a.status == b.status;
+}
+
+static void put_length(vector<uint8_t> & out, size_t length)
+{
+    for(; length >= 0xFF; length -= 0xFF)
+    {
+        out.push_back(0xFF);
+    }
+    out.push_back(length);
+}
+
+// LZ77 with the sequence layout of LZ4: a token holding the literal and
+// match lengths, longer lengths continued in extra bytes, the literals,
+// then a 16-bit match offset. The last sequence has literals only.
+static void lz_compress(const vector<uint8_t> & in, vector<uint8_t> & out)
+{
+    out.clear();
+    vector<uint32_t> table(1 << LZ_HASH_BITS, 0); // position + 1, 0 if none
+    size_t size = in.size();
+    size_t anchor = 0;
+    size_t i = 0;
+    while(i + LZ_MIN_MATCH <= size)
+    {
+        uint32_t word;
+        memcpy(&word, &in[i], sizeof(word));
+        uint32_t hash = (word * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[hash];
+        table[hash] = i + 1;
+        if(candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET || memcmp(&in[candidate - 1], &in[i], LZ_MIN_MATCH) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while(i + length < size && in[match + length] == in[i + length])
+        {
+            length++;
+        }
+        size_t literals = i - anchor;
+        size_t extra = length - LZ_MIN_MATCH;
+        out.push_back((min(literals, (size_t)LZ_RUN_MASK) << 4) | min(extra, (size_t)LZ_RUN_MASK));
+        if(literals >= LZ_RUN_MASK)
+        {
+            put_length(out, literals - LZ_RUN_MASK);
+        }
+        out.insert(out.end(), in.begin() + anchor, in.begin() + i);
+        out.push_back((i - match) & 0xFF);
+        out.push_back((i - match) >> 8);
+        if(extra >= LZ_RUN_MASK)
+        {
+            put_length(out, extra - LZ_RUN_MASK);
+        }
+        i += length;
+        anchor = i;
+    }
+
+    if(anchor < size)
+    {
+        size_t literals = size - anchor;
+        out.push_back(min(literals, (size_t)LZ_RUN_MASK) << 4);
+        if(literals >= LZ_RUN_MASK)
+        {
+            put_length(out, literals - LZ_RUN_MASK);
+        }
+        out.insert(out.end(), in.begin() + anchor, in.end());
+    }
+}
+
+static bool get_length(const uint8_t * & in, const uint8_t * end, size_t & length)
+{
+    uint8_t byte;
+    do
+    {
+        if(in == end)
+        {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while(byte == 0xFF);
+    return true;
+}
+
+// false unless the input decodes to exactly size bytes
+static bool lz_decompress(const uint8_t * in, size_t in_size, uint8_t * out, size_t size)
+{
+    const uint8_t * end = in + in_size;
+    size_t used = 0;
+    while(in < end)
+    {
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if(literals == LZ_RUN_MASK && !get_length(in, end, literals))
+        {
+            return false;
+        }
+        if(literals > (size_t)(end - in) || literals > size - used)
+        {
+            return false;
+        }
+        memcpy(out + used, in, literals);
+        in += literals;
+        used += literals;
+        if(in == end)
+        {
+            break;
+        }
+
+        if(end - in < 2)
+        {
+            return false;
+        }
+        size_t distance = in[0] | in[1] << 8;
+        in += 2;
+        size_t length = token & LZ_RUN_MASK;
+        if(length == LZ_RUN_MASK && !get_length(in, end, length))
+        {
+            return false;
+        }
+        length += LZ_MIN_MATCH;
+        if(distance == 0 || distance > used || length > size - used)
+        {
+            return false;
+        }
+        // byte by byte, since a match may overlap its own output
+        for(size_t k = 0; k < length; k++, used++)
+        {
+            out[used] = out[used - distance];
+        }
+    }
+    return used == size;
+}
+
+// Undoes TraceWriter::write() for one block. raw carries TRACE_RECORD_MAX
+// bytes of padding, so a record is only checked against the end once it
+// has been read.
+static bool decode_block(const vector<uint8_t> & raw, size_t size, uint32_t count, vector<TraceRecord> & records)
+{
+    records.resize(count);
+    vector<uint32_t> code(MEMORY_SIZE, 0);
+    TraceRecord previous = TraceRecord();
+    const uint8_t * in = raw.data();
+    const uint8_t * end = in + size;
+    for(uint32_t r = 0; r < count; r++)
+    {
+        TraceRecord & record = records[r];
+        uint8_t tag = *in++;
+        if(tag & TAG_PC)
+        {
+            record.PC = in[0] | in[1] << 8;
+            in += 2;
+        }
+        else if(r > 0)
+        {
+            record.PC = previous.PC + Disassembler::length(previous.opcode);
+        }
+        else
+        {
+            return false;
+        }
+
+        if(tag & TAG_CODE)
+        {
+            uint8_t length = Disassembler::length(*in);
+            record.opcode = *in++;
+            record.operand[0] = (length > 1) ? *in++ : 0;
+            record.operand[1] = (length > 2) ? *in++ : 0;
+            code[record.PC] = CODE_SEEN | record.opcode | record.operand[0] << 8 | record.operand[1] << 16;
+        }
+        else if(code[record.PC] != 0)
+        {
+            record.opcode = code[record.PC] & 0xFF;
+            record.operand[0] = (code[record.PC] >> 8) & 0xFF;
+            record.operand[1] = (code[record.PC] >> 16) & 0xFF;
+        }
+        else
+        {
+            return false;
+        }
+
+        uint8_t mask = (tag & TAG_REGS) ? *in++ : 0;
+        record.A = (mask & REG_A) ? *in++ : previous.A;
+        record.X = (mask & REG_X) ? *in++ : previous.X;
+        record.Y = (mask & REG_Y) ? *in++ : previous.Y;
+        record.SP = (mask & REG_SP) ? *in++ : previous.SP;
+        record.status = (mask & REG_P) ? *in++ : previous.status;
+
+        if((tag & TAG_CYCLES) == CYCLES_ABSOLUTE)
+        {
+            record.cycle = get_le(in, 8);
+            in += 8;
+        }
+        else if(r > 0)
+        {
+            record.cycle = previous.cycle + (tag & TAG_CYCLES);
+        }
+        else
+        {
+            return false;
+        }
+
+        if(in > end)
+        {
+            return false;
+        }
+        previous = record;
+    }
+    return in == end;
+}
+
+// Checks the magic and that the sizes fit together. LZ output never grows
+// by more than a length byte per 255 literals.
+static bool block_header(const uint8_t * header, uint32_t & compressed_size, uint32_t & count)
+{
+    compressed_size = get_le(header + 4, 4);
+    uint32_t raw_size = get_le(header + 8, 4);
+    count = get_le(header + 12, 4);
+    return memcmp(header, TRACE_BLOCK_MAGIC, 4) == 0 && count > 0 && count <= raw_size &&
+           raw_size <= (uint64_t)count * TRACE_RECORD_MAX && compressed_size <= raw_size + raw_size / 0xFF + 16;
+}
+
+TraceWriter::TraceWriter()
+    : file(NULL), block_records(TRACE_BLOCK_RECORDS), records(0), offset(0), failed(false),
+      block_count(0), block_cycle(0), previous(TraceRecord()), code(MEMORY_SIZE, 0)
+{
+}
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+bool TraceWriter::open(string filename, uint32_t block_records)
+{
+    close();
+    file = fopen(filename.c_str(), "wb");
+    if(file == NULL)
+    {
+        return false;
+    }
+    this->block_records = (block_records > 0) ? block_records : 1;
+    records = 0;
+    block_count = 0;
+    index.clear();
+    raw.clear();
+
+    uint8_t header[TRACE_FILE_HEADER];
+    memcpy(header, TRACE_FILE_MAGIC, 8);
+    put_le(header + 8, TRACE_FILE_VERSION, 4);
+    put_le(header + 12, this->block_records, 4);
+    failed = fwrite(header, 1, sizeof(header), file) != sizeof(header);
+    offset = sizeof(header);
+    return true;
+}
+
+void TraceWriter::write(const TraceRecord & record)
+{
+    if(file == NULL)
+    {
+        return;
+    }
+    if(block_count == 0)
+    {
+        block_cycle = record.cycle;
+        previous = TraceRecord();
+        fill(code.begin(), code.end(), 0);
+    }
+
+    size_t tag_at = raw.size();
+    raw.push_back(0);
+    uint8_t tag = 0;
+
+    uint16_t expected = previous.PC + Disassembler::length(previous.opcode);
+    if(block_count == 0 || record.PC != expected)
+    {
+        tag |= TAG_PC;
+        raw.push_back(record.PC & 0xFF);
+        raw.push_back(record.PC >> 8);
+    }
+
+    uint32_t bytes = CODE_SEEN | record.opcode | record.operand[0] << 8 | record.operand[1] << 16;
+    if(code[record.PC] != bytes)
+    {
+        uint8_t length = Disassembler::length(record.opcode);
+        tag |= TAG_CODE;
+        code[record.PC] = bytes;
+        raw.push_back(record.opcode);
+        raw.insert(raw.end(), record.operand, record.operand + length - 1);
+    }
+
+    uint8_t values[5] = {record.A, record.X, record.Y, record.SP, record.status};
+    uint8_t old[5] = {previous.A, previous.X, previous.Y, previous.SP, previous.status};
+    uint8_t mask = 0;
+    for(int i = 0; i < 5; i++)
+    {
+        mask |= (values[i] != old[i]) << i;
+    }
+    if(mask != 0)
+    {
+        tag |= TAG_REGS;
+        raw.push_back(mask);
+        for(int i = 0; i < 5; i++)
+        {
+            if(mask & (1 << i))
+            {
+                raw.push_back(values[i]);
+            }
+        }
+    }
+
+    if(block_count > 0 && record.cycle >= previous.cycle && record.cycle - previous.cycle < CYCLES_ABSOLUTE)
+    {
+        tag |= record.cycle - previous.cycle;
+    }
+    else
+    {
+        tag |= CYCLES_ABSOLUTE;
+        raw.resize(raw.size() + 8);
+        put_le(&raw[raw.size() - 8], record.cycle, 8);
+    }
+
+    raw[tag_at] = tag;
+    previous = record;
+    records++;
+    if(++block_count == block_records)
+    {
+        flush_block();
+    }
+}
+
+void TraceWriter::write(const TraceRecord * records, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        write(records[i]);
+    }
+}
+
+void TraceWriter::flush_block()
+{
+    if(block_count == 0)
+    {
+        return;
+    }
+    lz_compress(raw, compressed);
+
+    uint8_t header[TRACE_BLOCK_HEADER];
+    memcpy(header, TRACE_BLOCK_MAGIC, 4);
+    put_le(header + 4, compressed.size(), 4);
+    put_le(header + 8, raw.size(), 4);
+    put_le(header + 12, block_count, 4);
+    put_le(header + 16, block_cycle, 8);
+    if(fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+       fwrite(compressed.data(), 1, compressed.size(), file) != compressed.size())
+    {
+        failed = true;
+    }
+
+    index.push_back(offset);
+    index.push_back(records - block_count);
+    index.push_back(block_cycle);
+    offset += sizeof(header) + compressed.size();
+    raw.clear();
+    block_count = 0;
+}
+
+bool TraceWriter::close()
+{
+    if(file == NULL)
+    {
+        return !failed;
+    }
+    flush_block();
+
+    vector<uint8_t> tail(index.size() * 8 + TRACE_TRAILER);
+    for(size_t i = 0; i < index.size(); i++)
+    {
+        put_le(&tail[i * 8], index[i], 8);
+    }
+    uint8_t * trailer = &tail[index.size() * 8];
+    put_le(trailer, offset, 8);
+    put_le(trailer + 8, index.size() / 3, 8);
+    put_le(trailer + 16, records, 8);
+    memcpy(trailer + 24, TRACE_INDEX_MAGIC, 8);
+    if(fwrite(tail.data(), 1, tail.size(), file) != tail.size())
+    {
+        failed = true;
+    }
+    if(fclose(file) != 0)
+    {
+        failed = true;
+    }
+    file = NULL;
+    return !failed;
+}
+
+bool TraceWriter::is_open()
+{
+    return file != NULL;
+}
+
+uint64_t TraceWriter::size()
+{
+    return records;
+}
+
+TraceReader::TraceReader()
+    : file(NULL), records(0), loaded(-1), position(0)
+{
+}
+
+TraceReader::~TraceReader()
+{
+    close();
+}
+
+bool TraceReader::open(string filename)
+{
+    close();
+    file = fopen(filename.c_str(), "rb");
+    if(file == NULL)
+    {
+        return false;
+    }
+
+    uint8_t header[TRACE_FILE_HEADER];
+    if(fread(header, 1, sizeof(header), file) != sizeof(header) ||
+       memcmp(header, TRACE_FILE_MAGIC, 8) != 0 || get_le(header + 8, 4) != TRACE_FILE_VERSION ||
+       !(read_index() || scan_blocks(TRACE_FILE_HEADER)))
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void TraceReader::close()
+{
+    if(file != NULL)
+    {
+        fclose(file);
+        file = NULL;
+    }
+    records = 0;
+    blocks.clear();
+    loaded = -1;
+    position = 0;
+}
+
+bool TraceReader::is_open()
+{
+    return file != NULL;
+}
+
+// Reads the index the trailer points to; false if the file does not end
+// in a trailer that fits it.
+bool TraceReader::read_index()
+{
+    uint64_t size = file_size(file);
+    uint8_t trailer[TRACE_TRAILER];
+    if(size < TRACE_FILE_HEADER + TRACE_TRAILER || !seek_to(file, size - TRACE_TRAILER) ||
+       fread(trailer, 1, sizeof(trailer), file) != sizeof(trailer) ||
+       memcmp(trailer + 24, TRACE_INDEX_MAGIC, 8) != 0)
+    {
+        return false;
+    }
+    uint64_t index_offset = get_le(trailer, 8);
+    uint64_t count = get_le(trailer + 8, 8);
+    if(index_offset < TRACE_FILE_HEADER || index_offset > size - TRACE_TRAILER ||
+       count != (size - TRACE_TRAILER - index_offset) / TRACE_INDEX_ENTRY ||
+       count * TRACE_INDEX_ENTRY != size - TRACE_TRAILER - index_offset)
+    {
+        return false;
+    }
+
+    vector<uint8_t> entries(count * TRACE_INDEX_ENTRY);
+    if(!seek_to(file, index_offset) || fread(entries.data(), 1, entries.size(), file) != entries.size())
+    {
+        return false;
+    }
+    blocks.resize(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        blocks[i].offset = get_le(&entries[i * TRACE_INDEX_ENTRY], 8);
+        blocks[i].first = get_le(&entries[i * TRACE_INDEX_ENTRY + 8], 8);
+        blocks[i].first_cycle = get_le(&entries[i * TRACE_INDEX_ENTRY + 16], 8);
+    }
+    records = get_le(trailer + 16, 8);
+    return true;
+}
+
+// Rebuilds the index from the block headers, stopping at the first block
+// that is cut short.
+bool TraceReader::scan_blocks(uint64_t start)
+{
+    uint64_t size = file_size(file);
+    blocks.clear();
+    records = 0;
+    uint64_t offset = start;
+    uint8_t header[TRACE_BLOCK_HEADER];
+    uint32_t compressed_size;
+    uint32_t count;
+    while(offset + TRACE_BLOCK_HEADER <= size && seek_to(file, offset) &&
+          fread(header, 1, sizeof(header), file) == sizeof(header) &&
+          block_header(header, compressed_size, count))
+    {
+        uint64_t end = offset + TRACE_BLOCK_HEADER + compressed_size;
+        if(end > size)
+        {
+            break;
+        }
+        Block block;
+        block.offset = offset;
+        block.first = records;
+        block.first_cycle = get_le(header + 16, 8);
+        blocks.push_back(block);
+        records += count;
+        offset = end;
+    }
+    return true;
+}
+
+// Reads a block's compressed bytes and, if decode is set, unpacks its
+// records into decoded.
+bool TraceReader::read_block(size_t block, bool decode)
+{
+    uint8_t header[TRACE_BLOCK_HEADER];
+    if(!seek_to(file, blocks[block].offset) || fread(header, 1, sizeof(header), file) != sizeof(header))
+    {
+        return false;
+    }
+    uint32_t compressed_size;
+    uint32_t count;
+    if(!block_header(header, compressed_size, count))
+    {
+        return false;
+    }
+    uint32_t raw_size = get_le(header + 8, 4);
+    compressed.resize(compressed_size);
+    if(fread(compressed.data(), 1, compressed_size, file) != compressed_size)
+    {
+        return false;
+    }
+    if(!decode)
+    {
+        return true;
+    }
+
+    loaded = -1;
+    raw.assign(raw_size + TRACE_RECORD_MAX, 0);
+    if(!lz_decompress(compressed.data(), compressed_size, raw.data(), raw_size) ||
+       !decode_block(raw, raw_size, count, decoded))
+    {
+        return false;
+    }
+    loaded = block;
+    return true;
+}
+
+size_t TraceReader::block_of(uint64_t index)
+{
+    if(loaded >= 0 && index >= blocks[loaded].first && index < blocks[loaded].first + decoded.size())
+    {
+        return loaded;
+    }
+    size_t low = 0;
+    size_t high = blocks.size();
+    while(high - low > 1)
+    {
+        size_t middle = (low + high) / 2;
+        if(blocks[middle].first <= index)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+uint64_t TraceReader::size()
+{
+    return records;
+}
+
+uint64_t TraceReader::tell()
+{
+    return position;
+}
+
+bool TraceReader::seek(uint64_t index)
+{
+    if(file == NULL || index > records)
+    {
+        return false;
+    }
+    position = index;
+    return true;
+}
+
+bool TraceReader::seek_cycle(uint64_t cycle)
+{
+    if(file == NULL || blocks.empty())
+    {
+        return false;
+    }
+    // last block starting at or before cycle
+    size_t block = 0;
+    size_t high = blocks.size();
+    while(high - block > 1)
+    {
+        size_t middle = (block + high) / 2;
+        if(blocks[middle].first_cycle <= cycle)
+        {
+            block = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if((int64_t)block != loaded && !read_block(block, true))
+    {
+        return false;
+    }
+    for(size_t i = 0; i < decoded.size(); i++)
+    {
+        if(decoded[i].cycle >= cycle)
+        {
+            position = blocks[block].first + i;
+            return true;
+        }
+    }
+    position = blocks[block].first + decoded.size();
+    return position < records;
+}
+
+bool TraceReader::next(TraceRecord & record)
+{
+    if(file == NULL || position >= records)
+    {
+        return false;
+    }
+    size_t block = block_of(position);
+    if((int64_t)block != loaded && !read_block(block, true))
+    {
+        return false;
+    }
+    uint64_t offset = position - blocks[block].first;
+    if(offset >= decoded.size())
+    {
+        return false;
+    }
+    record = decoded[offset];
+    position++;
+    return true;
+}
+
+uint64_t TraceReader::first_difference(TraceReader & other)
+{
+    uint64_t limit = min(records, other.records);
+    uint64_t index = 0;
+    while(index < limit)
+    {
+        size_t block = block_of(index);
+        size_t other_block = other.block_of(index);
+        uint64_t end = (block + 1 < blocks.size()) ? blocks[block + 1].first : records;
+        uint64_t other_end = (other_block + 1 < other.blocks.size()) ? other.blocks[other_block + 1].first : other.records;
+        if(blocks[block].first == index && other.blocks[other_block].first == index && end == other_end &&
+           read_block(block, false) && other.read_block(other_block, false) && compressed == other.compressed)
+        {
+            index = end;
+            continue;
+        }
+
+        end = min(min(end, other_end), limit);
+        seek(index);
+        other.seek(index);
+        for(; index < end; index++)
+        {
+            TraceRecord mine;
+            TraceRecord theirs;
+            if(!next(mine) || !other.next(theirs) || !same_record(mine, theirs))
+            {
+                return index;
+            }
+        }
+    }
+    return limit;
+}
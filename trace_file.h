@@ -0,0 +1,127 @@
+#ifndef TRACE_FILE_H
+#define TRACE_FILE_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "trace.h"
+using namespace std;
+
+#define TRACE_FILE_MAGIC "M6502TRZ"
+#define TRACE_INDEX_MAGIC "M6502IDX"
+#define TRACE_BLOCK_MAGIC "TBLK"
+#define TRACE_FILE_VERSION 1
+#define TRACE_BLOCK_RECORDS 0x10000 // records per compressed block
+#define TRACE_BLOCK_HEADER 24       // magic, compressed, raw and record counts, first cycle
+
+// Trace file layout, all little-endian:
+//
+//   magic, version (4), records per block (4)
+//   blocks: block magic, compressed size (4), raw size (4), records (4),
+//           first cycle (8), compressed bytes
+//   index:  per block its file offset, first record and first cycle (8 each)
+//   trailer: index offset (8), block count (8), records (8), index magic
+//
+// Each block is delta encoded and then LZ compressed on its own, so any
+// block can be decoded without the ones before it. A record costs one tag
+// byte when it only moves the PC on to the next instruction; the PC after
+// a jump, the instruction bytes the first time they are seen at a PC in
+// the block, changed registers and unusual cycle deltas follow the tag.
+// Files whose trailer is missing, e.g. from a run that was killed, are
+// indexed again from the block headers when opened.
+
+class TraceWriter
+{
+private:
+    FILE * file;
+    uint32_t block_records;
+    uint64_t records;
+    uint64_t offset; // bytes written so far
+    bool failed;
+
+    // block being filled, delta encoded against previous; code holds the
+    // instruction bytes last seen at each PC, 0 if none yet
+    vector<uint8_t> raw;
+    uint32_t block_count;
+    uint64_t block_cycle;
+    TraceRecord previous;
+    vector<uint32_t> code;
+
+    vector<uint8_t> compressed;
+    vector<uint64_t> index; // offset, first record, first cycle per block
+
+    void flush_block();
+
+public:
+    TraceWriter();
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter & other) = delete;
+    TraceWriter & operator=(const TraceWriter & other) = delete;
+
+    // replaces any existing file; false if it cannot be created
+    bool open(string filename, uint32_t block_records = TRACE_BLOCK_RECORDS);
+    void write(const TraceRecord & record);
+    void write(const TraceRecord * records, size_t count);
+    // writes the last block and the index; false if any write failed
+    bool close();
+    bool is_open();
+    uint64_t size(); // records written
+};
+
+// Random access to a trace file. Only the block holding the current
+// record is kept decoded.
+class TraceReader
+{
+private:
+    struct Block {
+        uint64_t offset;
+        uint64_t first;       // index of its first record
+        uint64_t first_cycle;
+    };
+
+    FILE * file;
+    uint64_t records;
+    vector<Block> blocks;
+
+    int64_t loaded; // block in decoded, -1 if none
+    vector<TraceRecord> decoded;
+    vector<uint8_t> compressed;
+    vector<uint8_t> raw;
+    uint64_t position;
+
+    bool read_index();
+    bool scan_blocks(uint64_t start);
+    bool read_block(size_t block, bool decode);
+    size_t block_of(uint64_t index);
+
+public:
+    TraceReader();
+    ~TraceReader();
+
+    TraceReader(const TraceReader & other) = delete;
+    TraceReader & operator=(const TraceReader & other) = delete;
+
+    // false if the file is missing or not a trace
+    bool open(string filename);
+    void close();
+    bool is_open();
+
+    uint64_t size(); // records in the file
+    uint64_t tell(); // index of the record next() returns
+    // false past the end, or if the block there is damaged
+    bool seek(uint64_t index);
+    // goes to the first record at or after cycle; cycles must not go
+    // backwards within the trace, e.g. through restore()
+    bool seek_cycle(uint64_t cycle);
+    bool next(TraceRecord & record);
+
+    // index of the first record that differs between the two traces, or
+    // the shorter one's size if one is a prefix of the other; blocks whose
+    // compressed bytes match are skipped without decoding
+    uint64_t first_difference(TraceReader & other);
+};
+
+#endif
@@ -0,0 +1,172 @@
+#include "trace_file.h"
+#include "disassembler.h"
+
+// Command-line access to trace files written by TraceWriter or a
+// TraceBuffer drain.
+//
+//   trace_tool info FILE
+//   trace_tool dump FILE [FIRST [COUNT]]        records from index FIRST
+//   trace_tool dump-cycle FILE CYCLE [COUNT]    records from cycle CYCLE
+//   trace_tool diff FILE1 FILE2 [CONTEXT]       first divergence
+
+#define DUMP_DEFAULT_COUNT 20
+#define DIFF_DEFAULT_CONTEXT 3
+
+static void usage()
+{
+    cerr << "usage: trace_tool info FILE" << endl
+         << "       trace_tool dump FILE [FIRST [COUNT]]" << endl
+         << "       trace_tool dump-cycle FILE CYCLE [COUNT]" << endl
+         << "       trace_tool diff FILE1 FILE2 [CONTEXT]" << endl;
+}
+
+static uint64_t number(const char * text)
+{
+    return strtoull(text, NULL, 0);
+}
+
+static void print_record(const char * prefix, uint64_t index, const TraceRecord & record)
+{
+    uint8_t length = Disassembler::length(record.opcode);
+    uint8_t bytes[3] = {record.opcode, record.operand[0], record.operand[1]};
+    char hex[9] = "";
+    for(uint8_t i = 0; i < length; i++)
+    {
+        snprintf(hex + 3 * i, sizeof(hex) - 3 * i, "%02X ", bytes[i]);
+    }
+    printf("%s%10llu %12llu  %04X  %-9s %-13s A:%02X X:%02X Y:%02X P:%02X SP:%02X\n", prefix,
+           (unsigned long long)index, (unsigned long long)record.cycle, record.PC, hex,
+           Disassembler::disassemble(bytes).c_str(), record.A, record.X, record.Y, record.status, record.SP);
+}
+
+static bool open_trace(TraceReader & reader, const char * filename)
+{
+    if(!reader.open(filename))
+    {
+        cerr << "Not a readable trace: " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+static int dump(TraceReader & reader, uint64_t count)
+{
+    TraceRecord record;
+    for(uint64_t i = 0; i < count; i++)
+    {
+        uint64_t index = reader.tell();
+        if(!reader.next(record))
+        {
+            break;
+        }
+        print_record("", index, record);
+    }
+    return 0;
+}
+
+static int diff(TraceReader & first, TraceReader & second, const char * first_name, const char * second_name, uint64_t context)
+{
+    uint64_t index = first.first_difference(second);
+    if(index == first.size() && index == second.size())
+    {
+        printf("traces match: %llu records\n", (unsigned long long)index);
+        return 0;
+    }
+    if(index == first.size() || index == second.size())
+    {
+        printf("%s ends after %llu records\n", (index == first.size()) ? first_name : second_name,
+               (unsigned long long)index);
+    }
+    else
+    {
+        printf("first difference at record %llu\n", (unsigned long long)index);
+    }
+
+    TraceRecord record;
+    first.seek((index > context) ? index - context : 0);
+    while(first.tell() < index && first.next(record))
+    {
+        print_record("  ", first.tell() - 1, record);
+    }
+    if(first.seek(index) && first.next(record))
+    {
+        print_record("< ", index, record);
+    }
+    if(second.seek(index) && second.next(record))
+    {
+        print_record("> ", index, record);
+    }
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    if(argc < 3)
+    {
+        usage();
+        return 2;
+    }
+    string command = argv[1];
+    TraceReader reader;
+
+    if(command == "info" && argc == 3)
+    {
+        if(!open_trace(reader, argv[2]))
+        {
+            return 2;
+        }
+        TraceRecord first;
+        TraceRecord last = TraceRecord();
+        bool any = reader.next(first);
+        if(any)
+        {
+            reader.seek(reader.size() - 1);
+            reader.next(last);
+        }
+        printf("records %llu\n", (unsigned long long)reader.size());
+        if(any)
+        {
+            printf("cycles  %llu - %llu\n", (unsigned long long)first.cycle, (unsigned long long)last.cycle);
+        }
+        return 0;
+    }
+    if(command == "dump" && argc >= 3 && argc <= 5)
+    {
+        if(!open_trace(reader, argv[2]))
+        {
+            return 2;
+        }
+        uint64_t start = (argc > 3) ? number(argv[3]) : 0;
+        if(!reader.seek(start))
+        {
+            cerr << "Only " << reader.size() << " records" << endl;
+            return 2;
+        }
+        return dump(reader, (argc > 4) ? number(argv[4]) : DUMP_DEFAULT_COUNT);
+    }
+    if(command == "dump-cycle" && argc >= 4 && argc <= 5)
+    {
+        if(!open_trace(reader, argv[2]))
+        {
+            return 2;
+        }
+        if(!reader.seek_cycle(number(argv[3])))
+        {
+            cerr << "No records at or after cycle " << argv[3] << endl;
+            return 2;
+        }
+        return dump(reader, (argc > 4) ? number(argv[4]) : DUMP_DEFAULT_COUNT);
+    }
+    if(command == "diff" && argc >= 4 && argc <= 5)
+    {
+        TraceReader other;
+        if(!open_trace(reader, argv[2]) || !open_trace(other, argv[3]))
+        {
+            return 2;
+        }
+        return diff(reader, other, argv[2], argv[3], (argc > 4) ? number(argv[4]) : DIFF_DEFAULT_CONTEXT);
+    }
+
+    usage();
+    return 2;
+}